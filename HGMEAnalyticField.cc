@@ -0,0 +1,240 @@
+// ElectroMagnetic Field for HGMEAnalyticField
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEAnalyticField.hh"
+#include "HGMEAnalyticShapes.hh"
+
+#include "TsParameterManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4SystemOfUnits.hh"
+
+#include <cfloat>
+#include <cmath>
+#include <locale>
+
+namespace {
+	G4String ToLower(G4String value) {
+		std::locale loc;
+		for (std::string::size_type j = 0; j < value.length(); j++)
+			value[j] = std::tolower(value[j],loc);
+		return value;
+	}
+
+	// Multipole evaluator of compile time order N, for N up to kMaxOrder
+	const G4int kMaxOrder = 8;
+
+	template <G4int N>
+	HGMEVAnalyticEvaluator* MakeMultipole(const G4double* normal, const G4double* skew) {
+		HGMEAnalyticShapes::Multipole<N> shape;
+		for (G4int n = 0; n < N; n++) {
+			shape.normal[n] = normal[n];
+			shape.skew[n] = skew[n];
+		}
+		return new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Multipole<N> >(shape);
+	}
+
+	HGMEVAnalyticEvaluator* MakeMultipole(G4int order, const G4double* normal, const G4double* skew) {
+		switch (order) {
+			case 1: return MakeMultipole<1>(normal, skew);
+			case 2: return MakeMultipole<2>(normal, skew);
+			case 3: return MakeMultipole<3>(normal, skew);
+			case 4: return MakeMultipole<4>(normal, skew);
+			case 5: return MakeMultipole<5>(normal, skew);
+			case 6: return MakeMultipole<6>(normal, skew);
+			case 7: return MakeMultipole<7>(normal, skew);
+			case 8: return MakeMultipole<8>(normal, skew);
+		}
+		return 0;
+	}
+}
+
+HGMEAnalyticField::HGMEAnalyticField(TsParameterManager* pM, TsGeometryManager* gM,
+									 TsVGeometryComponent* component):
+TsVElectroMagneticField(pM, gM, component), fEvaluator(0), fSlot(3) {
+	ResolveParameters();
+}
+
+HGMEAnalyticField::~HGMEAnalyticField() {
+	delete fEvaluator;
+}
+
+void HGMEAnalyticField::ResolveParameters() {
+	delete fEvaluator;
+	fEvaluator = 0;
+
+	G4String type = "electric";
+	if (fPm->ParameterExists(fComponent->GetFullParmName("AnalyticFieldType")))
+		type = ToLower(fPm->GetStringParameter(fComponent->GetFullParmName("AnalyticFieldType")));
+	if (type != "electric" && type != "magnetic")
+		Abort(fComponent->GetFullParmName("AnalyticFieldType") + " must be Electric or Magnetic.");
+	fSlot = type == "magnetic" ? 0 : 3;
+	const char* unit = type == "magnetic" ? "Magnetic flux density" : "electric field strength";
+
+	G4String shapeName = ToLower(fPm->GetStringParameter(fComponent->GetFullParmName("AnalyticFieldShape")));
+	G4String strengthName = fComponent->GetFullParmName("AnalyticFieldStrength");
+
+	if (shapeName == "uniform") {
+		G4double strength = fPm->GetDoubleParameter(strengthName, unit);
+		G4double direction[3] = {0., 0., 1.};
+		const char* directionNames[3] = {"AnalyticFieldDirectionX", "AnalyticFieldDirectionY", "AnalyticFieldDirectionZ"};
+		for (G4int axis = 0; axis < 3; axis++)
+			if (fPm->ParameterExists(fComponent->GetFullParmName(directionNames[axis])))
+				direction[axis] = fPm->GetUnitlessParameter(fComponent->GetFullParmName(directionNames[axis]));
+		G4double norm = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+		if (norm == 0.)
+			Abort("The AnalyticFieldDirection of " + fComponent->GetName() + " is zero.");
+
+		HGMEAnalyticShapes::Uniform shape;
+		for (G4int axis = 0; axis < 3; axis++)
+			shape.field[axis] = strength * direction[axis] / norm;
+		fEvaluator = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Uniform>(shape);
+	} else if (shapeName == "coaxial") {
+		G4double strength = fPm->GetDoubleParameter(strengthName, unit);
+		G4double innerRadius = GetLength("AnalyticFieldInnerRadius");
+		G4double outerRadius = GetLength("AnalyticFieldOuterRadius", DBL_MAX);
+		G4double referenceRadius = GetLength("AnalyticFieldReferenceRadius", innerRadius);
+		if (innerRadius <= 0. || outerRadius <= innerRadius)
+			Abort("The coaxial field of " + fComponent->GetName() + " needs 0 < AnalyticFieldInnerRadius < AnalyticFieldOuterRadius.");
+
+		// Radial for an electric field, azimuthal around a current for a magnetic one
+		if (fSlot == 3) {
+			HGMEAnalyticShapes::Coaxial<false> shape;
+			shape.strengthTimesRadius = strength * referenceRadius;
+			shape.innerRadius2 = innerRadius * innerRadius;
+			shape.outerRadius2 = outerRadius < DBL_MAX ? outerRadius * outerRadius : DBL_MAX;
+			fEvaluator = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Coaxial<false> >(shape);
+		} else {
+			HGMEAnalyticShapes::Coaxial<true> shape;
+			shape.strengthTimesRadius = strength * referenceRadius;
+			shape.innerRadius2 = innerRadius * innerRadius;
+			shape.outerRadius2 = outerRadius < DBL_MAX ? outerRadius * outerRadius : DBL_MAX;
+			fEvaluator = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Coaxial<true> >(shape);
+		}
+	} else if (shapeName == "parallelplate") {
+		HGMEAnalyticShapes::ParallelPlate shape;
+		shape.strength = fPm->GetDoubleParameter(strengthName, unit);
+		G4double gap = GetLength("AnalyticFieldGap");
+		shape.halfGap = 0.5 * gap;
+		shape.halfLength = 0.5 * GetLength("AnalyticFieldLength");
+		G4double fringe = GetLength("AnalyticFieldFringeLength", 0.5 * gap);
+		if (gap <= 0. || fringe <= 0.)
+			Abort("The parallel plate field of " + fComponent->GetName() + " needs positive AnalyticFieldGap and AnalyticFieldFringeLength.");
+		shape.inverseFringe = 1. / fringe;
+		fEvaluator = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::ParallelPlate>(shape);
+	} else if (shapeName == "quadrupole") {
+		HGMEAnalyticShapes::Quadrupole shape;
+		G4double referenceRadius = GetLength("AnalyticFieldReferenceRadius");
+		if (referenceRadius <= 0.)
+			Abort("The quadrupole field of " + fComponent->GetName() + " needs a positive AnalyticFieldReferenceRadius.");
+		shape.gradient = fPm->GetDoubleParameter(strengthName, unit) / referenceRadius;
+		fEvaluator = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Quadrupole>(shape);
+	} else if (shapeName == "multipole") {
+		G4double referenceRadius = GetLength("AnalyticFieldReferenceRadius");
+		G4String normalName = fComponent->GetFullParmName("AnalyticFieldNormalCoefficients");
+		G4String skewName = fComponent->GetFullParmName("AnalyticFieldSkewCoefficients");
+		G4int order = fPm->GetVectorLength(normalName);
+		if (order < 1 || order > kMaxOrder || referenceRadius <= 0.)
+			Abort("The multipole field of " + fComponent->GetName() + " needs 1 to 8 AnalyticFieldNormalCoefficients and a positive AnalyticFieldReferenceRadius.");
+
+		G4double* normal = fPm->GetDoubleVector(normalName, unit);
+		G4double skew[kMaxOrder] = {0., 0., 0., 0., 0., 0., 0., 0.};
+		if (fPm->ParameterExists(skewName)) {
+			if (fPm->GetVectorLength(skewName) != order)
+				Abort(skewName + " must have as many entries as AnalyticFieldNormalCoefficients.");
+			G4double* skewValues = fPm->GetDoubleVector(skewName, unit);
+			for (G4int n = 0; n < order; n++)
+				skew[n] = skewValues[n];
+			delete[] skewValues;
+		}
+
+		// Coefficients are given at the reference radius
+		G4double scale = 1.;
+		for (G4int n = 0; n < order; n++) {
+			normal[n] /= scale;
+			skew[n] /= scale;
+			scale *= referenceRadius;
+		}
+		fEvaluator = MakeMultipole(order, normal, skew);
+		delete[] normal;
+	} else if (shapeName == "solenoid") {
+		HGMEAnalyticShapes::Solenoid shape;
+		shape.halfStrength = 0.5 * fPm->GetDoubleParameter(strengthName, unit);
+		shape.halfLength = 0.5 * GetLength("AnalyticFieldLength");
+		G4double radius = GetLength("AnalyticFieldRadius");
+		if (radius <= 0.)
+			Abort("The solenoid field of " + fComponent->GetName() + " needs a positive AnalyticFieldRadius.");
+		shape.radius2 = radius * radius;
+		fEvaluator = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Solenoid>(shape);
+	} else {
+		Abort(fComponent->GetFullParmName("AnalyticFieldShape") +
+			  " must be Uniform, Coaxial, ParallelPlate, Quadrupole, Multipole or Solenoid.");
+	}
+
+	const G4RotationMatrix* rotM = fComponent->GetRotRelToWorld();
+	G4Point3D* transRelToWorld = GetComponent()->GetTransRelToWorld();
+	G4ThreeVector transl = G4ThreeVector(transRelToWorld->x(),transRelToWorld->y(),transRelToWorld->z());
+	fAffineTransf = G4AffineTransform(rotM,transl);
+	fToLocal = fAffineTransf.Inverse();
+	for (G4int j = 0; j < 3; j++) {
+		G4ThreeVector axis = fAffineTransf.TransformAxis(G4ThreeVector(j == 0, j == 1, j == 2));
+		fRotation[j] = axis.x();
+		fRotation[3 + j] = axis.y();
+		fRotation[6 + j] = axis.z();
+	}
+
+	TsVElectroMagneticField::ResolveParameters();
+}
+
+G4double HGMEAnalyticField::GetLength(const char* name, G4double defaultValue) {
+	G4String fullName = fComponent->GetFullParmName(name);
+	if (defaultValue >= 0. && !fPm->ParameterExists(fullName))
+		return defaultValue;
+	return fPm->GetDoubleParameter(fullName, "Length");
+}
+
+void HGMEAnalyticField::Abort(const G4String& message) {
+	G4cerr << "" << G4endl;
+	G4cerr << "Topas is exiting due to a serious error." << G4endl;
+	G4cerr << message << G4endl;
+	fPm->AbortSession(1);
+}
+
+void HGMEAnalyticField::GetFieldValue(const G4double Point[4], G4double* fieldBandE) const {
+	const G4ThreeVector localPoint = fToLocal.TransformPoint(G4ThreeVector(Point[0],Point[1],Point[2]));
+	const G4double local[3] = {localPoint.x(), localPoint.y(), localPoint.z()};
+	G4double field[3];
+	fEvaluator->Evaluate(local, field);
+
+	for (G4int c = 0; c < 6; c++)
+		fieldBandE[c] = 0.;
+	for (G4int i = 0; i < 3; i++)
+		fieldBandE[fSlot + i] = fRotation[3 * i] * field[0] + fRotation[3 * i + 1] * field[1] + fRotation[3 * i + 2] * field[2];
+}
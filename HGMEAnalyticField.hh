@@ -0,0 +1,71 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEAnalyticField_hh
+#define HGMEAnalyticField_hh
+
+#include "TsVElectroMagneticField.hh"
+
+#include "G4AffineTransform.hh"
+
+class HGMEVAnalyticEvaluator;
+
+// Electric or magnetic field of an analytic shape (see HGMEAnalyticShapes),
+// configured by the AnalyticField* parameters of the component. Needs no
+// table, the field is computed at every query.
+class HGMEAnalyticField : public TsVElectroMagneticField
+{
+public:
+	HGMEAnalyticField(TsParameterManager* pM, TsGeometryManager* gM,
+					  TsVGeometryComponent* component);
+	~HGMEAnalyticField();
+
+	void GetFieldValue(const G4double[4], G4double *fieldBandE) const;
+	void ResolveParameters();
+
+private:
+	G4double GetLength(const char* name, G4double defaultValue = -1.);
+	void Abort(const G4String& message);
+
+	HGMEVAnalyticEvaluator* fEvaluator;
+
+	// Slot of the first component in fieldBandE: 0 for B, 3 for E
+	G4int fSlot;
+
+	// Affine transformation to the world to resolve the position/rotation
+	// when a daughter is placed in a mother holding the field, and its inverse
+	G4AffineTransform fAffineTransf;
+	G4AffineTransform fToLocal;
+
+	// Rotation of the component, fRotation[3 * i + j] = R_ij, to carry
+	// fields to the world frame
+	G4double fRotation[9];
+};
+
+#endif
@@ -0,0 +1,176 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEAnalyticShapes_hh
+#define HGMEAnalyticShapes_hh
+
+#include "G4Types.hh"
+
+#include <cmath>
+
+// Analytic field shapes for HGMEAnalyticField.
+//
+// Each shape is a small functor giving the field at a point of the component
+// frame. They are header only so that HGMEAnalyticEvaluator<Shape> inlines
+// the shape into its single virtual call: a query costs a few flops and no
+// table memory. The uniform, coaxial, quadrupole and multipole shapes are
+// exact vacuum fields, electric or magnetic. The plate fringe and the
+// solenoid are first order expansions about the mid plane and the axis.
+namespace HGMEAnalyticShapes
+{
+	// Constant field
+	struct Uniform {
+		G4double field[3];
+
+		void operator()(const G4double[3], G4double f[3]) const {
+			f[0] = field[0];
+			f[1] = field[1];
+			f[2] = field[2];
+		}
+	};
+
+	// 1/r field about the z axis between two radii, zero elsewhere. Radial
+	// for a coaxial electrode pair, azimuthal around a line current.
+	template <G4bool Azimuthal>
+	struct Coaxial {
+		G4double strengthTimesRadius;
+		G4double innerRadius2;
+		G4double outerRadius2;
+
+		void operator()(const G4double p[3], G4double f[3]) const {
+			const G4double r2 = p[0] * p[0] + p[1] * p[1];
+			const G4double scale = r2 >= innerRadius2 && r2 <= outerRadius2 ? strengthTimesRadius / r2 : 0.;
+			f[0] = Azimuthal ? -scale * p[1] : scale * p[0];
+			f[1] = Azimuthal ?  scale * p[0] : scale * p[1];
+			f[2] = 0.;
+		}
+	};
+
+	// Field along y between plates at y = +-halfGap that end at x = +-halfLength.
+	// The fringe falls off as tanh over the fringe length, and the first order
+	// x component keeps the field curl free.
+	struct ParallelPlate {
+		G4double strength;
+		G4double halfLength;
+		G4double halfGap;
+		G4double inverseFringe;
+
+		void operator()(const G4double p[3], G4double f[3]) const {
+			if (std::fabs(p[1]) > halfGap) {
+				f[0] = 0.;
+				f[1] = 0.;
+				f[2] = 0.;
+				return;
+			}
+			const G4double a = std::tanh((p[0] + halfLength) * inverseFringe);
+			const G4double b = std::tanh((p[0] - halfLength) * inverseFringe);
+			f[0] = 0.5 * strength * inverseFringe * p[1] * (b * b - a * a);
+			f[1] = 0.5 * strength * (a - b);
+			f[2] = 0.;
+		}
+	};
+
+	// Normal quadrupole, F = (G y, G x, 0)
+	struct Quadrupole {
+		G4double gradient;
+
+		void operator()(const G4double p[3], G4double f[3]) const {
+			f[0] = gradient * p[1];
+			f[1] = gradient * p[0];
+			f[2] = 0.;
+		}
+	};
+
+	// Two dimensional multipole expansion of order N,
+	//   F_y + i F_x = sum_n (normal[n] + i skew[n]) (x + i y)^n,  n = 0 .. N-1
+	// with the coefficients already divided by the reference radius to the
+	// power n. Evaluated by complex Horner steps with fused multiply-adds.
+	template <G4int N>
+	struct Multipole {
+		G4double normal[N];
+		G4double skew[N];
+
+		void operator()(const G4double p[3], G4double f[3]) const {
+			G4double re = normal[N - 1];
+			G4double im = skew[N - 1];
+			for (G4int n = N - 2; n >= 0; n--) {
+				const G4double nextRe = std::fma(re, p[0], std::fma(-im, p[1], normal[n]));
+				im = std::fma(re, p[1], std::fma(im, p[0], skew[n]));
+				re = nextRe;
+			}
+			f[0] = im;
+			f[1] = re;
+			f[2] = 0.;
+		}
+	};
+
+	// Finite solenoid along z, centred on the origin, in the paraxial
+	// approximation: the on-axis field of a current sheet and the radial
+	// component -r/2 dFz/dz
+	struct Solenoid {
+		G4double halfStrength;
+		G4double halfLength;
+		G4double radius2;
+
+		void operator()(const G4double p[3], G4double f[3]) const {
+			const G4double u1 = p[2] + halfLength;
+			const G4double u2 = p[2] - halfLength;
+			const G4double s1 = 1. / std::sqrt(u1 * u1 + radius2);
+			const G4double s2 = 1. / std::sqrt(u2 * u2 + radius2);
+			const G4double slope = halfStrength * radius2 * (s1 * s1 * s1 - s2 * s2 * s2);
+			f[0] = -0.5 * slope * p[0];
+			f[1] = -0.5 * slope * p[1];
+			f[2] = halfStrength * (u1 * s1 - u2 * s2);
+		}
+	};
+}
+
+// Common interface of the evaluators, one virtual call per query
+class HGMEVAnalyticEvaluator
+{
+public:
+	virtual ~HGMEVAnalyticEvaluator() {}
+	virtual void Evaluate(const G4double point[3], G4double field[3]) const = 0;
+};
+
+template <class Shape>
+class HGMEAnalyticEvaluator : public HGMEVAnalyticEvaluator
+{
+public:
+	explicit HGMEAnalyticEvaluator(const Shape& shape): fShape(shape) {}
+
+	void Evaluate(const G4double point[3], G4double field[3]) const {
+		fShape(point, field);
+	}
+
+private:
+	Shape fShape;
+};
+
+#endif
@@ -0,0 +1,56 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMECountingStepper_hh
+#define HGMECountingStepper_hh
+
+#include "G4MagIntegratorStepper.hh"
+
+// Thin wrapper around any G4MagIntegratorStepper that counts how often the
+// driver asks it for a step. The wrapped stepper is owned and deleted here.
+class HGMECountingStepper : public G4MagIntegratorStepper
+{
+public:
+	HGMECountingStepper(G4MagIntegratorStepper* stepper);
+	~HGMECountingStepper();
+
+	void Stepper(const G4double y[], const G4double dydx[], G4double h,
+				 G4double yout[], G4double yerr[]);
+	G4double DistChord() const;
+	G4int IntegratorOrder() const;
+
+	// Number of Stepper calls since construction
+	G4long GetNumberOfCalls() const { return fCalls; }
+
+private:
+	G4MagIntegratorStepper* fStepper;
+	G4long fCalls;
+};
+
+#endif
@@ -0,0 +1,505 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMEDriftTable.hh"
+#include "HGMEFieldMapLoader.hh"
+#include "HGMETabulation.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4SystemOfUnits.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+namespace {
+	const char driftTableMagic[8] = {'H', 'G', 'M', 'E', 'D', 'T', '0', '1'};
+
+	// Steps shorter than this end the drift in a straight line
+	const G4double minimumStep = 1.e-6 * mm;
+
+	// Share of the position tolerance given to the integration of one line
+	const G4double integrationShare = 0.01;
+}
+
+HGMEDriftTable::HGMEDriftTable(const HGMEFieldRegions& field, const std::vector<G4double>& fields,
+							   const std::vector<G4double>& velocities, G4double minField):
+fField(field), fFields(fields), fVelocities(velocities), fMinField(minField), fReadoutAxis(-1), fReadoutPosition(0.),
+fMaxDeviation(0.) {
+	for (G4int axis = 0; axis < 2; axis++) {
+		fMin[axis] = field.GetMin()[axis];
+		fMax[axis] = field.GetMax()[axis];
+		fGrid.nodes[axis] = 0;
+		fGrid.min[axis] = 0.;
+		fGrid.max[axis] = 0.;
+	}
+	fTolerance.position = 0.01 * mm;
+	fTolerance.time = 1.e-3;
+}
+
+HGMEDriftTable::~HGMEDriftTable() {;}
+
+void HGMEDriftTable::SetReadout(G4int axis, G4double position) {
+	fReadoutAxis = axis;
+	fReadoutPosition = position;
+}
+
+G4bool HGMEDriftTable::IsBounded() const {
+	for (G4int axis = 0; axis < 2; axis++)
+		if (!(fMin[axis] > -0.5 * DBL_MAX && fMax[axis] < 0.5 * DBL_MAX && fMin[axis] < fMax[axis]))
+			return false;
+	return true;
+}
+
+G4double HGMEDriftTable::Velocity(G4double field) const {
+	if (field <= fFields.front())
+		return fVelocities.front();
+	if (field >= fFields.back())
+		return fVelocities.back();
+	const size_t upper = std::upper_bound(fFields.begin(), fFields.end(), field) - fFields.begin();
+	const G4double t = (field - fFields[upper - 1]) / (fFields[upper] - fFields[upper - 1]);
+	return fVelocities[upper - 1] + t * (fVelocities[upper] - fVelocities[upper - 1]);
+}
+
+// Drift line with the path length as the variable: y holds the position
+// and the drift time. Electrons move against the field.
+void HGMEDriftTable::Derivatives(const G4double y[4], G4double dyds[4], G4bool& stopped) const {
+	G4double e[3];
+	fField.Evaluate(y, e);
+	const G4double field = std::sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+	stopped = !(field > fMinField);
+	if (stopped)
+		return;
+	for (G4int i = 0; i < 3; i++)
+		dyds[i] = -e[i] / field;
+	dyds[3] = 1. / Velocity(field);
+}
+
+// Inside the box, and on the side of the readout plane given by its sign
+G4bool HGMEDriftTable::IsInside(const G4double position[3], G4double readoutSide) const {
+	for (G4int axis = 0; axis < 2; axis++)
+		if (position[axis] < fMin[axis] || position[axis] > fMax[axis])
+			return false;
+	return fReadoutAxis < 0 || (position[fReadoutAxis] - fReadoutPosition) * readoutSide > 0.;
+}
+
+G4bool HGMEDriftTable::Drift(const G4double start[3], Result& result) const {
+	return Integrate(start, result) >= 0;
+}
+
+// Step doubling controls the error of every step. A step that would leave
+// the box, cross the readout plane or reach a point without field is halved
+// until it is negligible, then the electron goes straight to the nearest
+// face or plane. If that is not within a few such steps, it has stopped.
+G4int HGMEDriftTable::Integrate(const G4double start[3], Result& result) const {
+	const G4double readoutSide = fReadoutAxis >= 0 && start[fReadoutAxis] < fReadoutPosition ? -1. : 1.;
+	if (!IsInside(start, readoutSide))
+		return -1;
+
+	G4double y[4] = {start[0], start[1], start[2], 0.};
+	const G4double diagonal = std::sqrt((fMax[0] - fMin[0]) * (fMax[0] - fMin[0]) + (fMax[1] - fMin[1]) * (fMax[1] - fMin[1]));
+	const G4double positionError = integrationShare * fTolerance.position;
+	HGMETabulation::Steps steps;
+	steps.maximum = diagonal / 100.;
+	steps.initial = steps.maximum / 10.;
+	steps.minimum = minimumStep;
+	steps.maxPath = 100. * diagonal;
+
+	G4double path;
+	const G4bool drifted = HGMETabulation::Integrate<4>(y, path, steps,
+		[this](const G4double* at, G4double* dyds) {
+			G4bool stopped;
+			Derivatives(at, dyds, stopped);
+			return !stopped;
+		},
+		[positionError](const G4double* full, const G4double* doubled) {
+			G4double error = 0.;
+			for (G4int i = 0; i < 3; i++)
+				error = std::max(error, std::abs(doubled[i] - full[i]) / positionError);
+			return error;
+		},
+		[this, readoutSide](const G4double* at) { return IsInside(at, readoutSide); },
+		[](const G4double*) { return true; });
+	if (!drifted)
+		return -1;
+
+	G4double direction[4];
+	G4bool stopped;
+	Derivatives(y, direction, stopped);
+	if (stopped)
+		return -1;
+
+	G4int face = -1;
+	G4double distance = DBL_MAX;
+	for (G4int axis = 0; axis < 2; axis++) {
+		if (direction[axis] == 0.)
+			continue;
+		const G4bool upper = direction[axis] > 0.;
+		const G4double d = ((upper ? fMax[axis] : fMin[axis]) - y[axis]) / direction[axis];
+		if (d < distance) {
+			distance = d;
+			face = 2 * axis + upper;
+		}
+	}
+	if (fReadoutAxis >= 0 && direction[fReadoutAxis] * readoutSide < 0.) {
+		const G4double d = (fReadoutPosition - y[fReadoutAxis]) / direction[fReadoutAxis];
+		if (d < distance) {
+			distance = d;
+			face = 4;
+		}
+	}
+	if (face < 0 || distance > 10. * minimumStep)
+		return -1;
+	distance = std::max(distance, 0.);
+
+	for (G4int i = 0; i < 3; i++)
+		result.end[i] = y[i] + distance * direction[i];
+	if (face < 4)
+		result.end[face / 2] = face % 2 ? fMax[face / 2] : fMin[face / 2];
+	else
+		result.end[fReadoutAxis] = fReadoutPosition;
+	result.time = y[3] + distance * direction[3];
+	result.pathLength = path + distance;
+	return face;
+}
+
+void HGMEDriftTable::Build(const Grid& grid, const Tolerance& tolerance, G4int threads) {
+	fGrid = grid;
+	fTolerance = tolerance;
+	const size_t nodes = (size_t)grid.nodes[0] * grid.nodes[1];
+	const size_t cells = (size_t)(grid.nodes[0] - 1) * (grid.nodes[1] - 1);
+	fEnds.assign(kValues * nodes, 0.);
+	fFaces.assign(nodes, -1);
+	fCellValid.assign(cells, 0);
+
+	HGMETabulation::ParallelFor(nodes, threads, [this](size_t node) {
+		const G4int i[2] = {G4int(node / fGrid.nodes[1]), G4int(node % fGrid.nodes[1])};
+		G4double start[3] = {0., 0., 0.};
+		for (G4int axis = 0; axis < 2; axis++)
+			start[axis] = fGrid.min[axis] + (fGrid.max[axis] - fGrid.min[axis]) * i[axis] / (fGrid.nodes[axis] - 1);
+		Result result;
+		const G4int face = Integrate(start, result);
+		if (face < 0)
+			return;
+		G4double* values = &fEnds[kValues * node];
+		values[0] = result.end[0];
+		values[1] = result.end[1];
+		values[2] = result.end[2] - start[2];
+		values[3] = result.time;
+		values[4] = result.pathLength;
+		fFaces[node] = face;
+	});
+
+	// Every cell is checked at its centre, where bilinear interpolation errs
+	// most
+	std::vector<G4double> deviation(cells, 0.);
+	HGMETabulation::ParallelFor(cells, threads, [this, &deviation](size_t index) {
+		const G4int cell[2] = {G4int(index / (fGrid.nodes[1] - 1)), G4int(index % (fGrid.nodes[1] - 1))};
+		const signed char face = fFaces[cell[0] * fGrid.nodes[1] + cell[1]];
+		if (face < 0)
+			return;
+		for (G4int corner = 1; corner < 4; corner++)
+			if (fFaces[(cell[0] + (corner >> 1)) * fGrid.nodes[1] + cell[1] + (corner & 1)] != face)
+				return;
+
+		const G4double local[2] = {0.5, 0.5};
+		G4double start[3] = {0., 0., 0.};
+		for (G4int axis = 0; axis < 2; axis++)
+			start[axis] = fGrid.min[axis] + (fGrid.max[axis] - fGrid.min[axis]) * (cell[axis] + 0.5) / (fGrid.nodes[axis] - 1);
+		Result drifted, interpolated;
+		if (Integrate(start, drifted) != face)
+			return;
+		Interpolate(cell, local, start, interpolated);
+
+		G4double position = 0.;
+		for (G4int i = 0; i < 3; i++)
+			position += (drifted.end[i] - interpolated.end[i]) * (drifted.end[i] - interpolated.end[i]);
+		position = std::sqrt(position);
+		const G4double time = std::abs(drifted.time - interpolated.time) / std::max(drifted.time, DBL_MIN);
+		if (position <= fTolerance.position && time <= fTolerance.time) {
+			fCellValid[index] = 1;
+			deviation[index] = position;
+		}
+	});
+	fMaxDeviation = deviation.empty() ? 0. : *std::max_element(deviation.begin(), deviation.end());
+}
+
+size_t HGMEDriftTable::GetNumberOfValidCells() const {
+	return std::count(fCellValid.begin(), fCellValid.end(), 1);
+}
+
+G4bool HGMEDriftTable::Locate(const G4double start[3], G4int cell[2], G4double local[2]) const {
+	for (G4int axis = 0; axis < 2; axis++) {
+		const G4double u = (start[axis] - fGrid.min[axis]) / (fGrid.max[axis] - fGrid.min[axis]) * (fGrid.nodes[axis] - 1);
+		if (!(u >= 0. && u <= fGrid.nodes[axis] - 1))
+			return false;
+		cell[axis] = std::min(G4int(u), fGrid.nodes[axis] - 2);
+		local[axis] = u - cell[axis];
+	}
+	return true;
+}
+
+// Bilinear in the stored values, with the end point put back on the face
+// the corners end on
+void HGMEDriftTable::Interpolate(const G4int cell[2], const G4double local[2], const G4double start[3], Result& result) const {
+	G4double sum[kValues] = {0., 0., 0., 0., 0.};
+	for (G4int corner = 0; corner < 4; corner++) {
+		const G4int i = cell[0] + (corner >> 1);
+		const G4int j = cell[1] + (corner & 1);
+		const G4double weight = ((corner >> 1) ? local[0] : 1. - local[0]) * ((corner & 1) ? local[1] : 1. - local[1]);
+		const G4double* values = &fEnds[kValues * (i * fGrid.nodes[1] + j)];
+		for (G4int v = 0; v < kValues; v++)
+			sum[v] += weight * values[v];
+	}
+	const signed char face = fFaces[cell[0] * fGrid.nodes[1] + cell[1]];
+	result.end[0] = sum[0];
+	result.end[1] = sum[1];
+	result.end[2] = start[2] + sum[2];
+	if (face < 4)
+		result.end[face / 2] = face % 2 ? fMax[face / 2] : fMin[face / 2];
+	else
+		result.end[fReadoutAxis] = fReadoutPosition;
+	result.time = sum[3];
+	result.pathLength = sum[4];
+}
+
+G4bool HGMEDriftTable::Lookup(const G4double start[3], Result& result) const {
+	G4int cell[2];
+	G4double local[2];
+	if (fCellValid.empty() || !Locate(start, cell, local) || !fCellValid[cell[0] * (fGrid.nodes[1] - 1) + cell[1]])
+		return false;
+	Interpolate(cell, local, start, result);
+	return true;
+}
+
+void HGMEDriftTable::Write(std::ostream& output, uint64_t key) const {
+	output.write(driftTableMagic, sizeof(driftTableMagic));
+	output.write(reinterpret_cast<const char*>(&key), sizeof(key));
+	for (G4int axis = 0; axis < 2; axis++) {
+		int32_t n = fGrid.nodes[axis];
+		output.write(reinterpret_cast<const char*>(&n), sizeof(n));
+	}
+	output.write(reinterpret_cast<const char*>(fGrid.min), sizeof(fGrid.min));
+	output.write(reinterpret_cast<const char*>(fGrid.max), sizeof(fGrid.max));
+	output.write(reinterpret_cast<const char*>(&fMaxDeviation), sizeof(fMaxDeviation));
+	output.write(reinterpret_cast<const char*>(fEnds.data()), fEnds.size() * sizeof(G4double));
+	output.write(reinterpret_cast<const char*>(fFaces.data()), fFaces.size());
+	output.write(fCellValid.data(), fCellValid.size());
+}
+
+G4bool HGMEDriftTable::Read(std::istream& input, uint64_t key) {
+	char magic[sizeof(driftTableMagic)];
+	uint64_t fileKey = 0;
+	input.read(magic, sizeof(magic));
+	input.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey));
+	if (!input || std::memcmp(magic, driftTableMagic, sizeof(magic)) != 0 || fileKey != key)
+		return false;
+
+	Grid grid;
+	for (G4int axis = 0; axis < 2; axis++) {
+		int32_t n = 0;
+		input.read(reinterpret_cast<char*>(&n), sizeof(n));
+		if (!input || n < 2 || n > 65535)
+			return false;
+		grid.nodes[axis] = n;
+	}
+	input.read(reinterpret_cast<char*>(grid.min), sizeof(grid.min));
+	input.read(reinterpret_cast<char*>(grid.max), sizeof(grid.max));
+	input.read(reinterpret_cast<char*>(&fMaxDeviation), sizeof(fMaxDeviation));
+	fGrid = grid;
+	const size_t nodes = (size_t)grid.nodes[0] * grid.nodes[1];
+	fEnds.resize(kValues * nodes);
+	fFaces.resize(nodes);
+	fCellValid.resize((size_t)(grid.nodes[0] - 1) * (grid.nodes[1] - 1));
+	input.read(reinterpret_cast<char*>(fEnds.data()), fEnds.size() * sizeof(G4double));
+	input.read(reinterpret_cast<char*>(fFaces.data()), fFaces.size());
+	input.read(fCellValid.data(), fCellValid.size());
+	if (!input) {
+		fCellValid.clear();
+		return false;
+	}
+	return true;
+}
+
+std::shared_ptr<const HGMEDriftTable> HGMEDriftTable::Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+																const HGMEFieldRegions& field) {
+	G4String name = component->GetFullParmName("DriftTable");
+	if (!pM->ParameterExists(name) || !pM->GetBooleanParameter(name))
+		return std::shared_ptr<const HGMEDriftTable>();
+
+	for (size_t r = 0; r < field.GetNumberOfRegions(); r++)
+		if (field.GetTable(r).GetNZ() != 1)
+			HGMETabulation::Abort(pM, name, "needs Z-invariant field maps, with one node along Z.");
+
+	// Drift velocity as a function of the field strength
+	const G4String fieldsName = component->GetFullParmName("DriftVelocityFields");
+	const G4String velocitiesName = component->GetFullParmName("DriftVelocities");
+	if (!pM->ParameterExists(fieldsName) || !pM->ParameterExists(velocitiesName))
+		HGMETabulation::Abort(pM, name, "needs DriftVelocityFields and DriftVelocities.");
+	const G4int nVelocities = pM->GetVectorLength(velocitiesName);
+	if (nVelocities < 1 || pM->GetVectorLength(fieldsName) != nVelocities)
+		HGMETabulation::Abort(pM, velocitiesName, "must have as many values as DriftVelocityFields.");
+	G4double* fieldValues = pM->GetDoubleVector(fieldsName, "electric field strength");
+	G4double* velocityValues = pM->GetUnitlessVector(velocitiesName);
+	std::vector<G4double> fields(fieldValues, fieldValues + nVelocities);
+	std::vector<G4double> velocities(nVelocities);
+	for (G4int v = 0; v < nVelocities; v++) {
+		velocities[v] = velocityValues[v] * mm / microsecond;
+		if (velocities[v] <= 0.)
+			HGMETabulation::Abort(pM, velocitiesName, "must be positive, in mm/us.");
+		if (v > 0 && fields[v] <= fields[v - 1])
+			HGMETabulation::Abort(pM, fieldsName, "must be in ascending order.");
+	}
+	delete[] fieldValues;
+	delete[] velocityValues;
+
+	G4double minField = 0.;
+	name = component->GetFullParmName("DriftMinField");
+	if (pM->ParameterExists(name))
+		minField = pM->GetDoubleParameter(name, "electric field strength");
+
+	G4int readoutAxis = -1;
+	G4double readoutPosition = 0.;
+	name = component->GetFullParmName("DriftReadoutAxis");
+	if (pM->ParameterExists(name)) {
+		const G4String axis = pM->GetStringParameter(name);
+		if (axis == "X" || axis == "x")
+			readoutAxis = 0;
+		else if (axis == "Y" || axis == "y")
+			readoutAxis = 1;
+		else if (axis != "None" && axis != "none")
+			HGMETabulation::Abort(pM, name, "must be None, X or Y.");
+	}
+	if (readoutAxis >= 0) {
+		name = component->GetFullParmName("DriftReadoutPosition");
+		if (!pM->ParameterExists(name))
+			HGMETabulation::Abort(pM, name, "is needed by DriftReadoutAxis.");
+		readoutPosition = pM->GetDoubleParameter(name, "Length");
+	}
+
+	std::shared_ptr<HGMEDriftTable> table = std::make_shared<HGMEDriftTable>(field, fields, velocities, minField);
+	table->SetReadout(readoutAxis, readoutPosition);
+	if (!table->IsBounded())
+		HGMETabulation::Abort(pM, component->GetFullParmName("DriftTable"), "needs maps bounded along X and Y.");
+
+	// One start point per node of the map unless set
+	Grid grid;
+	const char* nodeNames[2] = {"DriftTableNodesX", "DriftTableNodesY"};
+	for (G4int axis = 0; axis < 2; axis++) {
+		grid.min[axis] = table->GetMin()[axis];
+		grid.max[axis] = table->GetMax()[axis];
+		grid.nodes[axis] = axis == 0 ? field.GetTable(0).GetNX() : field.GetTable(0).GetNY();
+		name = component->GetFullParmName(nodeNames[axis]);
+		if (pM->ParameterExists(name))
+			grid.nodes[axis] = pM->GetIntegerParameter(name);
+		if (grid.nodes[axis] < 2 || grid.nodes[axis] > 65535)
+			HGMETabulation::Abort(pM, name, "must be between 2 and 65535.");
+	}
+
+	Tolerance tolerance;
+	tolerance.position = 0.01 * mm;
+	tolerance.time = 1.e-3;
+	name = component->GetFullParmName("DriftPositionTolerance");
+	if (pM->ParameterExists(name))
+		tolerance.position = pM->GetDoubleParameter(name, "Length");
+	name = component->GetFullParmName("DriftTimeTolerance");
+	if (pM->ParameterExists(name))
+		tolerance.time = pM->GetUnitlessParameter(name);
+	if (tolerance.position <= 0. || tolerance.time <= 0.)
+		HGMETabulation::Abort(pM, component->GetFullParmName("DriftPositionTolerance"), "and DriftTimeTolerance must be positive.");
+
+	G4int threads = std::max(1U, std::thread::hardware_concurrency());
+	name = component->GetFullParmName("DriftTableThreads");
+	if (pM->ParameterExists(name))
+		threads = std::max(1, pM->GetIntegerParameter(name));
+
+	G4bool useCache = true;
+	G4String cacheDirectory;
+	if (pM->ParameterExists(component->GetFullParmName("DriftTableCache")))
+		useCache = pM->GetBooleanParameter(component->GetFullParmName("DriftTableCache"));
+	if (pM->ParameterExists(component->GetFullParmName("DriftTableCacheDirectory")))
+		cacheDirectory = pM->GetStringParameter(component->GetFullParmName("DriftTableCacheDirectory"));
+
+	std::ostringstream options;
+	options << std::setprecision(17) << "velocities";
+	for (G4int v = 0; v < nVelocities; v++)
+		options << " " << fields[v] << " " << velocities[v];
+	options << " min " << minField << " readout " << readoutAxis << " " << readoutPosition;
+	for (G4int axis = 0; axis < 2; axis++)
+		options << " " << grid.nodes[axis] << " " << grid.min[axis] << " " << grid.max[axis];
+	options << " tolerance " << tolerance.position << " " << tolerance.time;
+	for (size_t r = 0; r < field.GetNumberOfRegions(); r++) {
+		const HGMEFieldTable& map = field.GetTable(r);
+		const G4double* offset = field.GetOffset(r);
+		options << " [" << offset[0] << " " << offset[1] << " " << offset[2] << " interpolation "
+		<< map.GetInterpolation() << " geometry " << map.GetGeometry() << " scale " << map.GetScale() << "]";
+	}
+
+	// Storage addresses tell a reloaded map apart within the process, the
+	// content keys the disk cache
+	std::ostringstream description;
+	description << options.str();
+	for (size_t r = 0; r < field.GetNumberOfRegions(); r++)
+		description << " " << &field.GetTable(r).GetStorage();
+
+	return HGMETabulation::SharedTables<HGMEDriftTable>::Get(component->GetName(), description.str(), [&]() {
+		uint64_t key = HGMEFieldMapLoader::Hash(options.str().data(), options.str().size());
+		for (size_t r = 0; r < field.GetNumberOfRegions(); r++) {
+			const HGMEFieldStorage& storage = field.GetTable(r).GetStorage();
+			key = HGMEFieldMapLoader::Hash(storage.GetData(), storage.GetSize(), key);
+		}
+		const G4String cacheName = HGMETabulation::CacheName(cacheDirectory, "HGMEDriftTable", key);
+
+		if (useCache && HGMETabulation::ReadCache(cacheName, [&](std::istream& cache) { return table->Read(cache, key); })) {
+			G4cout << component->GetName() << ": read drift table " << cacheName << G4endl;
+		} else {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			table->Build(grid, tolerance, threads);
+			G4cout << component->GetName() << ": built the drift table of " << grid.nodes[0] << " x " << grid.nodes[1]
+			<< " start points in " << std::chrono::duration<G4double>(std::chrono::steady_clock::now() - start).count()
+			<< " s on " << threads << " threads" << G4endl;
+			if (useCache)
+				HGMETabulation::WriteCache(cacheName, "drift table", [&](std::ostream& cache) { table->Write(cache, key); });
+		}
+
+		const size_t cells = table->GetNumberOfCells();
+		G4cout << component->GetName() << ": drift table of " << cells << " cells, "
+		<< std::fixed << std::setprecision(1) << (cells > 0 ? 100. * table->GetNumberOfValidCells() / cells : 0.)
+		<< std::defaultfloat << std::setprecision(6) << "% within tolerance, largest deviation "
+		<< table->GetMaxDeviation() / mm << " mm at the cell centres" << G4endl;
+		return std::shared_ptr<const HGMEDriftTable>(table);
+	});
+}
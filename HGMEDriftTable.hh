@@ -0,0 +1,152 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEDriftTable_hh
+#define HGMEDriftTable_hh
+
+#include "HGMEFieldRegions.hh"
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+
+// Drift of ionization electrons in a Z-invariant electric map, tabulated
+// over the (X, Y) plane of the component frame.
+//
+// Electrons move along -E at a drift velocity given as a function of |E|,
+// from every node of a regular (X, Y) grid until they leave the box of the
+// map or cross the readout plane. The end point, the Z displacement, the
+// drift time and the path length of each node are stored, and a query
+// interpolates the four corners of its cell. A cell is only used if its
+// corners all end on the same face and, at its centre, the interpolation
+// agrees with a drift line within the tolerances.
+class HGMEDriftTable
+{
+public:
+	struct Result {
+		G4double end[3];
+		G4double time;
+		G4double pathLength;
+	};
+
+	struct Grid {
+		G4int nodes[2];
+		G4double min[2];
+		G4double max[2];
+	};
+
+	struct Tolerance {
+		G4double position;
+		// Relative to the drift time
+		G4double time;
+	};
+
+	// Drift velocities at ascending field strengths, interpolated linearly
+	// and constant beyond the ends. Drift stops where the field is not above
+	// minField.
+	HGMEDriftTable(const HGMEFieldRegions& field, const std::vector<G4double>& fields,
+				   const std::vector<G4double>& velocities, G4double minField);
+	~HGMEDriftTable();
+
+	// Plane across axis 0 (X) or 1 (Y) where drift ends, as at a wire or pad
+	// plane. Without it, drift ends at the box of the map.
+	void SetReadout(G4int axis, G4double position);
+
+	// Box of the map in X and Y
+	const G4double* GetMin() const { return fMin; }
+	const G4double* GetMax() const { return fMax; }
+	G4bool IsBounded() const;
+
+	// Drifts from every node, then checks every cell at its centre, on the
+	// given number of threads
+	void Build(const Grid& grid, const Tolerance& tolerance, G4int threads);
+
+	// Drift from start, interpolated from the table. Returns false outside
+	// the grid, or in a cell that failed its check.
+	G4bool Lookup(const G4double start[3], Result& result) const;
+
+	// Drift from start by integration. Returns false if the electron stops
+	// in a field below the minimum, or does not arrive within a hundred
+	// diagonals of the box.
+	G4bool Drift(const G4double start[3], Result& result) const;
+
+	// Cached tables, valid only for the map, velocities, readout, grid and
+	// tolerances of the given key
+	void Write(std::ostream& output, uint64_t key) const;
+	G4bool Read(std::istream& input, uint64_t key);
+
+	size_t GetNumberOfCells() const { return fCellValid.size(); }
+	size_t GetNumberOfValidCells() const;
+
+	// Largest end point deviation found at the centre of a used cell
+	G4double GetMaxDeviation() const { return fMaxDeviation; }
+
+	// Table of a component when DriftTable is set, built once per process
+	// or read from the cache, else null
+	static std::shared_ptr<const HGMEDriftTable> Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+														   const HGMEFieldRegions& field);
+
+private:
+	// End point X and Y, Z displacement, time and path length of a node
+	enum { kValues = 5 };
+
+	// Face where the drift from start ends, 2 * axis (+ 1 for the upper
+	// face) of the box or 4 for the readout plane, -1 if it does not end
+	G4int Integrate(const G4double start[3], Result& result) const;
+
+	void Derivatives(const G4double y[4], G4double dyds[4], G4bool& stopped) const;
+	G4double Velocity(G4double field) const;
+	G4bool IsInside(const G4double position[3], G4double readoutSide) const;
+
+	G4bool Locate(const G4double start[3], G4int cell[2], G4double local[2]) const;
+	void Interpolate(const G4int cell[2], const G4double local[2], const G4double start[3], Result& result) const;
+
+	HGMEFieldRegions fField;
+	std::vector<G4double> fFields;
+	std::vector<G4double> fVelocities;
+	G4double fMinField;
+	G4int fReadoutAxis;
+	G4double fReadoutPosition;
+	G4double fMin[2];
+	G4double fMax[2];
+
+	Grid fGrid;
+	Tolerance fTolerance;
+	std::vector<G4double> fEnds;
+	std::vector<signed char> fFaces;
+	std::vector<char> fCellValid;
+	G4double fMaxDeviation;
+};
+
+#endif
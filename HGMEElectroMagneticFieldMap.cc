@@ -0,0 +1,76 @@
+// ElectroMagnetic Field for HGMEElectroMagneticFieldMap
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMEElectroMagneticFieldMap.hh"
+#include "HGMEFieldEnvelope.hh"
+#include "HGMEFieldIntegrator.hh"
+#include "HGMEFieldManager.hh"
+#include "HGMEFieldMapScheduler.hh"
+#include "TsVGeometryComponent.hh"
+
+HGMEElectroMagneticFieldMap::HGMEElectroMagneticFieldMap(TsParameterManager* pM, TsGeometryManager* gM,
+														 TsVGeometryComponent* component):
+TsVElectroMagneticField(pM, gM, component), fEnvelope(0), fIntegrator(0) {
+	fChordFinder = 0;
+	HGMEFieldMapScheduler::Preload(pM, gM);
+	ResolveParameters();
+}
+
+HGMEElectroMagneticFieldMap::~HGMEElectroMagneticFieldMap() {
+	if (fIntegrator) fIntegrator->GetFieldManager()->ReportStepperCalls(fComponent->GetName());
+	delete fIntegrator;
+	delete fEnvelope;
+}
+
+void HGMEElectroMagneticFieldMap::ResolveParameters() {
+	HGMEFieldEnvelope* envelope = fEngine.Configure(fPm, fComponent, true);
+
+	// The field manager using the previous envelope goes with the integrator,
+	// after reporting the stepper calls it counted
+	if (fIntegrator) fIntegrator->GetFieldManager()->ReportStepperCalls(fComponent->GetName());
+	delete fIntegrator;
+	fIntegrator = new HGMEFieldIntegrator(fPm, fComponent, this);
+	fChordFinder = fIntegrator->GetChordFinder();
+	delete fEnvelope;
+	fEnvelope = envelope;
+	fIntegrator->GetFieldManager()->SetEnvelope(fEnvelope);
+}
+
+void HGMEElectroMagneticFieldMap::GetFieldValue(const G4double point[4], G4double* fieldBandE) const {
+	const HGMEFieldManager* manager = fIntegrator->GetFieldManager();
+	fEngine.GetFieldValue(point, fieldBandE, manager->GetTrackID(), manager->GetStepNumber());
+}
+
+void HGMEElectroMagneticFieldMap::GetFieldValueAndGradient(const G4double point[4], G4double field[6], G4double gradient[18]) const {
+	const HGMEFieldManager* manager = fIntegrator->GetFieldManager();
+	fEngine.GetFieldValueAndGradient(point, field, gradient, manager->GetTrackID(), manager->GetStepNumber());
+}
@@ -0,0 +1,68 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEElectroMagneticFieldMap_hh
+#define HGMEElectroMagneticFieldMap_hh
+
+#include "TsVElectroMagneticField.hh"
+
+#include "HGMEFieldMapEngine.hh"
+
+class HGMEFieldEnvelope;
+class HGMEFieldIntegrator;
+
+// Mapped magnetic and electric fields of one component, from the maps below
+// MagneticFieldMap/ and ElectricFieldMap/ (see HGMEElectroMagneticSlots),
+// which take every parameter of a single map.
+class HGMEElectroMagneticFieldMap : public TsVElectroMagneticField
+{
+public:
+	HGMEElectroMagneticFieldMap(TsParameterManager* pM, TsGeometryManager* gM,
+								TsVGeometryComponent* component);
+	~HGMEElectroMagneticFieldMap();
+
+	void GetFieldValue(const G4double[4], G4double *fieldBandE) const;
+	void ResolveParameters();
+
+	// Mapped fields at a point of the world, B in field[0..2] and E in
+	// field[3..5], and their derivatives dF_c/dx_j in gradient[3 * c + j],
+	// all in the world frame
+	void GetFieldValueAndGradient(const G4double point[4], G4double field[6], G4double gradient[18]) const;
+
+private:
+	HGMEFieldMapEngine<6, HGMEElectroMagneticSlots> fEngine;
+
+	// Where either map has field, null when FieldEnvelope is off
+	HGMEFieldEnvelope* fEnvelope;
+
+	// Integrator chain, rebuilt with the parameters of every run
+	HGMEFieldIntegrator* fIntegrator;
+};
+
+#endif
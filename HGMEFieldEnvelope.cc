@@ -0,0 +1,148 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+
+#include "HGMEFieldEnvelope.hh"
+
+#include "TsParameterManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+HGMEFieldEnvelope::HGMEFieldEnvelope(const HGMEFieldRegions& regions, const G4AffineTransform& toWorld):
+fToLocal(toWorld.Inverse()) {
+	Add(regions);
+}
+
+HGMEFieldEnvelope::~HGMEFieldEnvelope() {;}
+
+void HGMEFieldEnvelope::Add(const HGMEFieldRegions& regions) {
+	for (size_t r = 0; r < regions.GetNumberOfRegions(); r++) {
+		Box box;
+		if (regions.GetEnvelope(r, box.min, box.max))
+			fBoxes.push_back(box);
+	}
+}
+
+G4bool HGMEFieldEnvelope::Reaches(const G4ThreeVector& position, const G4ThreeVector& direction) const {
+	const G4ThreeVector localPosition = fToLocal.TransformPoint(position);
+	const G4ThreeVector localDirection = fToLocal.TransformAxis(direction);
+	const G4double p[3] = {localPosition.x(), localPosition.y(), localPosition.z()};
+	const G4double d[3] = {localDirection.x(), localDirection.y(), localDirection.z()};
+
+	// Slab test, the ray enters a box if the ranges of distance inside its
+	// three slabs overlap ahead of the position
+	for (size_t b = 0; b < fBoxes.size(); b++) {
+		const Box& box = fBoxes[b];
+		G4double enter = 0.;
+		G4double leave = DBL_MAX;
+		for (G4int axis = 0; axis < 3 && enter <= leave; axis++) {
+			if (d[axis] == 0.) {
+				if (p[axis] < box.min[axis] || p[axis] > box.max[axis])
+					leave = -1.;
+				continue;
+			}
+			G4double lower = (box.min[axis] - p[axis]) / d[axis];
+			G4double upper = (box.max[axis] - p[axis]) / d[axis];
+			if (lower > upper)
+				std::swap(lower, upper);
+			enter = std::max(enter, lower);
+			leave = std::min(leave, upper);
+		}
+		if (enter <= leave)
+			return true;
+	}
+	return false;
+}
+
+G4bool HGMEFieldEnvelope::Measure(const HGMEFieldTable& table, G4double threshold, G4double min[3], G4double max[3]) {
+	const G4int n[3] = {table.GetNX(), table.GetNY(), table.GetNZ()};
+	G4int low[3] = {n[0], n[1], n[2]};
+	G4int high[3] = {-1, -1, -1};
+	const G4double threshold2 = threshold * threshold;
+
+	// Series have no nodes, they are sampled at the nodes of the grid
+	const G4bool series = table.GetSeriesOrder() > 0;
+	G4double field[3];
+	G4double position[3];
+	for (G4int ix = 0; ix < n[0]; ix++) {
+		for (G4int iy = 0; iy < n[1]; iy++) {
+			for (G4int iz = 0; iz < n[2]; iz++) {
+				if (series) {
+					table.GetNodePosition(ix, iy, iz, position);
+					table.Evaluate(position, field);
+				} else {
+					table.GetNode(ix, iy, iz, field);
+				}
+				if (field[0] * field[0] + field[1] * field[1] + field[2] * field[2] > threshold2) {
+					const G4int index[3] = {ix, iy, iz};
+					for (G4int axis = 0; axis < 3; axis++) {
+						low[axis] = std::min(low[axis], index[axis]);
+						high[axis] = std::max(high[axis], index[axis]);
+					}
+				}
+			}
+		}
+	}
+	if (high[0] < 0)
+		return false;
+
+	const G4double tableMin[3] = {table.GetMinX(), table.GetMinY(), table.GetMinZ()};
+	const G4double tableMax[3] = {table.GetMaxX(), table.GetMaxY(), table.GetMaxZ()};
+	for (G4int axis = 0; axis < 3; axis++) {
+		if (n[axis] == 1) {
+			min[axis] = tableMin[axis];
+			max[axis] = tableMax[axis];
+			continue;
+		}
+		const G4int first = std::max(low[axis] - 1, 0);
+		const G4int last = std::min(high[axis] + 1, n[axis] - 1);
+		const G4double a = table.GetFirst(axis) + (table.GetLast(axis) - table.GetFirst(axis)) * first / (n[axis] - 1);
+		const G4double b = table.GetFirst(axis) + (table.GetLast(axis) - table.GetFirst(axis)) * last / (n[axis] - 1);
+		min[axis] = std::max(tableMin[axis], std::min(a, b));
+		max[axis] = std::min(tableMax[axis], std::max(a, b));
+	}
+
+	// The radial range of an (r, z) grid sweeps a cylinder about z
+	if (table.GetGeometry() == HGMEFieldTable::kAxisymmetric) {
+		min[0] = min[1] = -max[0];
+		max[1] = max[0];
+	}
+	return true;
+}
+
+HGMEFieldEnvelope* HGMEFieldEnvelope::Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+												const HGMEFieldRegions& regions, const G4AffineTransform& toWorld) {
+	G4String name = component->GetFullParmName("FieldEnvelope");
+	if (pM->ParameterExists(name) && !pM->GetBooleanParameter(name))
+		return 0;
+	return new HGMEFieldEnvelope(regions, toWorld);
+}
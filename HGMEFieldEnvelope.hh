@@ -0,0 +1,83 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+
+#ifndef HGMEFieldEnvelope_hh
+#define HGMEFieldEnvelope_hh
+
+#include "HGMEFieldRegions.hh"
+
+#include "G4AffineTransform.hh"
+#include "G4ThreeVector.hh"
+
+#include <vector>
+
+// Boxes of a mapped-field component outside of which its field is zero, or
+// below a threshold. A step whose straight line never enters them sees no
+// field, so HGMEFieldManager lets Geant4 transport it without integrating.
+class TsParameterManager;
+class TsVGeometryComponent;
+
+class HGMEFieldEnvelope
+{
+public:
+	// Envelope of the regions, whose boxes are in the component frame, placed
+	// in the world by toWorld
+	HGMEFieldEnvelope(const HGMEFieldRegions& regions, const G4AffineTransform& toWorld);
+	~HGMEFieldEnvelope();
+
+	// Adds the boxes of other maps of the component, such as the electric
+	// maps of a combined field
+	void Add(const HGMEFieldRegions& regions);
+
+	// Whether the ray from a world position along a direction enters a box
+	G4bool Reaches(const G4ThreeVector& position, const G4ThreeVector& direction) const;
+
+	// Box of the table frame holding every node whose field magnitude
+	// exceeds threshold, widened by one cell so it holds every cell touching
+	// them. Invariant axes keep the unbounded extent of the table. Returns
+	// false if no node exceeds the threshold.
+	static G4bool Measure(const HGMEFieldTable& table, G4double threshold, G4double min[3], G4double max[3]);
+
+	// Envelope of a component unless FieldEnvelope is off, else null. The
+	// caller owns it.
+	static HGMEFieldEnvelope* Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+									   const HGMEFieldRegions& regions, const G4AffineTransform& toWorld);
+
+private:
+	struct Box {
+		G4double min[3];
+		G4double max[3];
+	};
+
+	std::vector<Box> fBoxes;
+	G4AffineTransform fToLocal;
+};
+
+#endif
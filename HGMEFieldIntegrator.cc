@@ -0,0 +1,132 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMEFieldIntegrator.hh"
+#include "HGMECountingStepper.hh"
+#include "HGMEFieldManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4SystemOfUnits.hh"
+#include "G4ChordFinder.hh"
+#include "G4MagIntegratorDriver.hh"
+#include "G4EqMagElectricField.hh"
+#include "G4DormandPrince745.hh"
+#include "G4ClassicalRK4.hh"
+#include "G4CashKarpRKF45.hh"
+#include "G4BogackiShampine23.hh"
+#include "G4SimpleHeum.hh"
+#include "G4SimpleRunge.hh"
+#include "G4ImplicitEuler.hh"
+#include "G4ExplicitEuler.hh"
+#include "G4LogicalVolume.hh"
+
+#include <locale>
+
+HGMEFieldIntegrator::HGMEFieldIntegrator(TsParameterManager* pM, TsVGeometryComponent* component, G4ElectroMagneticField* field):
+fEquation(0), fStepper(0), fDriver(0), fChordFinder(0), fFieldManager(0) {
+	G4String stepperName = "DormandPrince745";
+	if (pM->ParameterExists(component->GetFullParmName("FieldStepper")))
+		stepperName = pM->GetStringParameter(component->GetFullParmName("FieldStepper"));
+
+	G4String stepperKey = stepperName;
+	std::locale loc;
+	for (std::string::size_type j = 0; j < stepperKey.length(); j++)
+		stepperKey[j] = std::tolower(stepperKey[j],loc);
+	if (stepperKey.find("g4") == 0)
+		stepperKey.erase(0, 2);
+
+	G4double stepMinimum = 0.01 * mm;
+	if (pM->ParameterExists(component->GetFullParmName("StepMinimum")))
+		stepMinimum = pM->GetDoubleParameter(component->GetFullParmName("StepMinimum"), "Length");
+
+	fEquation = new G4EqMagElectricField(field);
+	const G4int nvar = 8;
+
+	G4MagIntegratorStepper* stepper = 0;
+	if (stepperKey == "dormandprince745")
+		stepper = new G4DormandPrince745(fEquation, nvar);
+	else if (stepperKey == "classicalrk4")
+		stepper = new G4ClassicalRK4(fEquation, nvar);
+	else if (stepperKey == "cashkarprkf45")
+		stepper = new G4CashKarpRKF45(fEquation, nvar);
+	else if (stepperKey == "bogackishampine23")
+		stepper = new G4BogackiShampine23(fEquation, nvar);
+	else if (stepperKey == "simpleheum")
+		stepper = new G4SimpleHeum(fEquation, nvar);
+	else if (stepperKey == "simplerunge")
+		stepper = new G4SimpleRunge(fEquation, nvar);
+	else if (stepperKey == "impliciteuler")
+		stepper = new G4ImplicitEuler(fEquation, nvar);
+	else if (stepperKey == "expliciteuler")
+		stepper = new G4ExplicitEuler(fEquation, nvar);
+	else {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The parameter: " << component->GetFullParmName("FieldStepper") << G4endl;
+		G4cerr << "has an unknown value: " << stepperName << G4endl;
+		G4cerr << "Electric fields can use DormandPrince745, ClassicalRK4, CashKarpRKF45, BogackiShampine23," << G4endl;
+		G4cerr << "SimpleHeum, SimpleRunge, ImplicitEuler or ExplicitEuler (helix steppers are magnetic only)." << G4endl;
+		pM->AbortSession(1);
+	}
+
+	fStepper = new HGMECountingStepper(stepper);
+	fDriver = new G4MagInt_Driver(stepMinimum, fStepper, fStepper->GetNumberOfVariables());
+	fChordFinder = new G4ChordFinder(fDriver);
+
+	if (pM->ParameterExists(component->GetFullParmName("DeltaChord")))
+		fChordFinder->SetDeltaChord(pM->GetDoubleParameter(component->GetFullParmName("DeltaChord"), "Length"));
+
+	fFieldManager = new HGMEFieldManager(field, fChordFinder, fStepper);
+
+	if (pM->ParameterExists(component->GetFullParmName("DeltaOneStep")))
+		fFieldManager->SetDeltaOneStep(pM->GetDoubleParameter(component->GetFullParmName("DeltaOneStep"), "Length"));
+	if (pM->ParameterExists(component->GetFullParmName("DeltaIntersection")))
+		fFieldManager->SetDeltaIntersection(pM->GetDoubleParameter(component->GetFullParmName("DeltaIntersection"), "Length"));
+
+	// Set the maximum first, the minimum may not exceed it
+	if (pM->ParameterExists(component->GetFullParmName("MaximumEpsilonStep")))
+		fFieldManager->SetMaximumEpsilonStep(pM->GetUnitlessParameter(component->GetFullParmName("MaximumEpsilonStep")));
+	if (pM->ParameterExists(component->GetFullParmName("MinimumEpsilonStep")))
+		fFieldManager->SetMinimumEpsilonStep(pM->GetUnitlessParameter(component->GetFullParmName("MinimumEpsilonStep")));
+
+	if (pM->ParameterExists(component->GetFullParmName("ReportStepperCalls")))
+		fFieldManager->SetCountStepperCalls(pM->GetBooleanParameter(component->GetFullParmName("ReportStepperCalls")));
+
+	component->GetEnvelopeLogicalVolume()->SetFieldManager(fFieldManager, true);
+}
+
+// The chord finder owns the driver, the stepper wrapper owns the stepper
+HGMEFieldIntegrator::~HGMEFieldIntegrator() {
+	delete fFieldManager;
+	delete fChordFinder;
+	delete fStepper;
+	delete fEquation;
+}
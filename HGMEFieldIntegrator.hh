@@ -0,0 +1,70 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldIntegrator_hh
+#define HGMEFieldIntegrator_hh
+
+#include "globals.hh"
+
+class G4ChordFinder;
+class G4ElectroMagneticField;
+class G4EqMagElectricField;
+class G4MagInt_Driver;
+class HGMECountingStepper;
+class HGMEFieldManager;
+class TsParameterManager;
+class TsVGeometryComponent;
+
+// Integrator chain of a field with an electric part, attached to the
+// envelope of its component. Electric fields change the particle energy, so
+// the integrator has to carry the full 8 variable state (position, momentum,
+// energy, time) and helical steppers, which assume a pure magnetic field,
+// are not an option.
+class HGMEFieldIntegrator
+{
+public:
+	// Builds the equation of motion, stepper, driver, chord finder and field
+	// manager from the FieldStepper, StepMinimum, Delta*, *EpsilonStep and
+	// ReportStepperCalls parameters of the component
+	HGMEFieldIntegrator(TsParameterManager* pM, TsVGeometryComponent* component, G4ElectroMagneticField* field);
+	~HGMEFieldIntegrator();
+
+	G4ChordFinder* GetChordFinder() const { return fChordFinder; }
+	HGMEFieldManager* GetFieldManager() const { return fFieldManager; }
+
+private:
+	// fChordFinder owns fDriver, fStepper owns the Geant4 stepper
+	G4EqMagElectricField* fEquation;
+	HGMECountingStepper* fStepper;
+	G4MagInt_Driver* fDriver;
+	G4ChordFinder* fChordFinder;
+	HGMEFieldManager* fFieldManager;
+};
+
+#endif
@@ -0,0 +1,127 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldManager.hh"
+#include "HGMECountingStepper.hh"
+#include "HGMEFieldEnvelope.hh"
+
+#include "G4Track.hh"
+#include "G4Threading.hh"
+
+HGMEFieldManager::HGMEFieldManager(G4Field* field, G4ChordFinder* chordFinder, HGMECountingStepper* stepper):
+G4FieldManager(field, chordFinder, true), fStepper(stepper), fCountStepperCalls(false),
+fField(field), fEnvelope(0), fFieldOn(true), fSteps(0), fStraightSteps(0), fTrackID(0), fStepNumber(0),
+fLastTrackID(-1), fLastStepNumber(0), fCallsAtTrackStart(0), fTracks(0), fTotalCalls(0), fMaxCalls(0) {
+}
+
+HGMEFieldManager::~HGMEFieldManager() {;}
+
+void HGMEFieldManager::SetEnvelope(const HGMEFieldEnvelope* envelope) {
+	fEnvelope = envelope;
+	if (!fFieldOn) {
+		SetDetectorField(fField);
+		fFieldOn = true;
+	}
+}
+
+void HGMEFieldManager::ConfigureForTrack(const G4Track* track) {
+	const G4int trackID = track->GetTrackID();
+	const G4int stepNumber = track->GetCurrentStepNumber();
+	fTrackID = trackID;
+	fStepNumber = stepNumber;
+
+	// Geant4 reads the field of the manager right after this call, a null
+	// one means straight line transport. It is only switched on change.
+	if (fEnvelope) {
+		const G4bool on = fEnvelope->Reaches(track->GetPosition(), track->GetMomentumDirection());
+		if (on != fFieldOn) {
+			SetDetectorField(on ? fField : 0);
+			fFieldOn = on;
+		}
+		fSteps++;
+		if (!on)
+			fStraightSteps++;
+	}
+
+	if (!fCountStepperCalls || !fStepper)
+		return;
+
+	// A new track either has a different ID or restarts the step count
+	// (track IDs start again at 1 in every event)
+	if (trackID != fLastTrackID || stepNumber <= fLastStepNumber) {
+		FinishTrack();
+		fLastTrackID = trackID;
+		fCallsAtTrackStart = fStepper->GetNumberOfCalls();
+	}
+	fLastStepNumber = stepNumber;
+}
+
+void HGMEFieldManager::FinishTrack() {
+	if (fLastTrackID < 0)
+		return;
+
+	G4long calls = fStepper->GetNumberOfCalls() - fCallsAtTrackStart;
+	fTracks++;
+	fTotalCalls += calls;
+	if (calls > fMaxCalls) fMaxCalls = calls;
+
+	// Bin 0 holds tracks without any call, bin n holds [2^(n-1), 2^n)
+	size_t bin = 0;
+	while (calls > 0) {
+		calls >>= 1;
+		bin++;
+	}
+	if (fHistogram.size() <= bin) fHistogram.resize(bin + 1, 0);
+	fHistogram[bin]++;
+
+	fLastTrackID = -1;
+}
+
+void HGMEFieldManager::ReportStepperCalls(const G4String& name) {
+	if (!fCountStepperCalls || !fStepper)
+		return;
+
+	FinishTrack();
+	fLastStepNumber = 0;
+
+	G4cout << "Stepper calls for field in " << name << " (thread " << G4Threading::G4GetThreadId() << "):" << G4endl;
+	G4cout << "  tracks: " << fTracks << ", stepper calls: " << fTotalCalls
+		   << ", mean per track: " << (fTracks > 0 ? (G4double)fTotalCalls / fTracks : 0.)
+		   << ", max per track: " << fMaxCalls << G4endl;
+	if (fEnvelope)
+		G4cout << "  steps: " << fSteps << ", moved straight outside the field envelope: " << fStraightSteps << G4endl;
+	for (size_t bin = 0; bin < fHistogram.size(); bin++) {
+		if (fHistogram[bin] == 0) continue;
+		if (bin == 0)
+			G4cout << "  calls 0: ";
+		else
+			G4cout << "  calls " << (1L << (bin - 1)) << "-" << (1L << bin) - 1 << ": ";
+		G4cout << fHistogram[bin] << " tracks" << G4endl;
+	}
+}
@@ -0,0 +1,97 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldManager_hh
+#define HGMEFieldManager_hh
+
+#include "G4FieldManager.hh"
+
+#include <vector>
+
+class HGMECountingStepper;
+class HGMEFieldEnvelope;
+
+// Field manager attached to the envelope of a mapped-field component.
+// Geant4 calls ConfigureForTrack before every step taken in the volume, which
+// is used here to attribute stepper calls to the track that caused them and
+// to let the field tell which track and step a query belongs to.
+//
+// With an envelope, the field is switched off for the steps whose straight
+// line never enters it: Geant4 then moves them along that line, exactly as
+// the zero field it would integrate, at the cost of a navigation step.
+class HGMEFieldManager : public G4FieldManager
+{
+public:
+	HGMEFieldManager(G4Field* field, G4ChordFinder* chordFinder, HGMECountingStepper* stepper);
+	~HGMEFieldManager();
+
+	void ConfigureForTrack(const G4Track* track);
+
+	// Enables per-track bookkeeping of stepper calls
+	void SetCountStepperCalls(G4bool count) { fCountStepperCalls = count; }
+
+	// Envelope of the field, not owned, or null to integrate every step
+	void SetEnvelope(const HGMEFieldEnvelope* envelope);
+
+	// Track and step currently transported in the volume
+	G4int GetTrackID() const { return fTrackID; }
+	G4int GetStepNumber() const { return fStepNumber; }
+
+	// Prints number of tracks, mean/max stepper calls per track and a
+	// power-of-two histogram of calls per track
+	void ReportStepperCalls(const G4String& name);
+
+private:
+	void FinishTrack();
+
+	HGMECountingStepper* fStepper;
+	G4bool fCountStepperCalls;
+
+	G4Field* fField;
+	const HGMEFieldEnvelope* fEnvelope;
+	G4bool fFieldOn;
+	G4long fSteps;
+	G4long fStraightSteps;
+
+	G4int fTrackID;
+	G4int fStepNumber;
+
+	// Identification of the track seen in the previous step
+	G4int fLastTrackID;
+	G4int fLastStepNumber;
+	G4long fCallsAtTrackStart;
+
+	// Accumulated statistics over all finished tracks
+	G4long fTracks;
+	G4long fTotalCalls;
+	G4long fMaxCalls;
+	std::vector<G4long> fHistogram;
+};
+
+#endif
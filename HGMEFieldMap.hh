@@ -27,45 +27,49 @@
 // ********************************************************************
 //
 
-#ifndef MyElectroMagneticField1_hh
-#define MyElectroMagneticField1_hh
+#ifndef HGMEFieldMap_hh
+#define HGMEFieldMap_hh
 
 #include "TsVElectroMagneticField.hh"
 
-#include "G4AffineTransform.hh"
+#include "HGMEDriftTable.hh"
+#include "HGMEFieldMapEngine.hh"
 
-#include <vector>
+class HGMEFieldEnvelope;
+class HGMEFieldIntegrator;
 
-class MyElectroMagneticField1 : public TsVElectroMagneticField
+// Mapped electric field. The maps are those of HGMEFieldMapEngine, the
+// magnetic slots of fieldBandE stay zero.
+class HGMEFieldMap : public TsVElectroMagneticField
 {
 public:
-	MyElectroMagneticField1(TsParameterManager* pM, TsGeometryManager* gM,
+	HGMEFieldMap(TsParameterManager* pM, TsGeometryManager* gM,
 						  TsVGeometryComponent* component);
-	~MyElectroMagneticField1();
+	~HGMEFieldMap();
 	
 	void GetFieldValue(const G4double[4], G4double *fieldBandE) const;
 	void ResolveParameters();
-private:
-	// Physical limits of the defined region
-	G4double fMinX, fMinY, fMinZ, fMaxX, fMaxY, fMaxZ;
 
-	// Physical extent of the defined region
-	G4double fDX, fDY, fDZ;
+	// Mapped field at a point of the world and its derivatives dF_i/dx_j in
+	// gradient[3 * i + j], both in the world frame, from a single lookup of
+	// the table. The derivatives are those of the interpolant.
+	void GetFieldValueAndGradient(const G4double point[4], G4double field[3], G4double gradient[9]) const;
 
-	// Allows handling of either direction of min and max positions
-	G4bool fInvertX, fInvertY, fInvertZ;
+	// Drift of an ionization electron from start to its end point, both in
+	// the world frame, from the drift table. Returns false without a table,
+	// or where the table has no usable cell.
+	G4bool GetDrift(const G4ThreeVector& start, G4ThreeVector& end, G4double& time, G4double& pathLength) const;
+private:
+	HGMEFieldMapEngine<6, HGMEElectricSlots> fEngine;
 
-	// Dimensions of the table
-	G4int fNX, fNY, fNZ;
+	// Where the maps have field, null when FieldEnvelope is off
+	HGMEFieldEnvelope* fEnvelope;
 
-	// Storage for the table
-	std::vector< std::vector< std::vector< double > > > fFieldX;
-	std::vector< std::vector< std::vector< double > > > fFieldY;
-	std::vector< std::vector< std::vector< double > > > fFieldZ;
+	// Integrator chain, rebuilt with the parameters of every run
+	HGMEFieldIntegrator* fIntegrator;
 
-	// Affine transformation to the world to resolve the position/rotation
-	// when a daughter is placed in a mother holding the field
-	G4AffineTransform fAffineTransf;
+	// Null unless DriftTable is set
+	std::shared_ptr<const HGMEDriftTable> fDriftTable;
 };
 
 
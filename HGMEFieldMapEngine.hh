@@ -0,0 +1,257 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldMapEngine_hh
+#define HGMEFieldMapEngine_hh
+
+#include "TsParameterManager.hh"
+
+#include "HGMEFieldEnvelope.hh"
+#include "HGMEFieldMapValidation.hh"
+#include "HGMEFieldQueryTrace.hh"
+#include "HGMEFieldRegions.hh"
+#include "HGMEFieldStepLimits.hh"
+#include "HGMETransferMapModel.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4AffineTransform.hh"
+
+// Output slot mappings of HGMEFieldMapEngine. Each names the maps of a
+// component: the slot of fieldBandE their three components go to, the unit
+// of their field parameters and the prefix of their parameter names.
+struct HGMEMagneticSlots
+{
+	enum { kMaps = 1 };
+	static G4int Slot(G4int) { return 0; }
+	static const char* Unit(G4int) { return "Magnetic flux density"; }
+	static const char* Prefix(G4int) { return ""; }
+};
+
+struct HGMEElectricSlots
+{
+	enum { kMaps = 1 };
+	static G4int Slot(G4int) { return 3; }
+	static const char* Unit(G4int) { return "electric field strength"; }
+	static const char* Prefix(G4int) { return ""; }
+};
+
+// Magnetic maps below MagneticFieldMap/, electric maps below ElectricFieldMap/
+struct HGMEElectroMagneticSlots
+{
+	enum { kMaps = 2 };
+	static G4int Slot(G4int map) { return 3 * map; }
+	static const char* Unit(G4int map) { return map == 0 ? "Magnetic flux density" : "electric field strength"; }
+	static const char* Prefix(G4int map) { return map == 0 ? "MagneticFieldMap/" : "ElectricFieldMap/"; }
+};
+
+// Mapped field of a component, shared by the TOPAS field classes, which
+// only add their integrator. It loads the maps named by Slots, places them
+// with the component and answers queries in the world frame, writing
+// Components values: the mapped slots, and zero in every other one.
+template <G4int Components, class Slots>
+class HGMEFieldMapEngine
+{
+public:
+	enum { kMaps = Slots::kMaps };
+
+	HGMEFieldMapEngine(): fTrace(0), fTransferMap(0) {
+		static_assert(Components >= 3 * kMaps, "every map needs three output slots");
+	}
+	~HGMEFieldMapEngine() {
+		delete fTrace;
+		delete fTransferMap;
+	}
+
+	// Loads the maps, places them with the component, sets up query traces,
+	// step limits and the transfer map, and returns the envelope of the maps,
+	// owned by the caller, or null when FieldEnvelope is off. Called again for
+	// every run.
+	HGMEFieldEnvelope* Configure(TsParameterManager* pM, TsVGeometryComponent* component, G4bool trackContext);
+
+	// Field at a point of the world, in the world frame. The track and step
+	// only go to the query trace.
+	void GetFieldValue(const G4double point[3], G4double* field, G4int trackID = 0, G4int stepNumber = 0) const;
+
+	// Field and its derivatives dF_c/dx_j in gradient[3 * c + j], both in the
+	// world frame, from a single lookup of each map. The derivatives are
+	// those of the interpolant.
+	void GetFieldValueAndGradient(const G4double point[3], G4double field[Components], G4double gradient[3 * Components],
+								  G4int trackID = 0, G4int stepNumber = 0) const;
+
+	// Maps loaded elsewhere, placed by toWorld, for checks of the query path
+	// that have no component of their own
+	void SetMaps(const HGMEFieldRegions maps[kMaps], const G4AffineTransform& toWorld) {
+		for (G4int m = 0; m < kMaps; m++)
+			fMaps[m] = maps[m];
+		Place(toWorld);
+	}
+
+	const HGMEFieldRegions& GetMaps(G4int map) const { return fMaps[map]; }
+	const G4AffineTransform& GetTransform() const { return fToWorld; }
+	const G4AffineTransform& GetInverseTransform() const { return fToLocal; }
+
+private:
+	void Place(const G4AffineTransform& toWorld);
+
+	void ToLocal(const G4double point[3], G4double local[3]) const {
+		const G4ThreeVector localPoint = fToLocal.TransformPoint(G4ThreeVector(point[0], point[1], point[2]));
+		local[0] = localPoint.x();
+		local[1] = localPoint.y();
+		local[2] = localPoint.z();
+	}
+
+	// Tabulated field map regions, in the frame of the component
+	HGMEFieldRegions fMaps[kMaps];
+
+	// Sampled record of the queries, when FieldQueryTraceFile is set
+	HGMEFieldQueryTrace* fTrace;
+
+	// Fast simulation across the maps, when TransferMap has been set
+	HGMETransferMapModel* fTransferMap;
+
+	// Affine transformation to the world to resolve the position/rotation
+	// when a daughter is placed in a mother holding the field, and its inverse
+	G4AffineTransform fToWorld;
+	G4AffineTransform fToLocal;
+
+	// Rotation of the component, fRotation[3 * i + j] = R_ij, to carry
+	// fields and gradients to the world frame
+	G4double fRotation[9];
+};
+
+template <G4int Components, class Slots>
+HGMEFieldEnvelope* HGMEFieldMapEngine<Components, Slots>::Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+																	 G4bool trackContext) {
+	for (G4int m = 0; m < kMaps; m++)
+		fMaps[m].Load(pM, component, Slots::Unit(m), Slots::Prefix(m));
+
+	if (pM->ParameterExists(component->GetFullParmName("ValidateFieldMapEngine")) &&
+		pM->GetBooleanParameter(component->GetFullParmName("ValidateFieldMapEngine"))) {
+		HGMEFieldMapValidation validation(pM, component);
+		validation.RunOnce();
+	}
+
+	// Created before the previous recorder goes, so the trace file is kept.
+	// Replays run against the first map.
+	HGMEFieldQueryTrace* trace = HGMEFieldQueryTrace::Configure(pM, component, fMaps[0], trackContext);
+	delete fTrace;
+	fTrace = trace;
+
+	const G4Point3D* translation = component->GetTransRelToWorld();
+	Place(G4AffineTransform(component->GetRotRelToWorld(),
+							G4ThreeVector(translation->x(), translation->y(), translation->z())));
+
+	HGMEFieldStepLimits::Configure(pM, component, fMaps, kMaps, fToWorld);
+
+	const HGMEFieldRegions* maps[2] = {0, 0};
+	for (G4int m = 0; m < kMaps; m++)
+		maps[Slots::Slot(m) == 0 ? 0 : 1] = &fMaps[m];
+	fTransferMap = HGMETransferMapModel::Configure(pM, component, maps[0], maps[1], fTransferMap);
+
+	HGMEFieldEnvelope* envelope = HGMEFieldEnvelope::Configure(pM, component, fMaps[0], fToWorld);
+	for (G4int m = 1; envelope && m < kMaps; m++)
+		envelope->Add(fMaps[m]);
+	return envelope;
+}
+
+template <G4int Components, class Slots>
+void HGMEFieldMapEngine<Components, Slots>::Place(const G4AffineTransform& toWorld) {
+	fToWorld = toWorld;
+	fToLocal = fToWorld.Inverse();
+
+	for (G4int j = 0; j < 3; j++) {
+		G4ThreeVector axis = fToWorld.TransformAxis(G4ThreeVector(j == 0, j == 1, j == 2));
+		fRotation[j] = axis.x();
+		fRotation[3 + j] = axis.y();
+		fRotation[6 + j] = axis.z();
+	}
+}
+
+// Tabulated maps have their own field area, supposed to be smaller than the
+// volume, and give zero field for points outside of it
+template <G4int Components, class Slots>
+inline void HGMEFieldMapEngine<Components, Slots>::GetFieldValue(const G4double point[3], G4double* field,
+																 G4int trackID, G4int stepNumber) const {
+	G4double local[3];
+	ToLocal(point, local);
+
+	if (fTrace)
+		fTrace->Record(local, trackID, stepNumber);
+
+	for (G4int c = 0; c < Components; c++)
+		field[c] = 0.;
+
+	G4double mapped[3];
+	for (G4int m = 0; m < kMaps; m++) {
+		if (!fMaps[m].Evaluate(local, mapped))
+			continue;
+		G4double* out = field + Slots::Slot(m);
+		for (G4int i = 0; i < 3; i++)
+			out[i] = fRotation[3 * i] * mapped[0] + fRotation[3 * i + 1] * mapped[1] + fRotation[3 * i + 2] * mapped[2];
+	}
+}
+
+// Gradient in the world frame is R G R^T for the rotation R of the component
+template <G4int Components, class Slots>
+inline void HGMEFieldMapEngine<Components, Slots>::GetFieldValueAndGradient(const G4double point[3], G4double field[Components],
+																			G4double gradient[3 * Components],
+																			G4int trackID, G4int stepNumber) const {
+	G4double local[3];
+	ToLocal(point, local);
+
+	if (fTrace)
+		fTrace->Record(local, trackID, stepNumber);
+
+	for (G4int c = 0; c < Components; c++)
+		field[c] = 0.;
+	for (G4int c = 0; c < 3 * Components; c++)
+		gradient[c] = 0.;
+
+	G4double mapped[3];
+	G4double mappedGradient[9];
+	G4double rotated[9];
+	for (G4int m = 0; m < kMaps; m++) {
+		if (!fMaps[m].EvaluateGradient(local, mapped, mappedGradient))
+			continue;
+		G4double* out = field + Slots::Slot(m);
+		G4double* outGradient = gradient + 3 * Slots::Slot(m);
+		for (G4int i = 0; i < 3; i++) {
+			out[i] = fRotation[3 * i] * mapped[0] + fRotation[3 * i + 1] * mapped[1] + fRotation[3 * i + 2] * mapped[2];
+			for (G4int j = 0; j < 3; j++)
+				rotated[3 * i + j] = fRotation[3 * i] * mappedGradient[j] + fRotation[3 * i + 1] * mappedGradient[3 + j]
+				+ fRotation[3 * i + 2] * mappedGradient[6 + j];
+		}
+		for (G4int i = 0; i < 3; i++)
+			for (G4int j = 0; j < 3; j++)
+				outGradient[3 * i + j] = rotated[3 * i] * fRotation[3 * j] + rotated[3 * i + 1] * fRotation[3 * j + 1]
+				+ rotated[3 * i + 2] * fRotation[3 * j + 2];
+	}
+}
+
+#endif
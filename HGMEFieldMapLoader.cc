@@ -0,0 +1,1345 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldMapLoader.hh"
+#include "HGMEFieldEnvelope.hh"
+#include "HGMEFieldResampler.hh"
+#include "HGMEFieldSeriesFitter.hh"
+#include "HGMELaplaceSolver.hh"
+#include "HGMETabulation.hh"
+
+#include "TsParameterManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4AutoLock.hh"
+#include "G4SystemOfUnits.hh"
+#include "G4Tokenizer.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <locale>
+#include <map>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace {
+	G4String ToLower(G4String value) {
+		std::locale loc;
+		for (std::string::size_type j = 0; j < value.length(); j++)
+			value[j] = std::tolower(value[j],loc);
+		return value;
+	}
+
+	// Identity of the content of a source file. The size and modification
+	// time are checked first, the content hash only when they differ.
+	struct Fingerprint {
+		Fingerprint(): size(-1), seconds(0), nanoseconds(0), hash(0) {}
+		G4bool ReadStatus(const G4String& fileName) {
+			struct stat status;
+			if (stat(fileName.c_str(), &status) != 0)
+				return false;
+			size = status.st_size;
+#ifdef __APPLE__
+			seconds = status.st_mtimespec.tv_sec;
+			nanoseconds = status.st_mtimespec.tv_nsec;
+#else
+			seconds = status.st_mtim.tv_sec;
+			nanoseconds = status.st_mtim.tv_nsec;
+#endif
+			return true;
+		}
+		long long size;
+		long long seconds;
+		long nanoseconds;
+		uint64_t hash;
+	};
+
+	G4bool SameStatus(const Fingerprint& a, const Fingerprint& b) {
+		return a.size == b.size && a.seconds == b.seconds && a.nanoseconds == b.nanoseconds;
+	}
+
+	// Units of the .npy header file, by their usual symbols. The columns of
+	// text tables name them in any case, such as [MM], [TESLA] or [V/M].
+	G4double NpyUnit(const G4String& name, G4bool length, G4bool magnetic, G4bool anyCase = false) {
+		const char* lengths[6] = {"um", "mm", "cm", "m", "metre", "meter"};
+		const G4double lengthUnits[6] = {um, mm, cm, m, m, m};
+		const char* magnetics[5] = {"T", "tesla", "mT", "gauss", "kilogauss"};
+		const G4double magneticUnits[5] = {tesla, tesla, 1.e-3 * tesla, gauss, kilogauss};
+		const char* electrics[6] = {"kV/mm", "V/mm", "kV/cm", "V/cm", "V/m", "MV/m"};
+		const G4double electricUnits[6] = {kilovolt / mm, volt / mm, kilovolt / cm, volt / cm, volt / m, megavolt / m};
+		const G4int count = length ? 6 : (magnetic ? 5 : 6);
+		const char** names = length ? lengths : (magnetic ? magnetics : electrics);
+		const G4double* units = length ? lengthUnits : (magnetic ? magneticUnits : electricUnits);
+		for (G4int i = 0; i < count; i++)
+			if (anyCase ? ToLower(name) == ToLower(names[i]) : name == names[i])
+				return units[i];
+		return 0.;
+	}
+
+	// Layout of the array of a .npy file, from the Python dictionary literal
+	// of its header, such as
+	//   {'descr': '<f8', 'fortran_order': False, 'shape': (64, 64, 128, 3), }
+	struct NpyHeader {
+		G4bool littleEndian;
+		G4bool fortranOrder;
+		size_t elementSize;
+		std::vector<size_t> shape;
+		size_t dataOffset;
+	};
+
+	// Empty if the file holds a float32 or float64 array, else the reason
+	G4String ParseNpyHeader(const char* bytes, size_t size, NpyHeader& header) {
+		if (size < 10 || std::memcmp(bytes, "\x93NUMPY", 6) != 0)
+			return "The file is not a NumPy .npy file.";
+		size_t length;
+		size_t start;
+		if (bytes[6] == 1) {
+			length = (unsigned char)bytes[8] | (unsigned char)bytes[9] << 8;
+			start = 10;
+		} else if ((bytes[6] == 2 || bytes[6] == 3) && size >= 12) {
+			length = (unsigned char)bytes[8] | (unsigned char)bytes[9] << 8 |
+			(unsigned char)bytes[10] << 16 | (size_t)(unsigned char)bytes[11] << 24;
+			start = 12;
+		} else {
+			return "Unknown .npy format version.";
+		}
+		if (start + length > size)
+			return "The .npy header is truncated.";
+		const std::string dictionary(bytes + start, length);
+		header.dataOffset = start + length;
+
+		size_t key = dictionary.find("'descr'");
+		size_t quote = key == std::string::npos ? key : dictionary.find('\'', key + 7);
+		const G4String descr = quote == std::string::npos ? "" : dictionary.substr(quote + 1, dictionary.find('\'', quote + 1) - quote - 1);
+		if (descr.size() != 3 || (descr[1] != 'f') || (descr[2] != '4' && descr[2] != '8') ||
+			(descr[0] != '<' && descr[0] != '>' && descr[0] != '='))
+			return "The array must hold float32 or float64 values, its type is '" + descr + "'.";
+		header.elementSize = descr[2] == '8' ? 8 : 4;
+		const uint16_t probe = 1;
+		const G4bool littleHost = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+		header.littleEndian = descr[0] == '<' || (descr[0] == '=' && littleHost);
+
+		key = dictionary.find("'fortran_order'");
+		if (key == std::string::npos)
+			return "The .npy header has no fortran_order.";
+		const size_t value = dictionary.find_first_not_of(": ", key + 15);
+		header.fortranOrder = value != std::string::npos && dictionary.compare(value, 4, "True") == 0;
+
+		key = dictionary.find("'shape'");
+		size_t open = key == std::string::npos ? key : dictionary.find('(', key);
+		size_t close = open == std::string::npos ? open : dictionary.find(')', open);
+		if (close == std::string::npos)
+			return "The .npy header has no shape.";
+		std::istringstream dimensions(dictionary.substr(open + 1, close - open - 1));
+		G4String dimension;
+		header.shape.clear();
+		while (getline(dimensions, dimension, ','))
+			if (dimension.find_first_of("0123456789") != std::string::npos)
+				header.shape.push_back(std::strtoull(dimension.c_str(), 0, 10));
+		return "";
+	}
+
+	// Guards the map of the shared tables, not the tables themselves
+	G4Mutex sharedTablesMutex = G4MUTEX_INITIALIZER;
+}
+
+// Tables shared by the worker threads, with their NUMA replicas. Each has its
+// own lock, so that only the threads asking for the same table wait while it
+// is loaded, and tables of different files load at once.
+struct HGMEFieldMapLoader::SharedTable {
+	SharedTable(): loaded(false), replicasReported(false), envelopeThreshold(-1.), envelopeHasField(false) {}
+	G4Mutex mutex;
+	G4bool loaded;
+	HGMEFieldTable table;
+	std::map<G4int,HGMEFieldTable> replicas;
+	G4bool replicasReported;
+	Fingerprint fingerprint;
+	std::shared_ptr<const HGMEFieldSmoothness> smoothness;
+	G4double envelopeThreshold;
+	G4bool envelopeHasField;
+	G4double envelope[6];
+};
+
+HGMEFieldMapLoader::HGMEFieldMapLoader(TsParameterManager* pM, const char* fieldUnit):
+fPm(pM), fFieldUnit(fieldUnit), fComponent(0), fSourceHash(0), fSource(kTable), fSolver(0), fUseCache(true),
+fNpyFieldUnit(0.), fPrecision(HGMEFieldTable::kDouble), fPrecisionSet(false), fInterpolation(HGMEFieldTable::kTrilinear), fLayout(HGMEFieldTable::kRowMajor), fGeometry(HGMEFieldTable::kCartesian), fResampleMaxError(0.), fCrop(false), fSeriesOrder(0), fSeriesMaxResidual(0.),
+fHugePages(HGMEFieldStorage::kNoHugePages), fNUMAReplicas(false), fSharedMemory(false), fSharedMemoryDirectory("/tmp"), fSmoothnessBlock(0),
+fEnvelopeThreshold(-1.), fEnvelopeHasField(false) {
+	fSeriesPatches[0] = 1;
+	fSeriesPatches[1] = 1;
+	for (G4int axis = 0; axis < 3; axis++) {
+		fNpyOrigin[axis] = 0.;
+		fNpySpacing[axis] = 0.;
+		fEnvelope[axis] = 0.;
+		fEnvelope[3 + axis] = 0.;
+		fCropMin[axis] = -DBL_MAX;
+		fCropMax[axis] = DBL_MAX;
+	}
+}
+
+HGMEFieldMapLoader::~HGMEFieldMapLoader() {
+	delete fSolver;
+}
+
+void HGMEFieldMapLoader::ReadOptions(TsVGeometryComponent* component, const G4String& prefix) {
+	fComponent = component;
+	fPrefix = prefix;
+
+	G4String name = ParameterName("FieldSource");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "table")
+			fSource = kTable;
+		else if (value == "npy")
+			fSource = kNpy;
+		else if (value == "laplace")
+			fSource = kLaplace;
+		else
+			AbortParameter(name, "Table, Npy or Laplace");
+	}
+
+	if (fSource != kLaplace) {
+		fParameterName = ParameterName("MagneticField3DTable");
+		fFileName = fPm->GetStringParameter(fParameterName);
+		if (fFileName.size() > 4 && ToLower(fFileName.substr(fFileName.size() - 4)) == ".npy")
+			fSource = kNpy;
+		if (fSource == kNpy)
+			ReadNpyOptions();
+	} else {
+		ReadLaplaceOptions();
+	}
+
+	name = ParameterName("FieldStoragePrecision");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "double")
+			fPrecision = HGMEFieldTable::kDouble;
+		else if (value == "float")
+			fPrecision = HGMEFieldTable::kFloat;
+		else
+			AbortParameter(name, "Double or Float");
+		fPrecisionSet = true;
+	}
+
+	name = ParameterName("FieldInterpolation");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "trilinear")
+			fInterpolation = HGMEFieldTable::kTrilinear;
+		else if (value == "nearest")
+			fInterpolation = HGMEFieldTable::kNearest;
+		else
+			AbortParameter(name, "Trilinear or Nearest");
+	}
+
+	name = ParameterName("ResampleMaxFieldError");
+	if (fPm->ParameterExists(name)) {
+		fResampleMaxError = fPm->GetDoubleParameter(name, fFieldUnit);
+		if (fResampleMaxError < 0.)
+			AbortParameter(name, "a non-negative field error");
+	}
+
+	name = ParameterName("FieldRepresentation");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "multipole")
+			fSeriesOrder = 8;
+		else if (value != "table")
+			AbortParameter(name, "Table or Multipole");
+	}
+	if (fSeriesOrder > 0) {
+		if (fPm->ParameterExists(ParameterName("MultipoleOrder")))
+			fSeriesOrder = fPm->GetIntegerParameter(ParameterName("MultipoleOrder"));
+		if (fPm->ParameterExists(ParameterName("MultipolePatchesX")))
+			fSeriesPatches[0] = fPm->GetIntegerParameter(ParameterName("MultipolePatchesX"));
+		if (fPm->ParameterExists(ParameterName("MultipolePatchesY")))
+			fSeriesPatches[1] = fPm->GetIntegerParameter(ParameterName("MultipolePatchesY"));
+		if (fPm->ParameterExists(ParameterName("MultipoleMaxResidual")))
+			fSeriesMaxResidual = fPm->GetDoubleParameter(ParameterName("MultipoleMaxResidual"), fFieldUnit);
+		if (fSeriesOrder < 1 || fSeriesOrder > 32)
+			AbortParameter(ParameterName("MultipoleOrder"), "an order from 1 to 32");
+		if (fSeriesPatches[0] < 1 || fSeriesPatches[1] < 1)
+			AbortParameter(ParameterName("MultipolePatchesX"), "at least one patch along X and Y");
+	}
+
+	name = ParameterName("FieldTableLayout");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "rowmajor")
+			fLayout = HGMEFieldTable::kRowMajor;
+		else if (value == "tiled")
+			fLayout = HGMEFieldTable::kTiled;
+		else if (value == "padded")
+			fLayout = HGMEFieldTable::kPadded;
+		else
+			AbortParameter(name, "RowMajor, Tiled or Padded");
+	}
+
+	name = ParameterName("FieldTableGeometry");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "cartesian")
+			fGeometry = HGMEFieldTable::kCartesian;
+		else if (value == "axisymmetric")
+			fGeometry = HGMEFieldTable::kAxisymmetric;
+		else
+			AbortParameter(name, "Cartesian or Axisymmetric");
+		if (fGeometry == HGMEFieldTable::kAxisymmetric && fSource == kLaplace) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "The parameter: " << name << G4endl;
+			G4cerr << "must be Cartesian for fields solved by FieldSource Laplace." << G4endl;
+			fPm->AbortSession(1);
+		}
+	}
+
+	fCrop = fSource == kTable;
+	name = ParameterName("FieldTableCrop");
+	if (fPm->ParameterExists(name))
+		fCrop = fCrop && fPm->GetBooleanParameter(name);
+
+	name = ParameterName("FieldTableHugePages");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "none")
+			fHugePages = HGMEFieldStorage::kNoHugePages;
+		else if (value == "transparent")
+			fHugePages = HGMEFieldStorage::kTransparentHugePages;
+		else if (value == "explicit")
+			fHugePages = HGMEFieldStorage::kExplicitHugePages;
+		else
+			AbortParameter(name, "None, Transparent or Explicit");
+	}
+
+	name = ParameterName("FieldTableNUMAReplicas");
+	if (fPm->ParameterExists(name))
+		fNUMAReplicas = fPm->GetBooleanParameter(name);
+
+	name = ParameterName("FieldTableSharedMemory");
+	if (fPm->ParameterExists(name))
+		fSharedMemory = fPm->GetBooleanParameter(name);
+	name = ParameterName("FieldTableSharedMemoryDirectory");
+	if (fPm->ParameterExists(name))
+		fSharedMemoryDirectory = fPm->GetStringParameter(name);
+
+	name = fComponent->GetFullParmName("FieldStepLimiter");
+	if (fPm->ParameterExists(name) && fPm->GetBooleanParameter(name)) {
+		fSmoothnessBlock = 8;
+		name = fComponent->GetFullParmName("FieldSmoothnessBlock");
+		if (fPm->ParameterExists(name))
+			fSmoothnessBlock = fPm->GetIntegerParameter(name);
+		if (fSmoothnessBlock < 1) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "The parameter: " << name << G4endl;
+			G4cerr << "must be at least 1." << G4endl;
+			fPm->AbortSession(1);
+		}
+	}
+
+	name = fComponent->GetFullParmName("FieldEnvelope");
+	if (!fPm->ParameterExists(name) || fPm->GetBooleanParameter(name)) {
+		fEnvelopeThreshold = 0.;
+		name = fComponent->GetFullParmName("FieldEnvelopeThreshold");
+		if (fPm->ParameterExists(name))
+			fEnvelopeThreshold = fPm->GetDoubleParameter(name, fFieldUnit);
+		if (fEnvelopeThreshold < 0.)
+			AbortParameter(name, "a non-negative field");
+	}
+}
+
+void HGMEFieldMapLoader::SetFileName(const G4String& fileName) {
+	fFileName = fileName;
+	fParameterName = fileName;
+	fSource = fileName.size() > 4 && ToLower(fileName.substr(fileName.size() - 4)) == ".npy" ? kNpy : kTable;
+	fCrop = fSource == kTable;
+	if (fSource == kNpy)
+		ReadNpyOptions();
+}
+
+void HGMEFieldMapLoader::SetCropBox(const G4double min[3], const G4double max[3]) {
+	std::copy(min, min + 3, fCropMin);
+	std::copy(max, max + 3, fCropMax);
+}
+
+G4bool HGMEFieldMapLoader::IsCropped() const {
+	if (!fCrop)
+		return false;
+	for (G4int axis = 0; axis < 3; axis++)
+		if (fCropMin[axis] > -DBL_MAX || fCropMax[axis] < DBL_MAX)
+			return true;
+	return false;
+}
+
+G4String HGMEFieldMapLoader::ParameterName(const G4String& name) const {
+	return fComponent->GetFullParmName((fPrefix + name).c_str());
+}
+
+void HGMEFieldMapLoader::ReadLaplaceOptions() {
+	G4int n[3];
+	G4double halfLength[3];
+	n[0] = fPm->GetIntegerParameter(ParameterName("LaplaceNX"));
+	n[1] = fPm->GetIntegerParameter(ParameterName("LaplaceNY"));
+	n[2] = 1;
+	if (fPm->ParameterExists(ParameterName("LaplaceNZ")))
+		n[2] = fPm->GetIntegerParameter(ParameterName("LaplaceNZ"));
+	halfLength[0] = fPm->GetDoubleParameter(ParameterName("LaplaceHLX"), "Length");
+	halfLength[1] = fPm->GetDoubleParameter(ParameterName("LaplaceHLY"), "Length");
+	halfLength[2] = n[2] > 1 ? fPm->GetDoubleParameter(ParameterName("LaplaceHLZ"), "Length") : 0.;
+
+	if (n[0] < 2 || n[1] < 2 || n[2] < 1) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The Laplace grid of " << fComponent->GetName() << (fPrefix != "" ? " " + fPrefix : "") << " needs at least two nodes along X and Y." << G4endl;
+		fPm->AbortSession(1);
+	}
+
+	fFileName = "Laplace solution of " + fComponent->GetName() + (fPrefix != "" ? " " + fPrefix : "");
+	fSolver = new HGMELaplaceSolver(n, halfLength);
+
+	G4String name = ParameterName("LaplaceBoundary");
+	if (fPm->ParameterExists(name)) {
+		G4String value = ToLower(fPm->GetStringParameter(name));
+		if (value == "grounded")
+			fSolver->SetGroundedBoundary(true);
+		else if (value != "neumann")
+			AbortParameter(name, "Neumann or Grounded");
+	}
+
+	if (fPm->ParameterExists(ParameterName("LaplaceTolerance")))
+		fSolver->SetTolerance(fPm->GetUnitlessParameter(ParameterName("LaplaceTolerance")));
+	if (fPm->ParameterExists(ParameterName("LaplaceMaxIterations")))
+		fSolver->SetMaxIterations(fPm->GetIntegerParameter(ParameterName("LaplaceMaxIterations")));
+
+	G4int threads = std::max(1U, std::thread::hardware_concurrency());
+	if (fPm->ParameterExists(ParameterName("LaplaceThreads")))
+		threads = fPm->GetIntegerParameter(ParameterName("LaplaceThreads"));
+	fSolver->SetNumberOfThreads(threads);
+
+	if (fPm->ParameterExists(ParameterName("LaplaceCache")))
+		fUseCache = fPm->GetBooleanParameter(ParameterName("LaplaceCache"));
+	if (fPm->ParameterExists(ParameterName("LaplaceCacheDirectory")))
+		fCacheDirectory = fPm->GetStringParameter(ParameterName("LaplaceCacheDirectory"));
+
+	name = ParameterName("LaplaceElectrodes");
+	G4int nElectrodes = fPm->GetVectorLength(name);
+	G4String* electrodeNames = fPm->GetStringVector(name);
+	for (G4int e = 0; e < nElectrodes; e++) {
+		G4String electrodePrefix = "Laplace/" + electrodeNames[e] + "/";
+		HGMELaplaceSolver::Electrode electrode;
+		electrode.axis = 0;
+		electrode.position = 0.;
+		electrode.radius = 0.;
+		for (G4int axis = 0; axis < 3; axis++) {
+			electrode.center[axis] = 0.;
+			electrode.halfLength[axis] = 0.;
+		}
+		electrode.potential = fPm->GetUnitlessParameter(ParameterName(electrodePrefix + "Potential")) * volt;
+
+		const char* axisNames[3] = {"X", "Y", "Z"};
+		name = ParameterName(electrodePrefix + "Shape");
+		G4String shape = ToLower(fPm->GetStringParameter(name));
+		if (shape == "plane") {
+			electrode.shape = HGMELaplaceSolver::Electrode::kPlane;
+			G4String axisName = ToLower(fPm->GetStringParameter(ParameterName(electrodePrefix + "Axis")));
+			electrode.axis = axisName == "y" ? 1 : (axisName == "z" ? 2 : 0);
+			if ((axisName != "x" && axisName != "y" && axisName != "z") || n[electrode.axis] == 1)
+				AbortParameter(ParameterName(electrodePrefix + "Axis"), "X, Y or, for 3D grids, Z");
+			electrode.position = fPm->GetDoubleParameter(ParameterName(electrodePrefix + "Position"), "Length");
+		} else if (shape == "wire") {
+			electrode.shape = HGMELaplaceSolver::Electrode::kWire;
+			electrode.center[0] = fPm->GetDoubleParameter(ParameterName(electrodePrefix + "CenterX"), "Length");
+			electrode.center[1] = fPm->GetDoubleParameter(ParameterName(electrodePrefix + "CenterY"), "Length");
+			if (fPm->ParameterExists(ParameterName(electrodePrefix + "Radius")))
+				electrode.radius = fPm->GetDoubleParameter(ParameterName(electrodePrefix + "Radius"), "Length");
+		} else if (shape == "box") {
+			electrode.shape = HGMELaplaceSolver::Electrode::kBox;
+			for (G4int axis = 0; axis < 3; axis++) {
+				G4String centerName = ParameterName(electrodePrefix + "Center" + axisNames[axis]);
+				if (fPm->ParameterExists(centerName))
+					electrode.center[axis] = fPm->GetDoubleParameter(centerName, "Length");
+				G4String halfLengthName = ParameterName(electrodePrefix + "HL" + axisNames[axis]);
+				if (fPm->ParameterExists(halfLengthName))
+					electrode.halfLength[axis] = fPm->GetDoubleParameter(halfLengthName, "Length");
+			}
+		} else {
+			AbortParameter(name, "Plane, Wire or Box");
+		}
+		fSolver->AddElectrode(electrode);
+	}
+	delete[] electrodeNames;
+}
+
+void HGMEFieldMapLoader::ReadNpyOptions() {
+	const G4bool magnetic = fFieldUnit == "Magnetic flux density";
+	const char* gridNames[2] = {"NpyOrigin", "NpySpacing"};
+	G4double* grids[2] = {fNpyOrigin, fNpySpacing};
+	G4bool gridSet[2] = {false, false};
+
+	// The grid may come from a header file next to the array, such as
+	//   origin -100 -100 -500 mm
+	//   spacing 2 2 5 mm
+	//   unit T
+	// The parameters override it.
+	// Without a component, as after SetFileName, only the header file is read
+	G4String name = fComponent ? ParameterName("NpyHeaderFile") : G4String();
+	const G4bool named = fComponent && fPm->ParameterExists(name);
+	G4String headerFile = fFileName;
+	if (headerFile.size() > 4 && ToLower(headerFile.substr(headerFile.size() - 4)) == ".npy")
+		headerFile.erase(headerFile.size() - 4);
+	headerFile = named ? fPm->GetStringParameter(name) : headerFile + ".hdr";
+	std::ifstream header(headerFile);
+	if (named && !header) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The parameter: " << name << G4endl;
+		G4cerr << "references an Npy header file that cannot be found:" << G4endl;
+		G4cerr << headerFile << G4endl;
+		fPm->AbortSession(1);
+	}
+
+	G4String line;
+	while (getline(header, line)) {
+		std::istringstream fields(line.substr(0, line.find('#')));
+		G4String key;
+		if (!(fields >> key))
+			continue;
+		key = ToLower(key);
+		G4String unitName;
+		G4bool valid = false;
+		if (key == "origin" || key == "spacing") {
+			const G4int g = key == "origin" ? 0 : 1;
+			G4double values[3];
+			if (fields >> values[0] >> values[1] >> values[2] >> unitName) {
+				const G4double unit = NpyUnit(unitName, true, magnetic);
+				for (G4int axis = 0; axis < 3; axis++)
+					grids[g][axis] = values[axis] * unit;
+				gridSet[g] = true;
+				valid = unit > 0.;
+			}
+		} else if (key == "unit" && fields >> unitName) {
+			fNpyFieldUnit = NpyUnit(unitName, false, magnetic);
+			valid = fNpyFieldUnit > 0.;
+		}
+		if (!valid) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "Npy header file " << headerFile << " has an unknown line:" << G4endl;
+			G4cerr << line << G4endl;
+			G4cerr << "Lines are origin <x> <y> <z> <length unit>, spacing <dx> <dy> <dz> <length unit>" << G4endl;
+			G4cerr << "or unit <field unit>, with mm, cm, m or um and " << (magnetic ? "T, mT, gauss or kilogauss" : "kV/mm, V/mm, kV/cm, V/cm, V/m or MV/m") << G4endl;
+			fPm->AbortSession(1);
+		}
+	}
+
+	for (G4int g = 0; g < 2; g++) {
+		name = fComponent ? ParameterName(gridNames[g]) : G4String(gridNames[g]);
+		if (fComponent && fPm->ParameterExists(name)) {
+			if (fPm->GetVectorLength(name) != 3) {
+				G4cerr << "" << G4endl;
+				G4cerr << "Topas is exiting due to a serious error." << G4endl;
+				G4cerr << "The parameter: " << name << G4endl;
+				G4cerr << "must have three values, for X, Y and Z." << G4endl;
+				fPm->AbortSession(1);
+			}
+			G4double* values = fPm->GetDoubleVector(name, "Length");
+			for (G4int axis = 0; axis < 3; axis++)
+				grids[g][axis] = values[axis];
+			delete[] values;
+			gridSet[g] = true;
+		}
+		if (!gridSet[g]) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "The grid of " << fFileName << " is unknown." << G4endl;
+			G4cerr << "Set the parameter " << name << " or give the " << (g == 0 ? "origin" : "spacing")
+			<< " in the Npy header file " << headerFile << G4endl;
+			fPm->AbortSession(1);
+		}
+	}
+
+	name = fComponent ? ParameterName("NpyFieldUnit") : G4String();
+	if (fComponent && fPm->ParameterExists(name))
+		fNpyFieldUnit = fPm->GetDoubleParameter(name, fFieldUnit);
+	if (fNpyFieldUnit == 0.)
+		fNpyFieldUnit = magnetic ? tesla : kilovolt / mm;
+}
+
+void HGMEFieldMapLoader::LoadLaplace(HGMEFieldTable* table) {
+	G4String key = fSolver->GetDescription() + (fPrecision == HGMEFieldTable::kFloat ? " float" : " double");
+	const G4String cacheName = HGMETabulation::CacheName(fCacheDirectory, "HGMELaplace", Hash(key.data(), key.size()));
+
+	if (fUseCache && HGMETabulation::ReadCache(cacheName, [table](std::istream& cache) { return table->ReadBinary(cache); })) {
+		G4cout << "Read cached Laplace solution " << cacheName << G4endl;
+		return;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	fSolver->Solve(table, fPrecision);
+	G4cout << "Solved " << fFileName << " in "
+	<< std::chrono::duration<G4double>(std::chrono::steady_clock::now() - start).count() << " s" << G4endl;
+
+	if (fUseCache)
+		HGMETabulation::WriteCache(cacheName, "Laplace", [table](std::ostream& cache) { table->WriteBinary(cache); });
+}
+
+uint64_t HGMEFieldMapLoader::Hash(const void* data, size_t size, uint64_t hash) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint64_t HGMEFieldMapLoader::HashFile(const G4String& fileName, uint64_t hash) {
+	std::ifstream file(fileName, std::ios::binary);
+	std::vector<char> buffer(1 << 20);
+	while (file.read(&buffer[0], buffer.size()) || file.gcount() > 0)
+		hash = Hash(&buffer[0], file.gcount(), hash);
+	return hash;
+}
+
+G4String HGMEFieldMapLoader::GetSharingKey() const {
+	std::ostringstream key;
+	key << (fSource == kLaplace ? fSolver->GetDescription() : "table " + fFileName)
+	<< " precision " << fPrecision << " resample " << fResampleMaxError
+	<< " series " << fSeriesOrder << " " << fSeriesPatches[0] << " " << fSeriesPatches[1] << " " << fSeriesMaxResidual
+	<< " layout " << fLayout << " geometry " << fGeometry << " pages " << fHugePages << " shared " << fSharedMemory;
+	if (IsCropped())
+		key << " crop " << fCropMin[0] << " " << fCropMin[1] << " " << fCropMin[2] << " " << fCropMax[0]
+		<< " " << fCropMax[1] << " " << fCropMax[2];
+	if (fSource == kNpy)
+		key << " grid " << fNpyOrigin[0] << " " << fNpyOrigin[1] << " " << fNpyOrigin[2] << " " << fNpySpacing[0]
+		<< " " << fNpySpacing[1] << " " << fNpySpacing[2] << " " << fNpyFieldUnit << " " << fPrecisionSet;
+	return key.str();
+}
+
+void HGMEFieldMapLoader::Load(HGMEFieldTable* table) {
+	// The first thread loads the table, the others take a copy sharing its
+	// nodes. Later runs reuse it too, unless the file content has changed.
+	std::shared_ptr<SharedTable> shared = FindShared(GetSharingKey());
+	G4AutoLock lock(&shared->mutex);
+	Share(*shared);
+	*table = shared->table;
+
+	if (fSmoothnessBlock > 0) {
+		std::shared_ptr<const HGMEFieldSmoothness>& smoothness = shared->smoothness;
+		if (!smoothness || smoothness->GetBlock() != fSmoothnessBlock) {
+			smoothness = std::make_shared<HGMEFieldSmoothness>(shared->table, fSmoothnessBlock);
+			const G4bool magnetic = fFieldUnit == "Magnetic flux density";
+			const G4double unit = magnetic ? tesla : kilovolt / mm;
+			G4cout << "Smoothness table of " << fFileName << ": " << smoothness->GetNumberOfBlocks(0) << " x "
+			<< smoothness->GetNumberOfBlocks(1) << " x " << smoothness->GetNumberOfBlocks(2) << " blocks of "
+			<< fSmoothnessBlock << " cells, " << smoothness->GetMemorySize() << " bytes, largest field "
+			<< smoothness->GetMaxField() / unit << (magnetic ? " T" : " kV/mm") << ", largest gradient "
+			<< smoothness->GetMaxGradient() / unit * mm << (magnetic ? " T/mm" : " kV/mm2") << G4endl;
+		}
+		fSmoothness = smoothness;
+	}
+
+	if (fEnvelopeThreshold >= 0.) {
+		SharedTable& loaded = *shared;
+		if (loaded.envelopeThreshold != fEnvelopeThreshold) {
+			loaded.envelopeThreshold = fEnvelopeThreshold;
+			loaded.envelopeHasField = HGMEFieldEnvelope::Measure(loaded.table, fEnvelopeThreshold, loaded.envelope, loaded.envelope + 3);
+			if (!loaded.envelopeHasField) {
+				G4cout << "Field envelope of " << fFileName << ": no field above the threshold" << G4endl;
+			} else {
+				// Share of the bounded extent of the table it covers
+				G4double tableMin[3], tableMax[3];
+				loaded.table.GetBounds(tableMin, tableMax);
+				const G4double extent[3] = {tableMax[0] - tableMin[0], tableMax[1] - tableMin[1], tableMax[2] - tableMin[2]};
+				G4double share = 1.;
+				G4cout << "Field envelope of " << fFileName << ":";
+				for (G4int axis = 0; axis < 3; axis++) {
+					if (extent[axis] <= 0. || extent[axis] >= DBL_MAX)
+						continue;
+					G4cout << " " << "xyz"[axis] << " " << loaded.envelope[axis] / mm << " to " << loaded.envelope[3 + axis] / mm << " mm";
+					share *= (loaded.envelope[3 + axis] - loaded.envelope[axis]) / extent[axis];
+				}
+				G4cout << ", " << std::fixed << std::setprecision(1) << 100. * share << std::defaultfloat << std::setprecision(6)
+				<< "% of the table" << G4endl;
+			}
+		}
+		fEnvelopeHasField = loaded.envelopeHasField;
+		std::copy(loaded.envelope, loaded.envelope + 6, fEnvelope);
+	}
+
+	if (fNUMAReplicas) {
+		G4int nodes = HGMEFieldStorage::GetNumberOfNodes();
+		G4int node = HGMEFieldStorage::GetThreadNode();
+		if (nodes > 1 && node >= 0) {
+			std::map<G4int,HGMEFieldTable>::iterator replica = shared->replicas.find(node);
+			if (replica == shared->replicas.end()) {
+				replica = shared->replicas.insert(std::make_pair(node, shared->table.Replicate(node))).first;
+				G4cout << "Field table " << fFileName << ": replica for NUMA node " << node << ", "
+				<< replica->second.GetStorage().Describe() << G4endl;
+			}
+			*table = replica->second;
+		} else if (!shared->replicasReported) {
+			shared->replicasReported = true;
+			G4cout << "Field table " << fFileName << ": NUMA replicas not made, "
+			<< (nodes > 1 ? "the node of the thread is unknown" : "the system has a single NUMA node") << G4endl;
+		}
+	}
+
+	table->SetInterpolation(fInterpolation);
+}
+
+G4bool HGMEFieldMapLoader::Preload() {
+	std::shared_ptr<SharedTable> shared = FindShared(GetSharingKey());
+	G4AutoLock lock(&shared->mutex);
+	return Share(*shared);
+}
+
+void HGMEFieldMapLoader::Unload() {
+	G4AutoLock lock(&sharedTablesMutex);
+	GetSharedTables().erase(GetSharingKey());
+}
+
+std::shared_ptr<HGMEFieldMapLoader::SharedTable> HGMEFieldMapLoader::FindShared(const G4String& key) {
+	G4AutoLock lock(&sharedTablesMutex);
+	std::shared_ptr<SharedTable>& shared = GetSharedTables()[key];
+	if (!shared)
+		shared = std::make_shared<SharedTable>();
+	return shared;
+}
+
+std::map<G4String,std::shared_ptr<HGMEFieldMapLoader::SharedTable> >& HGMEFieldMapLoader::GetSharedTables() {
+	static std::map<G4String,std::shared_ptr<SharedTable> > sharedTables;
+	return sharedTables;
+}
+
+G4bool HGMEFieldMapLoader::Share(SharedTable& shared) {
+	// The content is hashed once per load, unless the table is already loaded
+	// from a file of the same size and modification time. It is taken before
+	// loading, so a change during the load is seen next time, and also names
+	// the shared memory segment.
+	Fingerprint fingerprint;
+	const G4bool file = fSource != kLaplace && fingerprint.ReadStatus(fFileName);
+	if (shared.loaded && (!file || SameStatus(fingerprint, shared.fingerprint)))
+		return false;
+	if (file)
+		fingerprint.hash = HashFile(fFileName);
+	if (shared.loaded) {
+		if (fingerprint.hash == shared.fingerprint.hash) {
+			shared.fingerprint = fingerprint;
+			return false;
+		}
+		G4cout << "Field table " << fFileName << " has changed, reloading it" << G4endl;
+		shared.replicas.clear();
+		shared.replicasReported = false;
+		shared.smoothness.reset();
+		shared.envelopeThreshold = -1.;
+	}
+
+	fSourceHash = fingerprint.hash;
+	shared.fingerprint = fingerprint;
+	shared.table = HGMEFieldTable();
+	shared.table.SetHugePages(fHugePages);
+	if (fSharedMemory)
+		LoadShared(&shared.table);
+	else
+		LoadSource(&shared.table);
+	shared.loaded = true;
+	G4cout << "Field table " << fFileName << ": " << shared.table.GetMemorySize() << " bytes, "
+	<< shared.table.GetStorage().Describe() << G4endl;
+	return true;
+}
+
+G4bool HGMEFieldMapLoader::GetEnvelope(G4double min[3], G4double max[3]) const {
+	std::copy(fEnvelope, fEnvelope + 3, min);
+	std::copy(fEnvelope + 3, fEnvelope + 6, max);
+	return fEnvelopeHasField;
+}
+
+G4String HGMEFieldMapLoader::GetSegmentName() const {
+	// The options without the file name, which the content replaces
+	std::ostringstream options;
+	options << (fSource == kLaplace ? fSolver->GetDescription() : "table")
+	<< " precision " << fPrecision << " resample " << fResampleMaxError
+	<< " series " << fSeriesOrder << " " << fSeriesPatches[0] << " " << fSeriesPatches[1] << " " << fSeriesMaxResidual
+	<< " layout " << fLayout << " geometry " << fGeometry;
+	if (IsCropped())
+		options << " crop " << fCropMin[0] << " " << fCropMin[1] << " " << fCropMin[2] << " " << fCropMax[0]
+		<< " " << fCropMax[1] << " " << fCropMax[2];
+	if (fSource == kNpy)
+		options << " grid " << fNpyOrigin[0] << " " << fNpyOrigin[1] << " " << fNpyOrigin[2] << " " << fNpySpacing[0]
+		<< " " << fNpySpacing[1] << " " << fNpySpacing[2] << " " << fNpyFieldUnit << " " << fPrecisionSet;
+	// The content enters through the hash taken by Load
+	uint64_t hash = Hash(options.str().data(), options.str().size());
+	if (fSource != kLaplace)
+		hash = Hash(&fSourceHash, sizeof(fSourceHash), hash);
+
+	std::ostringstream name;
+	name << "HGMEFieldTable_" << std::hex << std::setw(16) << std::setfill('0') << hash;
+	return name.str();
+}
+
+void HGMEFieldMapLoader::LoadShared(HGMEFieldTable* table) {
+	if (fSeriesOrder > 0) {
+		G4cout << "Field table " << fFileName << ": multipole series are not placed in shared memory" << G4endl;
+		LoadSource(table);
+		return;
+	}
+
+	const G4String name = GetSegmentName();
+	std::shared_ptr<HGMEFieldStorage> storage = std::make_shared<HGMEFieldStorage>();
+	HGMEFieldStorage::SharedLock lock(fSharedMemoryDirectory, name);
+	if (!lock.IsLocked()) {
+		G4cout << "Field table " << fFileName << ": the lock file of shared segment " << name << " cannot be taken in "
+		<< fSharedMemoryDirectory << ", the table is kept in private memory" << G4endl;
+		LoadSource(table);
+		return;
+	}
+	if (storage->OpenShared(fSharedMemoryDirectory, name) && table->MapImage(storage)) {
+		G4cout << "Field table " << fFileName << ": attached to shared segment " << name << G4endl;
+	} else {
+		HGMEFieldTable loaded;
+		loaded.SetHugePages(fHugePages);
+		LoadSource(&loaded);
+		try {
+			storage->CreateShared(fSharedMemoryDirectory, name, loaded.GetImageSize());
+		} catch (const std::bad_alloc&) {
+			// Full /dev/shm or directory, or a users file that cannot be opened
+			G4cout << "Field table " << fFileName << ": shared segment " << name << " of " << loaded.GetImageSize()
+			<< " bytes cannot be created, the table is kept in private memory" << G4endl;
+			*table = loaded;
+			return;
+		}
+		loaded.WriteImage(storage->GetData());
+		storage->PublishShared();
+		table->MapImage(storage);
+		G4cout << "Field table " << fFileName << ": published to shared segment " << name << G4endl;
+	}
+	table->SetGeometry(fGeometry);
+	table->SetInterpolation(fInterpolation);
+}
+
+void HGMEFieldMapLoader::LoadSource(HGMEFieldTable* table) {
+	if (fSource == kLaplace) {
+		LoadLaplace(table);
+		Finish(fFileName, table);
+		return;
+	}
+	if (fSource == kNpy) {
+		LoadNpy(table);
+		Finish(fFileName, table);
+		return;
+	}
+
+	std::ifstream file(fFileName);
+	if (!file) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The parameter: " << fParameterName << G4endl;
+		G4cerr << "references a MagneticField3DTable file that cannot be found:" << G4endl;
+		G4cerr << fFileName << G4endl;
+		fPm->AbortSession(1);
+	}
+	Load(file, fFileName, table);
+	file.close();
+}
+
+void HGMEFieldMapLoader::LoadNpy(HGMEFieldTable* table) {
+	std::shared_ptr<HGMEFieldStorage> storage = std::make_shared<HGMEFieldStorage>();
+	if (!storage->MapFile(fFileName)) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The parameter: " << fParameterName << G4endl;
+		G4cerr << "references an .npy file that cannot be found or mapped:" << G4endl;
+		G4cerr << fFileName << G4endl;
+		fPm->AbortSession(1);
+	}
+
+	const char* bytes = static_cast<const char*>(storage->GetData());
+	NpyHeader header;
+	G4String reason = ParseNpyHeader(bytes, storage->GetSize(), header);
+	const std::vector<size_t>& shape = header.shape;
+	if (reason == "" && ((shape.size() != 3 && shape.size() != 4) || shape.back() != 3))
+		reason = "The array must have the shape (nx, ny, nz, 3), or (nx, ny, 3) for a Z-invariant map.";
+	size_t nodes = 1;
+	for (size_t d = 0; reason == "" && d + 1 < shape.size(); d++) {
+		if (shape[d] < 1 || shape[d] > 0x7fffffff)
+			reason = "The array has an empty or too long axis.";
+		nodes *= shape[d];
+	}
+	if (reason == "" && header.dataOffset + 3 * nodes * header.elementSize > storage->GetSize())
+		reason = "The file is shorter than its array.";
+	if (reason != "")
+		Abort(fFileName, reason);
+
+	const G4int n[3] = {(G4int)shape[0], (G4int)shape[1], shape.size() == 4 ? (G4int)shape[2] : 1};
+	for (G4int axis = 0; axis < 3; axis++)
+		if (n[axis] > 1 && fNpySpacing[axis] == 0.)
+			Abort(fFileName, "The node spacing must not be zero along axes with several nodes.");
+
+	// The kernels read little-endian row-major nodes with z running fastest
+	// and the components interleaved, which is the C order of the array
+	const uint16_t probe = 1;
+	const G4bool littleHost = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+	const HGMEFieldTable::Precision filePrecision = header.elementSize == 8 ? HGMEFieldTable::kDouble : HGMEFieldTable::kFloat;
+	G4String copyReason;
+	if (header.fortranOrder)
+		copyReason = "the array is in Fortran order";
+	else if (!header.littleEndian || !littleHost)
+		copyReason = "the byte order differs from the one of the machine";
+	else if (fPrecisionSet && fPrecision != filePrecision)
+		copyReason = "FieldStoragePrecision differs from the precision of the file";
+	else if (fHugePages != HGMEFieldStorage::kNoHugePages)
+		copyReason = "huge pages are requested";
+	else if (header.dataOffset % header.elementSize != 0)
+		copyReason = "the array is not aligned";
+
+	if (copyReason == "") {
+		table->MapNodes(storage, header.dataOffset, n[0], n[1], n[2], filePrecision, fNpyFieldUnit);
+		G4cout << "Field table " << fFileName << ": " << n[0] << " x " << n[1] << " x " << n[2]
+		<< " nodes mapped in place" << G4endl;
+	} else {
+		table->Allocate(n[0], n[1], n[2], fPrecisionSet ? fPrecision : filePrecision);
+		const G4bool swap = header.littleEndian != littleHost;
+		const size_t size = header.elementSize;
+		const char* data = bytes + header.dataOffset;
+		for (G4int ix = 0; ix < n[0]; ix++) {
+			for (G4int iy = 0; iy < n[1]; iy++) {
+				for (G4int iz = 0; iz < n[2]; iz++) {
+					G4double field[3];
+					for (G4int c = 0; c < 3; c++) {
+						const size_t element = header.fortranOrder ?
+						ix + (size_t)n[0] * (iy + (size_t)n[1] * (iz + (size_t)n[2] * c)) :
+						(((size_t)ix * n[1] + iy) * n[2] + iz) * 3 + c;
+						char value[8];
+						std::memcpy(value, data + element * size, size);
+						if (swap)
+							std::reverse(value, value + size);
+						if (size == 8) {
+							double number;
+							std::memcpy(&number, value, 8);
+							field[c] = number * fNpyFieldUnit;
+						} else {
+							float number;
+							std::memcpy(&number, value, 4);
+							field[c] = number * fNpyFieldUnit;
+						}
+					}
+					table->SetNode(ix, iy, iz, field[0], field[1], field[2]);
+				}
+			}
+		}
+		G4cout << "Field table " << fFileName << ": " << n[0] << " x " << n[1] << " x " << n[2]
+		<< " nodes copied, " << copyReason << G4endl;
+	}
+
+	table->SetLimits(fNpyOrigin[0], fNpyOrigin[1], fNpyOrigin[2],
+					 fNpyOrigin[0] + (n[0] - 1) * fNpySpacing[0],
+					 fNpyOrigin[1] + (n[1] - 1) * fNpySpacing[1],
+					 fNpyOrigin[2] + (n[2] - 1) * fNpySpacing[2]);
+}
+
+void HGMEFieldMapLoader::Load(std::istream& input, const G4String& fileName, HGMEFieldTable* table) {
+	G4String line;
+	G4bool readingHeader = true;
+	G4int counter = 0;
+	G4int nx = 0, ny = 0, nz = 0;
+	G4double xval = 0., yval = 0., zval = 0., bx, by, bz;
+	G4double firstX = 0., firstY = 0., firstZ = 0.;
+	G4int ix = 0, iy = 0, iz = 0;
+
+	// Nodes kept along each axis, with the corners of the whole table
+	G4bool cropped = false;
+	G4int keep[3][2];
+	G4double first[3], last[3];
+
+	// Unit of every column, looked up by the column name of the header
+	std::map<G4String,G4double> headerUnits;
+	std::vector<G4String> headerUnitStrings;
+	std::vector<G4String> headerFields;
+
+	while (input.good()) {
+		getline(input,line);
+		if (line.find_last_not_of(" \t\f\v\n\r") == std::string::npos)
+			continue;
+
+		// Rows outside the crop box are counted without being parsed
+		if (cropped && (ix < keep[0][0] || ix > keep[0][1] || iy < keep[1][0] || iy > keep[1][1] ||
+						iz < keep[2][0] || iz > keep[2][1])) {
+			if (++iz == nz) {
+				iz = 0;
+				if (++iy == ny) {
+					iy = 0;
+					ix++;
+				}
+			}
+			continue;
+		}
+
+		// Strip leading and trailing white space
+		std::string::size_type pos = line.find_last_not_of(' ');
+		if(pos != std::string::npos) {
+			line.erase(pos + 1);
+			pos = line.find_first_not_of(" \t\n\f\v\r\n");
+			if(pos != std::string::npos) line.erase(0, pos);
+		} else {
+			line.erase(line.begin(), line.end());
+		}
+
+		std::vector<G4String> thisRow;
+		G4Tokenizer next(line);
+		G4String token = next();
+		while (token != "" && token != "\t" && token != "\n" && token != "\r" && token != "\f" && token != "\v") {
+			thisRow.push_back(token);
+			token = next();
+		}
+
+		if (readingHeader && (thisRow[0] == "0") && (counter > 0)) {
+			// Found end of header, signal start of data read
+			// Electric tables default to kV/mm, as .npy arrays do
+			const G4bool magnetic = fFieldUnit == "Magnetic flux density";
+			const G4String defaultUnit = magnetic ? "tesla" : "kV/mm";
+			if (headerUnitStrings.size() == 0) {
+				if (headerFields.size() > 6) {
+					Abort(fileName, "Only six fields (x,y,z,Bx,By,Bz) are allowed without specified units. Please include explicit unit declaration in the header");
+				} else {
+					G4cout << "No units specified, setting to 'mm' for x,y,z and '" << defaultUnit << "' for the field components" << G4endl;
+					headerUnitStrings.push_back("mm");
+					headerUnitStrings.push_back("mm");
+					headerUnitStrings.push_back("mm");
+					headerUnitStrings.push_back(defaultUnit);
+					headerUnitStrings.push_back(defaultUnit);
+					headerUnitStrings.push_back(defaultUnit);
+				}
+			}
+
+			for(G4int i = 0; i < (G4int)headerFields.size(); i++) {
+				G4String unitString = headerUnitStrings[i];
+
+				size_t f = unitString.find("[");
+				if (f != std::string::npos)
+					unitString.replace(f, std::string("[").length(), "");
+
+				f = unitString.find("]");
+				if (f != std::string::npos)
+					unitString.replace(f, std::string("]").length(), "");
+
+				// Lengths for the coordinates, the units of the field type for
+				// the other columns; 1 keeps the values in internal units
+				const G4bool length = headerFields[i] == "X" || headerFields[i] == "Y" || headerFields[i] == "Z";
+				const G4double unit = unitString == "1" ? 1. : NpyUnit(unitString, length, magnetic, true);
+				if (unit <= 0.)
+					Abort(fileName, "Unknown unit [" + unitString + "] of column " + headerFields[i] + ". Lengths take um, mm, cm or m; " +
+						  (magnetic ? "magnetic fields T, mT, gauss or kilogauss." : "electric fields kV/mm, V/mm, kV/cm, V/cm, V/m or MV/m."));
+				headerUnits[headerFields[i]] = unit;
+			}
+
+			const G4int n[3] = {nx, ny, nz};
+			const G4double units[3] = {headerUnits["X"], headerUnits["Y"], headerUnits["Z"]};
+			if (IsCropped())
+				cropped = CropNodes(input, fileName, units, n, keep, first, last);
+			if (cropped)
+				table->Allocate(keep[0][1] - keep[0][0] + 1, keep[1][1] - keep[1][0] + 1, keep[2][1] - keep[2][0] + 1, fPrecision);
+			else
+				table->Allocate(nx, ny, nz, fPrecision);
+
+			readingHeader = false;
+			counter = 0;
+			continue;
+		}
+
+		if (readingHeader) {
+			if (counter == 0) {
+				// Number of nodes along x, y and z
+				nx = atoi(thisRow[0]);
+				ny = atoi(thisRow[1]);
+				nz = atoi(thisRow[2]);
+			} else {
+				if (thisRow.size() < 2) continue;
+
+				headerFields.push_back(thisRow[1]);
+				if (thisRow.size() == 3)
+					headerUnitStrings.push_back(thisRow[2]);
+
+				if (thisRow.size() > 3) {
+					G4cerr << "" << G4endl;
+					G4cerr << "Topas is exiting due to a serious error." << G4endl;
+					G4cerr << "Header information was not usable from MagneticField3DTable file:" << G4endl;
+					G4cerr << fileName << G4endl;
+					G4cerr << "Header has an unknown format on line" << G4endl;
+					G4cerr << line << G4endl;
+					G4cerr << "This error can be triggered by mismatch of linux/windows end-of-line characters." << G4endl;
+					G4cerr << "If the opera file was created in windows, try converting it with dos2unix" << G4endl;
+					fPm->AbortSession(1);
+				}
+			}
+		} else {
+			if (thisRow.size() != headerFields.size())
+				Abort(fileName, "File contains columns not in the header.");
+
+			xval = atof(thisRow[0]);
+			yval = atof(thisRow[1]);
+			zval = atof(thisRow[2]);
+			bx = atof(thisRow[3]);
+			by = atof(thisRow[4]);
+			bz = atof(thisRow[5]);
+
+			if ( ix==0 && iy==0 && iz==0 ) {
+				firstX = xval * headerUnits["X"];
+				firstY = yval * headerUnits["Y"];
+				firstZ = zval * headerUnits["Z"];
+			}
+
+			if (cropped)
+				table->SetNode(ix - keep[0][0], iy - keep[1][0], iz - keep[2][0],
+							   bx * headerUnits["BX"], by * headerUnits["BY"], bz * headerUnits["BZ"]);
+			else
+				table->SetNode(ix, iy, iz, bx * headerUnits["BX"], by * headerUnits["BY"], bz * headerUnits["BZ"]);
+
+			// Nodes are listed with z running fastest
+			iz++;
+			if (iz == nz) {
+				iy++;
+				iz = 0;
+			}
+
+			if (iy == ny) {
+				ix++;
+				iy = 0;
+			}
+		}
+
+		counter++;
+	}
+
+	if (nx == 0)
+		Abort(fileName, "");
+
+	if (cropped) {
+		G4double limits[6];
+		for (G4int axis = 0; axis < 3; axis++) {
+			const G4int n = axis == 0 ? nx : (axis == 1 ? ny : nz);
+			const G4double spacing = n > 1 ? (last[axis] - first[axis]) / (n - 1) : 0.;
+			limits[axis] = first[axis] + keep[axis][0] * spacing;
+			limits[3 + axis] = first[axis] + keep[axis][1] * spacing;
+		}
+		table->SetLimits(limits[0], limits[1], limits[2], limits[3], limits[4], limits[5]);
+	} else {
+		// The last row read is the far corner of the table
+		table->SetLimits(firstX, firstY, firstZ,
+						 xval * headerUnits["X"], yval * headerUnits["Y"], zval * headerUnits["Z"]);
+	}
+	Finish(fileName, table);
+}
+
+G4bool HGMEFieldMapLoader::CropNodes(std::istream& input, const G4String& fileName, const G4double units[3],
+									 const G4int n[3], G4int keep[3][2], G4double first[3], G4double last[3]) const {
+	// The corners are the first and the last data rows. Streams that cannot
+	// seek back are read whole.
+	const std::streampos start = input.tellg();
+	if (start < 0)
+		return false;
+	G4String firstRow;
+	while (getline(input, firstRow) && firstRow.find_first_not_of(" \t\f\v\r") == std::string::npos) {}
+	input.clear();
+	input.seekg(0, std::ios::end);
+	const std::streamoff end = input.tellg();
+	const std::streamoff tail = std::min<std::streamoff>(end - start, 4096);
+	std::string lastRow(tail, ' ');
+	input.seekg(end - tail);
+	input.read(&lastRow[0], tail);
+	input.clear();
+	input.seekg(start);
+	const size_t rowEnd = lastRow.find_last_not_of(" \t\f\v\r\n");
+	if (rowEnd == std::string::npos)
+		return false;
+	const size_t rowStart = lastRow.find_last_of('\n', rowEnd);
+	const size_t rowBegin = rowStart == std::string::npos ? 0 : rowStart + 1;
+	lastRow = lastRow.substr(rowBegin, rowEnd + 1 - rowBegin);
+
+	std::istringstream firstValues(firstRow), lastValues(lastRow);
+	for (G4int axis = 0; axis < 3; axis++) {
+		firstValues >> first[axis];
+		lastValues >> last[axis];
+		first[axis] *= units[axis];
+		last[axis] *= units[axis];
+	}
+	if (!firstValues || !lastValues)
+		return false;
+
+	// Axisymmetric tables hold the radius along X and no Y
+	G4double cropMin[3], cropMax[3];
+	std::copy(fCropMin, fCropMin + 3, cropMin);
+	std::copy(fCropMax, fCropMax + 3, cropMax);
+	if (fGeometry == HGMEFieldTable::kAxisymmetric) {
+		G4double nearest = 0., farthest = 0.;
+		for (G4int axis = 0; axis < 2; axis++) {
+			const G4double gap = std::max(0., std::max(fCropMin[axis], -fCropMax[axis]));
+			const G4double reach = std::max(std::abs(fCropMin[axis]), std::abs(fCropMax[axis]));
+			nearest += gap * gap;
+			farthest += reach * reach;
+		}
+		cropMin[0] = std::sqrt(nearest);
+		cropMax[0] = std::min(DBL_MAX, std::sqrt(farthest));
+		cropMin[1] = -DBL_MAX;
+		cropMax[1] = DBL_MAX;
+	}
+
+	// One cell beyond the cells the box touches
+	G4bool cropped = false;
+	for (G4int axis = 0; axis < 3; axis++) {
+		keep[axis][0] = 0;
+		keep[axis][1] = n[axis] - 1;
+		if (n[axis] < 2 || last[axis] == first[axis])
+			continue;
+		const G4double spacing = (last[axis] - first[axis]) / (n[axis] - 1);
+		const G4double a = (std::max(cropMin[axis], -1.e300) - first[axis]) / spacing;
+		const G4double b = (std::min(cropMax[axis], 1.e300) - first[axis]) / spacing;
+		const G4double low = std::floor(std::min(a, b)) - 1.;
+		const G4double high = std::ceil(std::max(a, b)) + 1.;
+		if (high < 0. || low > n[axis] - 1.) {
+			G4cout << "Field table " << fileName << " does not reach the component, it is kept whole" << G4endl;
+			return false;
+		}
+		keep[axis][0] = (G4int)std::max(0., low);
+		keep[axis][1] = (G4int)std::min(n[axis] - 1., high);
+		cropped = cropped || keep[axis][1] - keep[axis][0] + 1 < n[axis];
+	}
+
+	if (cropped)
+		G4cout << "Field table " << fileName << ": cropped from " << n[0] << " x " << n[1] << " x " << n[2] << " to "
+		<< keep[0][1] - keep[0][0] + 1 << " x " << keep[1][1] - keep[1][0] + 1 << " x " << keep[2][1] - keep[2][0] + 1
+		<< " nodes around the component" << G4endl;
+	return cropped;
+}
+
+void HGMEFieldMapLoader::Finish(const G4String& fileName, HGMEFieldTable* table) {
+	if (fGeometry == HGMEFieldTable::kAxisymmetric) {
+		if (!table->SetGeometry(fGeometry)) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "FieldTableGeometry Axisymmetric needs an (r, z) table, with at least two nodes along X for r >= 0 and one node along Y:" << G4endl;
+			G4cerr << fileName << G4endl;
+			fPm->AbortSession(1);
+		}
+		const G4double removed = table->ClearAxis();
+		if (removed > 0.) {
+			const G4bool magnetic = fFieldUnit == "Magnetic flux density";
+			G4cout << "Field table " << fileName << ": radial and azimuthal components of up to "
+			<< removed / (magnetic ? tesla : kilovolt / mm) << (magnetic ? " T" : " kV/mm") << " on the axis set to zero" << G4endl;
+		}
+	}
+
+	if (fResampleMaxError > 0.) {
+		const G4bool magnetic = fFieldUnit == "Magnetic flux density";
+		const G4double unit = magnetic ? tesla : kilovolt / mm;
+		const char* unitName = magnetic ? " T" : " kV/mm";
+		const G4int n[3] = {table->GetNX(), table->GetNY(), table->GetNZ()};
+		HGMEFieldResampler resampler(fResampleMaxError);
+		if (resampler.Resample(table)) {
+			G4cout << "Resampled " << fileName << " from " << n[0] << " x " << n[1] << " x " << n[2]
+			<< " to " << table->GetNX() << " x " << table->GetNY() << " x " << table->GetNZ() << " nodes, memory "
+			<< resampler.GetOriginalMemory() << " -> " << resampler.GetResampledMemory() << " bytes ("
+			<< std::fixed << std::setprecision(1)
+			<< 100. * (1. - G4double(resampler.GetResampledMemory()) / resampler.GetOriginalMemory())
+			<< std::defaultfloat << std::setprecision(6) << "% less), worst deviation "
+			<< resampler.GetMaxDeviation() / unit << unitName << " for a tolerance of "
+			<< fResampleMaxError / unit << unitName << G4endl;
+		} else {
+			G4cout << "Kept " << fileName << " at " << n[0] << " x " << n[1] << " x " << n[2]
+			<< " nodes, no coarser grid meets ResampleMaxFieldError" << G4endl;
+		}
+	}
+	if (fSeriesOrder > 0)
+		FitSeries(fileName, table);
+
+	table->SetLayout(fLayout);
+	table->SetGeometry(fGeometry);
+	table->SetInterpolation(fInterpolation);
+}
+
+void HGMEFieldMapLoader::FitSeries(const G4String& fileName, HGMEFieldTable* table) {
+	if (table->GetNZ() != 1 || table->GetNX() < 2 || table->GetNY() < 2) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "FieldRepresentation Multipole needs a Z-invariant table (one node along Z) with at least two nodes along X and Y:" << G4endl;
+		G4cerr << fileName << G4endl;
+		fPm->AbortSession(1);
+	}
+
+	const G4bool magnetic = fFieldUnit == "Magnetic flux density";
+	const G4double unit = magnetic ? tesla : kilovolt / mm;
+	const char* unitName = magnetic ? " T" : " kV/mm";
+
+	HGMEFieldSeriesFitter fitter(fSeriesOrder, fSeriesPatches[0], fSeriesPatches[1]);
+	if (!fitter.Fit(*table)) {
+		G4cout << "Kept the table of " << fileName << ", its " << fSeriesPatches[0] << " x " << fSeriesPatches[1]
+		<< " patches do not all hold " << fSeriesOrder << " nodes" << G4endl;
+		return;
+	}
+
+	G4cout << "Multipole fit of " << fileName << ": order " << fSeriesOrder << ", "
+	<< fSeriesPatches[0] << " x " << fSeriesPatches[1] << " patches, " << fitter.GetNumberOfCoefficients() * sizeof(G4double)
+	<< " bytes instead of " << table->GetMemorySize() << ", residual max " << fitter.GetMaxResidual() / unit
+	<< unitName << " rms " << fitter.GetRmsResidual() / unit << unitName << " (max field "
+	<< fitter.GetMaxField() / unit << unitName << ")" << G4endl;
+
+	if (fSeriesMaxResidual > 0. && fitter.GetMaxResidual() > fSeriesMaxResidual) {
+		G4cout << "Kept the table of " << fileName << ", the residual exceeds MultipoleMaxResidual of "
+		<< fSeriesMaxResidual / unit << unitName << G4endl;
+		return;
+	}
+	fitter.Apply(table);
+}
+
+void HGMEFieldMapLoader::Abort(const G4String& fileName, const G4String& reason) {
+	G4cerr << "" << G4endl;
+	G4cerr << "Topas is exiting due to a serious error." << G4endl;
+	G4cerr << "Header information was not usable from MagneticField3DTable file:" << G4endl;
+	G4cerr << fileName << G4endl;
+	if (reason != "")
+		G4cerr << reason << G4endl;
+	fPm->AbortSession(1);
+}
+
+void HGMEFieldMapLoader::AbortParameter(const G4String& name, const G4String& allowed) {
+	G4cerr << "" << G4endl;
+	G4cerr << "Topas is exiting due to a serious error." << G4endl;
+	G4cerr << "The parameter: " << name << G4endl;
+	G4cerr << "has an unknown value: " << fPm->GetStringParameter(name) << G4endl;
+	G4cerr << "Allowed values are " << allowed << G4endl;
+	fPm->AbortSession(1);
+}
@@ -0,0 +1,238 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldMapLoader_hh
+#define HGMEFieldMapLoader_hh
+
+#include "HGMEFieldTable.hh"
+#include "HGMEFieldSmoothness.hh"
+
+#include "G4String.hh"
+
+#include <istream>
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+
+class HGMELaplaceSolver;
+
+// Reads Opera style field tables (the MagneticField3DTable format) or NumPy
+// .npy arrays into an HGMEFieldTable, or generates the table with the
+// built-in Laplace solver. Malformed input aborts the TOPAS session.
+class HGMEFieldMapLoader
+{
+public:
+	// fieldUnit is the TOPAS unit category of the field values, used to read
+	// tolerances such as ResampleMaxFieldError
+	HGMEFieldMapLoader(TsParameterManager* pM, const char* fieldUnit = "Magnetic flux density");
+	~HGMEFieldMapLoader();
+
+	// Reads the source and the storage options of a component: FieldSource,
+	// MagneticField3DTable, the Npy* grid of .npy files or the Laplace*
+	// parameters, FieldStoragePrecision,
+	// FieldInterpolation, ResampleMaxFieldError, FieldRepresentation and the
+	// Multipole* options, FieldTableLayout, FieldTableGeometry, FieldTableCrop,
+	// FieldTableHugePages, FieldTableNUMAReplicas and FieldTableSharedMemory. The names are read
+	// below prefix, such as "FieldMapRegion/Inner/", if one is given.
+	// FieldStepLimiter, FieldSmoothnessBlock, FieldEnvelope and
+	// FieldEnvelopeThreshold apply to the whole component.
+	void ReadOptions(TsVGeometryComponent* component, const G4String& prefix = "");
+
+	void SetPrecision(HGMEFieldTable::Precision precision) {
+		fPrecision = precision;
+		fPrecisionSet = true;
+	}
+	void SetInterpolation(HGMEFieldTable::Interpolation interpolation) { fInterpolation = interpolation; }
+	void SetLayout(HGMEFieldTable::Layout layout) { fLayout = layout; }
+
+	// Box in the frame of the table outside which the field is never
+	// queried. Unless FieldTableCrop is off, text tables keep only the nodes
+	// within one cell of it, and the rows of the others are not parsed.
+	void SetCropBox(const G4double min[3], const G4double max[3]);
+
+	// Multipole series fit of a Z-invariant table after loading, with the
+	// options of FieldRepresentation Multipole. Order 0 keeps the nodes.
+	void SetSeries(G4int order, G4int patchesX, G4int patchesY, G4double maxResidual) {
+		fSeriesOrder = order;
+		fSeriesPatches[0] = patchesX;
+		fSeriesPatches[1] = patchesY;
+		fSeriesMaxResidual = maxResidual;
+	}
+
+	// Cartesian table, or (r, z) table of an axisymmetric field, as with
+	// FieldTableGeometry
+	void SetGeometry(HGMEFieldTable::Geometry geometry) { fGeometry = geometry; }
+
+	// Largest field error allowed when coarsening the table after loading,
+	// zero keeps the table as read
+	void SetResampleMaxError(G4double maxError) { fResampleMaxError = maxError; }
+
+	// Table file or .npy array to load in place of the one the parameters of
+	// a component name. An .npy array then takes its grid from the header
+	// file next to it.
+	void SetFileName(const G4String& fileName);
+	const G4String& GetFileName() const { return fFileName; }
+
+	// Smoothness table of the loaded map, built once per process with the
+	// table when the component limits steps by it, else null
+	std::shared_ptr<const HGMEFieldSmoothness> GetSmoothness() const { return fSmoothness; }
+
+	// Envelope of the loaded map where its field exceeds
+	// FieldEnvelopeThreshold, measured once per process with the table, see
+	// HGMEFieldEnvelope::Measure. HasEnvelope is false when FieldEnvelope is
+	// off; GetEnvelope returns false when the map has no field above it.
+	G4bool HasEnvelope() const { return fEnvelopeThreshold >= 0.; }
+	G4bool GetEnvelope(G4double min[3], G4double max[3]) const;
+
+	// Loads the file named by the MagneticField3DTable parameter, or solves
+	// (or reads back from the cache) the Laplace problem of the component.
+	// Tables are loaded once per process and shared by the worker threads,
+	// or by the threads of each NUMA node when replicas are enabled. Loading
+	// again, as in a new run, reuses the table unless the file has changed. With
+	// shared memory, they are loaded once per node and mapped by every process.
+	void Load(HGMEFieldTable* table);
+
+	// Loads a table from any stream, fileName is only used in messages
+	void Load(std::istream& input, const G4String& fileName, HGMEFieldTable* table);
+
+	// Loads the table into those shared by the process, as Load does, for a
+	// later Load to find it. Tables are loaded from several threads at once;
+	// only the threads asking for the same table wait for each other.
+	// Returns false if the table was there already.
+	G4bool Preload();
+
+	// Drops the table from those shared by the process, for tables that are
+	// only loaded once, such as those of the validation. Tables copied from
+	// it keep their nodes.
+	void Unload();
+
+	// Identifies the table among those shared by the process
+	G4String GetSharingKey() const;
+
+	// 64 bit FNV-1a hash, used to key cached and shared tables
+	static uint64_t Hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL);
+	static uint64_t HashFile(const G4String& fileName, uint64_t hash = 14695981039346656037ULL);
+
+private:
+	G4String ParameterName(const G4String& name) const;
+	void ReadLaplaceOptions();
+	void ReadNpyOptions();
+	void LoadSource(HGMEFieldTable* table);
+	void LoadLaplace(HGMEFieldTable* table);
+
+	// Range of node indices along each axis that a text table keeps, from
+	// its first and last data rows, which are read ahead from the stream.
+	// False when the whole table is kept.
+	G4bool CropNodes(std::istream& input, const G4String& fileName, const G4double units[3], const G4int n[3],
+					 G4int keep[3][2], G4double first[3], G4double last[3]) const;
+	G4bool IsCropped() const;
+
+	// Uses the nodes of a .npy file in place when the kernels can read them
+	// as stored, else copies them into the table
+	void LoadNpy(HGMEFieldTable* table);
+
+	// Table shared by the threads of the process, with its own lock
+	struct SharedTable;
+	static std::shared_ptr<SharedTable> FindShared(const G4String& key);
+	static std::map<G4String,std::shared_ptr<SharedTable> >& GetSharedTables();
+
+	// Loads the table into shared, unless it holds one from a file of the
+	// same content. Called with the lock of shared held, true if it loaded.
+	G4bool Share(SharedTable& shared);
+
+	// Maps the table from the shared memory segment named after the content
+	// of the source and the processing options, publishing it first if no
+	// process of the node has done so
+	void LoadShared(HGMEFieldTable* table);
+	G4String GetSegmentName() const;
+
+	// Post-processing common to all sources, once the nodes are filled
+	void Finish(const G4String& fileName, HGMEFieldTable* table);
+	void FitSeries(const G4String& fileName, HGMEFieldTable* table);
+
+	void Abort(const G4String& fileName, const G4String& reason);
+	void AbortParameter(const G4String& name, const G4String& allowed);
+
+	TsParameterManager* fPm;
+	G4String fFieldUnit;
+	TsVGeometryComponent* fComponent;
+	G4String fPrefix;
+	G4String fParameterName;
+	G4String fFileName;
+
+	// Content hash of the file being loaded, taken once by Load or Preload
+	uint64_t fSourceHash;
+
+	enum Source { kTable, kNpy, kLaplace };
+	Source fSource;
+	HGMELaplaceSolver* fSolver;
+	G4bool fUseCache;
+	G4String fCacheDirectory;
+
+	// Grid of .npy files: position of the first node, node spacing (negative
+	// for descending coordinates) and unit of the stored field values
+	G4double fNpyOrigin[3];
+	G4double fNpySpacing[3];
+	G4double fNpyFieldUnit;
+
+	HGMEFieldTable::Precision fPrecision;
+	G4bool fPrecisionSet;
+	HGMEFieldTable::Interpolation fInterpolation;
+	HGMEFieldTable::Layout fLayout;
+	HGMEFieldTable::Geometry fGeometry;
+	G4double fResampleMaxError;
+
+	// Crop box of text tables, unbounded until SetCropBox
+	G4bool fCrop;
+	G4double fCropMin[3];
+	G4double fCropMax[3];
+
+	// Multipole series fit of Z-invariant tables, order 0 keeps the nodes
+	G4int fSeriesOrder;
+	G4int fSeriesPatches[2];
+	G4double fSeriesMaxResidual;
+	HGMEFieldStorage::HugePages fHugePages;
+	G4bool fNUMAReplicas;
+	G4bool fSharedMemory;
+	G4String fSharedMemoryDirectory;
+
+	// Block edge of the smoothness table, in cells, zero when not built
+	G4int fSmoothnessBlock;
+	std::shared_ptr<const HGMEFieldSmoothness> fSmoothness;
+
+	// Negative when the envelope is not measured
+	G4double fEnvelopeThreshold;
+	G4bool fEnvelopeHasField;
+	G4double fEnvelope[6];
+};
+
+#endif
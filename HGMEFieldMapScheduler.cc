@@ -0,0 +1,163 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMEFieldMapScheduler.hh"
+#include "HGMEFieldMapEngine.hh"
+#include "HGMEFieldMapLoader.hh"
+#include "TsGeometryManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4AutoLock.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <locale>
+#include <map>
+#include <thread>
+#include <vector>
+
+namespace {
+	G4Mutex preloadMutex = G4MUTEX_INITIALIZER;
+	G4bool preloaded = false;
+
+	// A table to load, with the components using it
+	struct Job {
+		Job(): seconds(0.), loaded(false) {}
+		std::shared_ptr<HGMEFieldMapLoader> loader;
+		G4String components;
+		G4double seconds;
+		G4bool loaded;
+	};
+
+	// Adds the tables of a component with the maps of Slots, merging those
+	// already listed
+	template <class Slots>
+	void AddJobs(TsParameterManager* pM, TsVGeometryComponent* component, std::vector<Job>& jobs,
+				 std::map<G4String,size_t>& jobOfKey) {
+		for (G4int m = 0; m < Slots::kMaps; m++) {
+			std::vector<std::shared_ptr<HGMEFieldMapLoader> > loaders;
+			HGMEFieldRegions::GetLoaders(pM, component, Slots::Unit(m), Slots::Prefix(m), loaders);
+			for (size_t l = 0; l < loaders.size(); l++) {
+				std::map<G4String,size_t>::iterator listed = jobOfKey.find(loaders[l]->GetSharingKey());
+				if (listed != jobOfKey.end()) {
+					Job& job = jobs[listed->second];
+					if (job.components.find(component->GetName()) == std::string::npos)
+						job.components += ", " + component->GetName();
+					continue;
+				}
+				jobOfKey[loaders[l]->GetSharingKey()] = jobs.size();
+				jobs.push_back(Job());
+				jobs.back().loader = loaders[l];
+				jobs.back().components = component->GetName();
+			}
+		}
+	}
+
+	G4bool SlowerFirst(const Job& a, const Job& b) {
+		return a.seconds > b.seconds;
+	}
+}
+
+void HGMEFieldMapScheduler::Preload(TsParameterManager* pM, TsGeometryManager* gM) {
+	G4AutoLock lock(&preloadMutex);
+	if (preloaded)
+		return;
+	preloaded = true;
+
+	G4int threads = std::max(1U, std::thread::hardware_concurrency());
+	if (pM->ParameterExists("Ge/FieldMapLoadThreads"))
+		threads = pM->GetIntegerParameter("Ge/FieldMapLoadThreads");
+	if (threads < 2)
+		return;
+
+	// Map components of the geometry, by the Field they name
+	std::vector<G4String> names;
+	pM->GetParameterNamesBracketedBy("Ge/", "/Field", &names);
+	std::vector<Job> jobs;
+	std::map<G4String,size_t> jobOfKey;
+	G4int components = 0;
+	std::locale loc;
+	for (size_t n = 0; n < names.size(); n++) {
+		const G4String componentName = names[n].substr(3, names[n].size() - 9);
+		if (componentName.find('/') != std::string::npos)
+			continue;
+		G4String type = pM->GetStringParameter(names[n]);
+		for (std::string::size_type j = 0; j < type.length(); j++)
+			type[j] = std::tolower(type[j], loc);
+		if (type != "hgmefieldmap" && type != "mappedmagnet" && type != "hgmeelectromagneticfieldmap")
+			continue;
+
+		// Components not built yet load their own tables
+		TsVGeometryComponent* component = gM->GetComponent(componentName);
+		if (!component)
+			continue;
+		components++;
+		if (type == "hgmefieldmap")
+			AddJobs<HGMEElectricSlots>(pM, component, jobs, jobOfKey);
+		else if (type == "mappedmagnet")
+			AddJobs<HGMEMagneticSlots>(pM, component, jobs, jobOfKey);
+		else
+			AddJobs<HGMEElectroMagneticSlots>(pM, component, jobs, jobOfKey);
+	}
+	if (jobs.size() < 2)
+		return;
+
+	// Each thread takes the next table until none is left
+	threads = std::min<G4int>(threads, jobs.size());
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t j = next++; j < jobs.size(); j = next++) {
+			std::chrono::steady_clock::time_point jobStart = std::chrono::steady_clock::now();
+			jobs[j].loaded = jobs[j].loader->Preload();
+			jobs[j].seconds = std::chrono::duration<G4double>(std::chrono::steady_clock::now() - jobStart).count();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (G4int t = 0; t < threads; t++)
+		pool.push_back(std::thread(worker));
+	for (G4int t = 0; t < threads; t++)
+		pool[t].join();
+	const G4double elapsed = std::chrono::duration<G4double>(std::chrono::steady_clock::now() - start).count();
+
+	G4double total = 0.;
+	for (size_t j = 0; j < jobs.size(); j++)
+		total += jobs[j].seconds;
+	std::sort(jobs.begin(), jobs.end(), SlowerFirst);
+	G4cout << "Field tables of " << components << " map components: " << jobs.size() << " tables loaded on "
+	<< threads << " threads in " << elapsed << " s, " << total << " s summed over the tables" << G4endl;
+	for (size_t j = 0; j < jobs.size(); j++)
+		G4cout << std::setw(10) << std::fixed << std::setprecision(3) << jobs[j].seconds << std::defaultfloat
+		<< std::setprecision(6) << " s  " << jobs[j].loader->GetFileName() << " (" << jobs[j].components << ")"
+		<< (jobs[j].loaded ? "" : ", already loaded") << G4endl;
+}
@@ -0,0 +1,50 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldMapScheduler_hh
+#define HGMEFieldMapScheduler_hh
+
+class TsParameterManager;
+class TsGeometryManager;
+
+// Loads the tables of every map component of the geometry at once, on a
+// pool of threads, before the components load them one after the other.
+// The components are those whose Field is HGMEFieldMap, MappedMagnet or
+// HGMEElectroMagneticFieldMap, and a table used by several of them is
+// loaded once. The components then find their tables among those shared
+// by the process. The time spent on each table is printed.
+class HGMEFieldMapScheduler
+{
+public:
+	// Called by every map component as it is built. Only the first call of
+	// the process loads anything; later runs load as the components do.
+	static void Preload(TsParameterManager* pM, TsGeometryManager* gM);
+};
+
+#endif
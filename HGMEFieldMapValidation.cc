@@ -0,0 +1,787 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldMapValidation.hh"
+#include "HGMEAnalyticShapes.hh"
+#include "HGMEFieldMapEngine.hh"
+#include "HGMEFieldMapLoader.hh"
+
+#include "TsParameterManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4PhysicalConstants.hh"
+#include "G4SystemOfUnits.hh"
+#include "G4AutoLock.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <sstream>
+
+namespace {
+	G4Mutex validationMutex = G4MUTEX_INITIALIZER;
+	G4bool validationDone = false;
+
+	// Strength and length scale of the reference fields
+	const G4double referenceField = 1. * kilovolt / cm;
+	const G4double referenceLength = 20. * mm;
+}
+
+HGMEFieldMapValidation::HGMEFieldMapValidation(TsParameterManager* pM, TsVGeometryComponent* component):
+fPm(pM), fComponent(component), fOutputFileName("FieldMapValidation.csv"), fDirectory("."), fSafetyFactor(1.5),
+fNumberOfQueries(200000), fLayoutNodes(161), fAbortOnFailure(true) {
+	if (fPm->ParameterExists(fComponent->GetFullParmName("FieldMapValidationOutput")))
+		fOutputFileName = fPm->GetStringParameter(fComponent->GetFullParmName("FieldMapValidationOutput"));
+	if (fPm->ParameterExists(fComponent->GetFullParmName("FieldMapValidationDirectory")))
+		fDirectory = fPm->GetStringParameter(fComponent->GetFullParmName("FieldMapValidationDirectory"));
+	if (fPm->ParameterExists(fComponent->GetFullParmName("FieldMapValidationSafetyFactor")))
+		fSafetyFactor = fPm->GetUnitlessParameter(fComponent->GetFullParmName("FieldMapValidationSafetyFactor"));
+	if (fPm->ParameterExists(fComponent->GetFullParmName("FieldMapValidationQueries")))
+		fNumberOfQueries = fPm->GetIntegerParameter(fComponent->GetFullParmName("FieldMapValidationQueries"));
+	if (fPm->ParameterExists(fComponent->GetFullParmName("FieldMapValidationLayoutNodes")))
+		fLayoutNodes = fPm->GetIntegerParameter(fComponent->GetFullParmName("FieldMapValidationLayoutNodes"));
+	if (fPm->ParameterExists(fComponent->GetFullParmName("FieldMapValidationAbortOnFailure")))
+		fAbortOnFailure = fPm->GetBooleanParameter(fComponent->GetFullParmName("FieldMapValidationAbortOnFailure"));
+
+	HGMEAnalyticShapes::Uniform uniform;
+	uniform.field[0] = referenceField;
+	uniform.field[1] = 0.5 * referenceField;
+	uniform.field[2] = -0.25 * referenceField;
+	HGMEAnalyticShapes::Coaxial<false> coaxial;
+	coaxial.strengthTimesRadius = referenceField * referenceLength;
+	coaxial.innerRadius2 = 0.;
+	coaxial.outerRadius2 = DBL_MAX;
+	HGMEAnalyticShapes::Quadrupole quadrupole;
+	quadrupole.gradient = referenceField / referenceLength;
+	fReferences[kUniform] = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Uniform>(uniform);
+	fReferences[kCoaxial] = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Coaxial<false> >(coaxial);
+	fReferences[kQuadrupole] = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Quadrupole>(quadrupole);
+
+	// Dipole to octupole, with skew terms
+	HGMEAnalyticShapes::Multipole<4> multipole;
+	const G4double normal[4] = {0.2, 1., 0.5, 0.2};
+	const G4double skew[4] = {0.1, 0., 0.3, 0.};
+	for (G4int order = 0; order < 4; order++) {
+		multipole.normal[order] = normal[order] * referenceField / std::pow(referenceLength, order);
+		multipole.skew[order] = skew[order] * referenceField / std::pow(referenceLength, order);
+	}
+	fReferences[kMultipole] = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Multipole<4> >(multipole);
+
+	HGMEAnalyticShapes::Solenoid solenoid;
+	solenoid.halfStrength = 0.5 * referenceField;
+	solenoid.halfLength = referenceLength;
+	solenoid.radius2 = referenceLength * referenceLength;
+	fReferences[kSolenoid] = new HGMEAnalyticEvaluator<HGMEAnalyticShapes::Solenoid>(solenoid);
+
+	// Tilted about every axis and away from the origin, so that a wrong
+	// transformation of points or fields shows as an error
+	G4RotationMatrix rotation;
+	rotation.rotateX(20. * deg);
+	rotation.rotateY(-35. * deg);
+	rotation.rotateZ(50. * deg);
+	fToWorld = G4AffineTransform(rotation, G4ThreeVector(120. * mm, -40. * mm, 75. * mm));
+	fToLocal = fToWorld.Inverse();
+	fOffset[0] = 7. * mm;
+	fOffset[1] = -4. * mm;
+	fOffset[2] = 3. * mm;
+
+	BuildConfigurations();
+}
+
+HGMEFieldMapValidation::~HGMEFieldMapValidation() {
+	for (G4int s = 0; s < kShapes; s++)
+		delete fReferences[s];
+}
+
+void HGMEFieldMapValidation::BuildConfigurations() {
+	const HGMEFieldTable::Precision precisions[2] = {HGMEFieldTable::kDouble, HGMEFieldTable::kFloat};
+	const HGMEFieldTable::Interpolation interpolations[2] = {HGMEFieldTable::kTrilinear, HGMEFieldTable::kNearest};
+
+	const HGMEFieldTable::Layout layouts[3] = {HGMEFieldTable::kRowMajor, HGMEFieldTable::kTiled, HGMEFieldTable::kPadded};
+	const char* layoutNames[3] = {"", "-tiled", "-padded"};
+
+	for (G4int l = 0; l < 3; l++) {
+		for (G4int i = 0; i < 2; i++) {
+			for (G4int p = 0; p < 2; p++) {
+				Configuration configuration;
+				configuration.precision = precisions[p];
+				configuration.interpolation = interpolations[i];
+				configuration.layout = layouts[l];
+				configuration.geometry = HGMEFieldTable::kCartesian;
+				configuration.resampleMaxError = 0.;
+				configuration.seriesOrder = 0;
+				configuration.seriesPatches[0] = 1;
+				configuration.seriesPatches[1] = 1;
+				configuration.seriesMaxResidual = 0.;
+				configuration.gradient = false;
+				configuration.mapped = false;
+				configuration.name = G4String(p == 0 ? "double" : "float") + "-" + (i == 0 ? "trilinear" : "nearest") +
+				layoutNames[l];
+				fConfigurations.push_back(configuration);
+			}
+		}
+	}
+}
+
+void HGMEFieldMapValidation::RunOnce() {
+	G4AutoLock lock(&validationMutex);
+	if (validationDone)
+		return;
+	validationDone = true;
+
+	std::ofstream output(fOutputFileName);
+	if (!output) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The field map validation output cannot be written to:" << G4endl;
+		G4cerr << fOutputFileName << G4endl;
+		fPm->AbortSession(1);
+	}
+
+	G4cout << "Validating field map engine against analytic reference fields" << G4endl;
+	G4bool passed = Run(output);
+	output.close();
+	G4cout << "Field map validation " << (passed ? "passed" : "FAILED") << ", results written to " << fOutputFileName << G4endl;
+
+	if (!passed && fAbortOnFailure) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The field map engine exceeded its error bound, see " << fOutputFileName << G4endl;
+		fPm->AbortSession(1);
+	}
+}
+
+G4bool HGMEFieldMapValidation::Run(std::ostream& output) {
+	const Shape shapes[3] = {kUniform, kCoaxial, kQuadrupole};
+	const G4int nodes[4] = {9, 17, 33, 65};
+	G4bool passed = true;
+
+	output << "field,nx,ny,nz,spacing_mm,configuration,queries,max_rel_error,rms_rel_error,rel_bound,ns_per_query,memory_bytes,status" << std::endl;
+
+	for (G4int s = 0; s < 3; s++) {
+		for (G4int g = 0; g < 4; g++) {
+			const G4int n[3] = {nodes[g], nodes[g], 5};
+
+			// The table file is written once and loaded for every configuration
+			const G4String fileName = WriteFile(shapes[s], n, ".table");
+			for (size_t c = 0; c < fConfigurations.size(); c++) {
+				Engine engine;
+				Load(fileName, fConfigurations[c], engine);
+				Result result = Measure(shapes[s], n, fConfigurations[c], engine, kRandom);
+				passed = Report(output, shapes[s], n, fConfigurations[c], kRandom, result) && passed;
+			}
+			RemoveFile(fileName);
+		}
+	}
+
+	// Layout comparison on a table that does not fit the caches. It is an
+	// .npy array, the text form would take longer to parse than to query.
+	const G4int n[3] = {fLayoutNodes, fLayoutNodes, fLayoutNodes};
+	const G4String npyName = WriteFile(kQuadrupole, n, ".npy");
+	for (size_t c = 0; c < fConfigurations.size(); c++) {
+		Engine engine;
+		Load(npyName, fConfigurations[c], engine);
+
+		const Pattern patterns[2] = {kRandom, kTracks};
+		for (G4int p = 0; p < 2; p++) {
+			Result result = Measure(kQuadrupole, n, fConfigurations[c], engine, patterns[p]);
+			passed = Report(output, kQuadrupole, n, fConfigurations[c], patterns[p], result) && passed;
+		}
+	}
+	RemoveFile(npyName);
+
+	return RunModes(output) && passed;
+}
+
+G4bool HGMEFieldMapValidation::RunModes(std::ostream& output) {
+	G4bool passed = true;
+
+	// Resampling: within ResampleMaxFieldError of the interpolation of the
+	// original table, which is itself within the bound of its spacing
+	Configuration resampled = fConfigurations[0];
+	resampled.name = "double-trilinear-resampled";
+	resampled.resampleMaxError = 1.e-3 * referenceField;
+	const G4int fine[3] = {65, 65, 5};
+	passed = Check(output, kCoaxial, fine, resampled, ".table") && passed;
+
+	// Multipole series: a Z-invariant table of a multipole of lower order
+	// than the series, fitted on two patches
+	Configuration series = fConfigurations[0];
+	series.name = "double-multipole";
+	series.seriesOrder = 8;
+	series.seriesPatches[0] = 2;
+	series.seriesMaxResidual = 1.e-6 * referenceField;
+	const G4int plane[3] = {33, 33, 1};
+	passed = Check(output, kMultipole, plane, series, ".table") && passed;
+
+	// Gradients: the derivatives of the trilinear interpolant of the coaxial
+	// field, against central differences of the reference
+	Configuration gradient = fConfigurations[0];
+	gradient.name = "double-trilinear-gradient";
+	gradient.gradient = true;
+	const G4int cube[3] = {33, 33, 33};
+	passed = Check(output, kCoaxial, cube, gradient, ".table") && passed;
+
+	// In-place .npy mapping: double row-major arrays are used as the node
+	// storage without a copy, and share the bound of the text tables
+	Configuration npy = fConfigurations[0];
+	npy.name = "double-trilinear-npy";
+	npy.mapped = true;
+	const Shape shapes[3] = {kUniform, kCoaxial, kQuadrupole};
+	for (G4int s = 0; s < 3; s++)
+		passed = Check(output, shapes[s], cube, npy, ".npy") && passed;
+
+	// Axisymmetric tables: the (r, z) plane of a solenoid, bilinear in the
+	// plane and turned about the axis, within the bound of its two spacings
+	Configuration axisymmetric = fConfigurations[0];
+	axisymmetric.name = "double-trilinear-axisymmetric";
+	axisymmetric.geometry = HGMEFieldTable::kAxisymmetric;
+	const G4int radial[3] = {17, 1, 65};
+	passed = Check(output, kSolenoid, radial, axisymmetric, ".table") && passed;
+
+	return passed;
+}
+
+G4bool HGMEFieldMapValidation::Check(std::ostream& output, Shape shape, const G4int n[3],
+									 const Configuration& configuration, const G4String& extension) {
+	const G4String fileName = WriteFile(shape, n, extension);
+	Engine engine;
+	Load(fileName, configuration, engine);
+	RemoveFile(fileName);
+	Result result = configuration.gradient ? MeasureGradient(shape, n, engine) : Measure(shape, n, configuration, engine, kRandom);
+	G4bool passed = Report(output, shape, n, configuration, kRandom, result);
+
+	if (configuration.mapped && !engine.GetMaps(0).GetTable(0).GetStorage().IsMappedFile()) {
+		G4cerr << "Field map validation: " << fileName << " was copied instead of mapped in place" << G4endl;
+		passed = false;
+	}
+	return passed;
+}
+
+G4String HGMEFieldMapValidation::WriteFile(Shape shape, const G4int n[3], const G4String& extension) const {
+	const G4String fileName = FileName(shape, n, extension);
+	if (extension == ".npy") {
+		WriteNpy(shape, n, fileName);
+		return fileName;
+	}
+
+	std::ofstream file(fileName);
+	WriteTable(shape, n, file);
+	file.close();
+	if (!file) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The field map validation table cannot be written to:" << G4endl;
+		G4cerr << fileName << G4endl;
+		fPm->AbortSession(1);
+	}
+	return fileName;
+}
+
+void HGMEFieldMapValidation::RemoveFile(const G4String& fileName) const {
+	std::remove(fileName.c_str());
+	if (fileName.size() > 4 && fileName.substr(fileName.size() - 4) == ".npy")
+		std::remove((fileName.substr(0, fileName.size() - 4) + ".hdr").c_str());
+}
+
+G4String HGMEFieldMapValidation::FileName(Shape shape, const G4int n[3], const G4String& extension) const {
+	std::ostringstream name;
+	name << fDirectory << "/HGMEFieldMapValidation_" << ShapeName(shape) << "_" << n[0] << "x" << n[1] << "x" << n[2]
+	<< extension;
+	return name.str();
+}
+
+void HGMEFieldMapValidation::Load(const G4String& fileName, const Configuration& configuration, Engine& engine) const {
+	HGMEFieldMapLoader loader(fPm);
+	loader.SetFileName(fileName);
+	loader.SetPrecision(configuration.precision);
+	loader.SetInterpolation(configuration.interpolation);
+	loader.SetLayout(configuration.layout);
+	loader.SetGeometry(configuration.geometry);
+	loader.SetResampleMaxError(configuration.resampleMaxError);
+	loader.SetSeries(configuration.seriesOrder, configuration.seriesPatches[0], configuration.seriesPatches[1],
+					 configuration.seriesMaxResidual);
+
+	// Kept only by the engine, the next configuration loads the file again
+	HGMEFieldTable table;
+	loader.Load(&table);
+	loader.Unload();
+
+	HGMEFieldRegions maps;
+	maps.AddRegion(fileName, table, fOffset, 0);
+	maps.BuildIndex();
+	engine.SetMaps(&maps, fToWorld);
+}
+
+G4bool HGMEFieldMapValidation::Report(std::ostream& output, Shape shape, const G4int n[3], const Configuration& configuration,
+									  Pattern pattern, const Result& result) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+	G4bool ok = result.maxError <= result.bound;
+
+	output << ShapeName(shape) << "," << n[0] << "," << n[1] << "," << n[2] << ","
+	<< std::setprecision(6) << Spacing(min[0], max[0], n[0]) / mm << "," << configuration.name << ","
+	<< (pattern == kRandom ? "random" : "tracks") << ","
+	<< std::scientific << std::setprecision(4)
+	<< result.maxError / referenceField << "," << result.rmsError / referenceField << ","
+	<< result.bound / referenceField << "," << std::fixed << std::setprecision(2)
+	<< result.nsPerQuery << "," << result.memory << "," << (ok ? "pass" : "fail") << std::endl;
+	output.unsetf(std::ios::floatfield);
+	return ok;
+}
+
+G4String HGMEFieldMapValidation::ShapeName(Shape shape) const {
+	if (shape == kUniform) return "uniform";
+	if (shape == kCoaxial) return "coaxial";
+	if (shape == kMultipole) return "multipole";
+	if (shape == kSolenoid) return "solenoid";
+	return "quadrupole";
+}
+
+void HGMEFieldMapValidation::Domain(Shape shape, G4double min[3], G4double max[3]) const {
+	min[0] = -referenceLength;
+	max[0] = referenceLength;
+	min[1] = -referenceLength;
+	max[1] = referenceLength;
+	min[2] = -0.5 * referenceLength;
+	max[2] = 0.5 * referenceLength;
+
+	// Keep clear of the singular axis of the coaxial field
+	if (shape == kCoaxial) {
+		min[0] = referenceLength;
+		max[0] = 3. * referenceLength;
+	}
+
+	// The (r, z) plane of the solenoid, past both of its ends
+	if (shape == kSolenoid) {
+		min[0] = 0.;
+		min[1] = 0.;
+		max[1] = 0.;
+		min[2] = -2. * referenceLength;
+		max[2] = 2. * referenceLength;
+	}
+}
+
+void HGMEFieldMapValidation::Reference(Shape shape, const G4double point[3], G4double field[3]) const {
+	fReferences[shape]->Evaluate(point, field);
+}
+
+void HGMEFieldMapValidation::WriteTable(Shape shape, const G4int n[3], std::ostream& output) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	output << n[0] << " " << n[1] << " " << n[2] << "\n";
+	output << "1 X [MM]\n2 Y [MM]\n3 Z [MM]\n4 BX [1]\n5 BY [1]\n6 BZ [1]\n0\n";
+	output << std::setprecision(17);
+
+	G4double point[3], field[3];
+	for (G4int ix = 0; ix < n[0]; ix++) {
+		point[0] = min[0] + Spacing(min[0], max[0], n[0]) * ix;
+		for (G4int iy = 0; iy < n[1]; iy++) {
+			point[1] = min[1] + Spacing(min[1], max[1], n[1]) * iy;
+			for (G4int iz = 0; iz < n[2]; iz++) {
+				point[2] = min[2] + Spacing(min[2], max[2], n[2]) * iz;
+				Reference(shape, point, field);
+				output << point[0] / mm << " " << point[1] / mm << " " << point[2] / mm << " "
+				<< field[0] << " " << field[1] << " " << field[2] << "\n";
+			}
+		}
+	}
+}
+
+void HGMEFieldMapValidation::WriteNpy(Shape shape, const G4int n[3], const G4String& fileName) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	// Little-endian doubles in C order, the header padded to 64 bytes
+	std::ostringstream dictionary;
+	dictionary << "{'descr': '<f8', 'fortran_order': False, 'shape': (" << n[0] << ", " << n[1] << ", " << n[2] << ", 3), }";
+	G4String header = dictionary.str();
+	header.append(63 - (10 + header.size()) % 64, ' ');
+	header += "\n";
+	const uint16_t headerSize = header.size();
+
+	std::ofstream file(fileName, std::ios::binary);
+	file.write("\x93NUMPY\x01\x00", 8);
+	const unsigned char size[2] = {(unsigned char)(headerSize & 0xff), (unsigned char)(headerSize >> 8)};
+	file.write(reinterpret_cast<const char*>(size), 2);
+	file.write(header.data(), header.size());
+
+	// Values in tesla, the unit of the header file
+	std::vector<double> plane(3 * (size_t)n[1] * n[2]);
+	G4double point[3], field[3];
+	for (G4int ix = 0; ix < n[0]; ix++) {
+		point[0] = min[0] + Spacing(min[0], max[0], n[0]) * ix;
+		for (G4int iy = 0; iy < n[1]; iy++) {
+			point[1] = min[1] + Spacing(min[1], max[1], n[1]) * iy;
+			for (G4int iz = 0; iz < n[2]; iz++) {
+				point[2] = min[2] + Spacing(min[2], max[2], n[2]) * iz;
+				Reference(shape, point, field);
+				for (G4int c = 0; c < 3; c++)
+					plane[((size_t)iy * n[2] + iz) * 3 + c] = field[c] / tesla;
+			}
+		}
+		file.write(reinterpret_cast<const char*>(plane.data()), plane.size() * sizeof(double));
+	}
+	file.close();
+
+	std::ofstream gridHeader(fileName.substr(0, fileName.size() - 4) + ".hdr");
+	gridHeader << std::setprecision(17) << "origin " << min[0] / mm << " " << min[1] / mm << " " << min[2] / mm << " mm\n"
+	<< "spacing " << Spacing(min[0], max[0], n[0]) / mm << " " << Spacing(min[1], max[1], n[1]) / mm << " "
+	<< Spacing(min[2], max[2], n[2]) / mm << " mm\nunit T\n";
+	gridHeader.close();
+
+	if (!file || !gridHeader) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The field map validation array cannot be written to:" << G4endl;
+		G4cerr << fileName << G4endl;
+		fPm->AbortSession(1);
+	}
+}
+
+void HGMEFieldMapValidation::Derivatives(Shape shape, G4double firstDerivative[3], G4double secondDerivative[3]) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	const G4int samples = 41;
+	G4double point[3], field[3], plus[3], minus[3];
+	for (G4int axis = 0; axis < 3; axis++) {
+		firstDerivative[axis] = 0.;
+		secondDerivative[axis] = 0.;
+		if (max[axis] == min[axis])
+			continue;
+		const G4double delta = 1.e-3 * (max[axis] - min[axis]);
+
+		for (G4int i = 0; i < samples; i++) {
+			for (G4int j = 0; j < samples; j++) {
+				for (G4int k = 0; k < samples; k++) {
+					point[0] = min[0] + (max[0] - min[0]) * i / (samples - 1);
+					point[1] = min[1] + (max[1] - min[1]) * j / (samples - 1);
+					point[2] = min[2] + (max[2] - min[2]) * k / (samples - 1);
+					Reference(shape, point, field);
+					point[axis] += delta;
+					Reference(shape, point, plus);
+					point[axis] -= 2. * delta;
+					Reference(shape, point, minus);
+
+					for (G4int c = 0; c < 3; c++) {
+						firstDerivative[axis] = std::max(firstDerivative[axis], std::fabs(plus[c] - minus[c]) / (2. * delta));
+						secondDerivative[axis] = std::max(secondDerivative[axis], std::fabs(plus[c] - 2. * field[c] + minus[c]) / (delta * delta));
+					}
+				}
+			}
+		}
+	}
+}
+
+void HGMEFieldMapValidation::ThirdDerivatives(Shape shape, G4double thirdDerivative[3][3]) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	const G4int samples = 21;
+	G4double point[3], gradient[9], plus[9], minus[9];
+	for (G4int k = 0; k < 3; k++) {
+		for (G4int j = 0; j < 3; j++)
+			thirdDerivative[k][j] = 0.;
+		const G4double delta = 1.e-2 * (max[k] - min[k]);
+
+		for (G4int a = 0; a < samples; a++) {
+			for (G4int b = 0; b < samples; b++) {
+				for (G4int c = 0; c < samples; c++) {
+					point[0] = min[0] + (max[0] - min[0]) * a / (samples - 1);
+					point[1] = min[1] + (max[1] - min[1]) * b / (samples - 1);
+					point[2] = min[2] + (max[2] - min[2]) * c / (samples - 1);
+					ReferenceGradient(shape, point, gradient);
+					point[k] += delta;
+					ReferenceGradient(shape, point, plus);
+					point[k] -= 2. * delta;
+					ReferenceGradient(shape, point, minus);
+
+					for (G4int i = 0; i < 3; i++)
+						for (G4int j = 0; j < 3; j++)
+							thirdDerivative[k][j] = std::max(thirdDerivative[k][j],
+								std::fabs(plus[3 * i + j] - 2. * gradient[3 * i + j] + minus[3 * i + j]) / (delta * delta));
+				}
+			}
+		}
+	}
+}
+
+void HGMEFieldMapValidation::ReferenceGradient(Shape shape, const G4double point[3], G4double gradient[9]) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	G4double shifted[3] = {point[0], point[1], point[2]};
+	G4double plus[3], minus[3];
+	for (G4int j = 0; j < 3; j++) {
+		const G4double delta = 1.e-4 * (max[j] - min[j]);
+		shifted[j] = point[j] + delta;
+		Reference(shape, shifted, plus);
+		shifted[j] = point[j] - delta;
+		Reference(shape, shifted, minus);
+		shifted[j] = point[j];
+		for (G4int i = 0; i < 3; i++)
+			gradient[3 * i + j] = (plus[i] - minus[i]) / (2. * delta);
+	}
+}
+
+void HGMEFieldMapValidation::Points(Shape shape, const G4int n[3], Pattern pattern, std::vector<G4double>& points) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	std::mt19937_64 generator(20221);
+	points.resize(3 * (size_t)fNumberOfQueries);
+	if (pattern == kRandom) {
+		for (G4int q = 0; q < fNumberOfQueries; q++) {
+			for (G4int axis = 0; axis < 3; axis++)
+				points[3 * q + axis] = std::uniform_real_distribution<G4double>(min[axis], max[axis])(generator);
+			if (shape == kSolenoid) {
+				const G4double phi = std::uniform_real_distribution<G4double>(0., 2. * pi)(generator);
+				points[3 * q + 1] = points[3 * q] * std::sin(phi);
+				points[3 * q] *= std::cos(phi);
+			}
+		}
+		return;
+	}
+
+	G4double step = DBL_MAX;
+	for (G4int axis = 0; axis < 3; axis++)
+		if (n[axis] > 1)
+			step = std::min(step, 0.5 * Spacing(min[axis], max[axis], n[axis]));
+
+	G4double point[3] = {0., 0., 0.}, direction[3] = {0., 0., 0.};
+	G4bool inside = false;
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		if (!inside) {
+			// New track from a random point in an isotropic direction
+			G4double cosTheta = std::uniform_real_distribution<G4double>(-1., 1.)(generator);
+			G4double phi = std::uniform_real_distribution<G4double>(0., 2. * pi)(generator);
+			G4double sinTheta = std::sqrt(1. - cosTheta * cosTheta);
+			direction[0] = sinTheta * std::cos(phi);
+			direction[1] = sinTheta * std::sin(phi);
+			direction[2] = cosTheta;
+			for (G4int axis = 0; axis < 3; axis++)
+				point[axis] = std::uniform_real_distribution<G4double>(min[axis], max[axis])(generator);
+		}
+		inside = true;
+		for (G4int axis = 0; axis < 3; axis++) {
+			points[3 * q + axis] = point[axis];
+			point[axis] += step * direction[axis];
+			inside = inside && point[axis] >= min[axis] && point[axis] <= max[axis];
+		}
+	}
+}
+
+HGMEFieldMapValidation::Result HGMEFieldMapValidation::Measure(Shape shape, const G4int n[3], const Configuration& configuration,
+															   const Engine& engine, Pattern pattern) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	// Points of the table frame, and where they are in the world
+	std::vector<G4double> points;
+	Points(shape, n, pattern, points);
+	std::vector<G4double> worldPoints(points.size());
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		const G4double* point = &points[3 * q];
+		const G4ThreeVector world = fToWorld.TransformPoint(
+			G4ThreeVector(point[0] + fOffset[0], point[1] + fOffset[1], point[2] + fOffset[2]));
+		worldPoints[3 * q] = world.x();
+		worldPoints[3 * q + 1] = world.y();
+		worldPoints[3 * q + 2] = world.z();
+	}
+
+	const HGMEFieldTable& table = engine.GetMaps(0).GetTable(0);
+	Result result;
+	result.maxError = 0.;
+	result.rmsError = 0.;
+	result.memory = table.GetMemorySize();
+
+	// The field is compared in the table frame, where the bound holds
+	G4double maxField = 0.;
+	G4double field[3], reference[3];
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		engine.GetFieldValue(&worldPoints[3 * q], field);
+		const G4ThreeVector local = fToLocal.TransformAxis(G4ThreeVector(field[0], field[1], field[2]));
+		Reference(shape, &points[3 * q], reference);
+		for (G4int c = 0; c < 3; c++) {
+			G4double error = std::fabs(local[c] - reference[c]);
+			result.maxError = std::max(result.maxError, error);
+			result.rmsError += error * error;
+			maxField = std::max(maxField, std::fabs(reference[c]));
+		}
+	}
+	result.rmsError = std::sqrt(result.rmsError / (3. * fNumberOfQueries));
+
+	// Interpolation error bound of the scheme at the spacing of the written
+	// table, plus the tolerance of resampling and rounding of the stored
+	// values and of the rotations
+	G4double firstDerivative[3], secondDerivative[3];
+	Derivatives(shape, firstDerivative, secondDerivative);
+	G4double bound = 0.;
+	for (G4int axis = 0; axis < 3; axis++) {
+		// Invariant axes only hold fields that do not vary along them
+		if (n[axis] == 1)
+			continue;
+		G4double h = Spacing(min[axis], max[axis], n[axis]);
+		if (table.GetInterpolation() == HGMEFieldTable::kNearest)
+			bound += 0.5 * h * firstDerivative[axis];
+		else
+			bound += 0.125 * h * h * secondDerivative[axis];
+	}
+	G4double epsilon = table.GetPrecision() == HGMEFieldTable::kFloat ?
+	std::numeric_limits<float>::epsilon() : std::numeric_limits<double>::epsilon();
+	// A series replaces the interpolation, the fit of an exact multipole of
+	// lower order is only limited by the residual it was accepted with
+	if (configuration.seriesOrder > 0)
+		bound = configuration.seriesMaxResidual;
+	result.bound = fSafetyFactor * bound + configuration.resampleMaxError + 4. * epsilon * maxField + 16. * std::numeric_limits<double>::epsilon() * maxField;
+
+	// Throughput over the same points; the sum goes to a volatile so that the
+	// loop is not optimised away
+	G4double sum = 0.;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		engine.GetFieldValue(&worldPoints[3 * q], field);
+		sum += field[0];
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	result.nsPerQuery = std::chrono::duration<G4double, std::nano>(stop - start).count() / fNumberOfQueries;
+	volatile G4double sink = sum;
+	(void)sink;
+
+	return result;
+}
+
+HGMEFieldMapValidation::Result HGMEFieldMapValidation::MeasureGradient(Shape shape, const G4int n[3], const Engine& engine) const {
+	G4double min[3], max[3];
+	Domain(shape, min, max);
+
+	std::vector<G4double> points;
+	Points(shape, n, kRandom, points);
+	std::vector<G4double> worldPoints(points.size());
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		const G4double* point = &points[3 * q];
+		const G4ThreeVector world = fToWorld.TransformPoint(
+			G4ThreeVector(point[0] + fOffset[0], point[1] + fOffset[1], point[2] + fOffset[2]));
+		worldPoints[3 * q] = world.x();
+		worldPoints[3 * q + 1] = world.y();
+		worldPoints[3 * q + 2] = world.z();
+	}
+
+	// Rows of the rotation to the table frame, the gradient is R^-1 G R
+	G4double toLocal[9];
+	for (G4int j = 0; j < 3; j++) {
+		G4ThreeVector axis;
+		axis[j] = 1.;
+		const G4ThreeVector column = fToLocal.TransformAxis(axis);
+		for (G4int i = 0; i < 3; i++)
+			toLocal[3 * i + j] = column[i];
+	}
+
+	const HGMEFieldTable& table = engine.GetMaps(0).GetTable(0);
+	Result result;
+	result.maxError = 0.;
+	result.rmsError = 0.;
+	result.memory = table.GetMemorySize();
+
+	G4double maxField = 0., maxGradient = 0.;
+	G4double field[3], gradient[9], rotated[9], local[9], reference[3], referenceGradient[9];
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		engine.GetFieldValueAndGradient(&worldPoints[3 * q], field, gradient);
+		for (G4int i = 0; i < 3; i++)
+			for (G4int j = 0; j < 3; j++)
+				rotated[3 * i + j] = toLocal[3 * i] * gradient[j] + toLocal[3 * i + 1] * gradient[3 + j]
+				+ toLocal[3 * i + 2] * gradient[6 + j];
+		for (G4int i = 0; i < 3; i++)
+			for (G4int j = 0; j < 3; j++)
+				local[3 * i + j] = rotated[3 * i] * toLocal[3 * j] + rotated[3 * i + 1] * toLocal[3 * j + 1]
+				+ rotated[3 * i + 2] * toLocal[3 * j + 2];
+
+		Reference(shape, &points[3 * q], reference);
+		ReferenceGradient(shape, &points[3 * q], referenceGradient);
+		for (G4int c = 0; c < 9; c++) {
+			G4double error = referenceLength * std::fabs(local[c] - referenceGradient[c]);
+			result.maxError = std::max(result.maxError, error);
+			result.rmsError += error * error;
+			maxGradient = std::max(maxGradient, referenceLength * std::fabs(referenceGradient[c]));
+		}
+		for (G4int c = 0; c < 3; c++)
+			maxField = std::max(maxField, std::fabs(reference[c]));
+	}
+	result.rmsError = std::sqrt(result.rmsError / (9. * fNumberOfQueries));
+
+	// The difference quotient along x_j is within h_j/2 of the largest second
+	// derivative along x_j, and its linear interpolation along the other axes
+	// within h_k2/8 of the third derivatives. Rounding of the stored values is
+	// amplified by the reference length over the smallest spacing, and the
+	// central differences of the reference are allowed 1e-6 of the gradient.
+	G4double firstDerivative[3], secondDerivative[3], thirdDerivative[3][3];
+	Derivatives(shape, firstDerivative, secondDerivative);
+	ThirdDerivatives(shape, thirdDerivative);
+	G4double bound = 0., minSpacing = DBL_MAX;
+	for (G4int j = 0; j < 3; j++) {
+		if (n[j] == 1)
+			continue;
+		G4double h = Spacing(min[j], max[j], n[j]);
+		minSpacing = std::min(minSpacing, h);
+		G4double axisBound = 0.5 * h * secondDerivative[j];
+		for (G4int k = 0; k < 3; k++) {
+			if (k == j || n[k] == 1)
+				continue;
+			G4double hk = Spacing(min[k], max[k], n[k]);
+			axisBound += 0.125 * hk * hk * thirdDerivative[k][j];
+		}
+		bound = std::max(bound, referenceLength * axisBound);
+	}
+	G4double epsilon = table.GetPrecision() == HGMEFieldTable::kFloat ?
+	std::numeric_limits<float>::epsilon() : std::numeric_limits<double>::epsilon();
+	result.bound = fSafetyFactor * bound + 4. * epsilon * maxField * referenceLength / minSpacing
+	+ 1.e-6 * maxGradient;
+
+	G4double sum = 0.;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (G4int q = 0; q < fNumberOfQueries; q++) {
+		engine.GetFieldValueAndGradient(&worldPoints[3 * q], field, gradient);
+		sum += gradient[0];
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	result.nsPerQuery = std::chrono::duration<G4double, std::nano>(stop - start).count() / fNumberOfQueries;
+	volatile G4double sink = sum;
+	(void)sink;
+
+	return result;
+}
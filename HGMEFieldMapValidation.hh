@@ -0,0 +1,184 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldMapValidation_hh
+#define HGMEFieldMapValidation_hh
+
+#include "HGMEFieldTable.hh"
+
+#include "G4AffineTransform.hh"
+#include "G4String.hh"
+
+#include <ostream>
+#include <vector>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+class HGMEVAnalyticEvaluator;
+struct HGMEMagneticSlots;
+template <G4int Components, class Slots> class HGMEFieldMapEngine;
+
+// Accuracy and throughput check of the field map engine against analytic
+// reference fields.
+//
+// Every reference field (uniform, coaxial 1/r and quadrupole, the shapes of
+// HGMEAnalyticField) is written as an Opera style table file at several
+// grid spacings and loaded by HGMEFieldMapLoader once per storage
+// configuration. The table is placed off the origin of a rotated and
+// translated component and queried through HGMEFieldMapEngine::GetFieldValue,
+// the path of the field classes. Each configuration reports its
+// interpolation error and ns/query and passes if the error stays below the
+// analytic bound of its interpolation scheme.
+//
+// A large 3D quadrupole table, too big for the caches, is then written as an
+// .npy array and queried at random points and along straight tracks to
+// compare the node layouts.
+class HGMEFieldMapValidation
+{
+public:
+	HGMEFieldMapValidation(TsParameterManager* pM, TsVGeometryComponent* component);
+	~HGMEFieldMapValidation();
+
+	// Runs the suite unless it already ran in this process (each worker
+	// thread builds its own field), aborting the session on failures if
+	// FieldMapValidationAbortOnFailure is set
+	void RunOnce();
+
+	// Runs every configuration, writes one CSV row per configuration and
+	// returns false if any of them failed
+	G4bool Run(std::ostream& output);
+
+	// Analytic reference fields, in the table frame
+	enum Shape { kUniform, kCoaxial, kQuadrupole, kMultipole, kSolenoid, kShapes };
+
+private:
+	typedef HGMEFieldMapEngine<3, HGMEMagneticSlots> Engine;
+
+	struct Configuration {
+		G4String name;
+		HGMEFieldTable::Precision precision;
+		HGMEFieldTable::Interpolation interpolation;
+		HGMEFieldTable::Layout layout;
+		HGMEFieldTable::Geometry geometry;
+
+		// Performance modes, checked against the same references
+		G4double resampleMaxError;
+		G4int seriesOrder;
+		G4int seriesPatches[2];
+		G4double seriesMaxResidual;
+
+		// Checks the gradient of GetFieldValueAndGradient instead of the field
+		G4bool gradient;
+
+		// Fails unless the table storage maps the .npy array in place
+		G4bool mapped;
+	};
+
+	// Query points spread uniformly, or following straight tracks in random
+	// directions with steps of half a cell. The (r, z) plane of the solenoid
+	// is turned about the axis to random azimuths instead.
+	enum Pattern { kRandom, kTracks };
+
+	struct Result {
+		G4double maxError;
+		G4double rmsError;
+		G4double bound;
+		G4double nsPerQuery;
+		size_t memory;
+	};
+
+	void BuildConfigurations();
+	void Reference(Shape shape, const G4double point[3], G4double field[3]) const;
+	G4String ShapeName(Shape shape) const;
+	void Domain(Shape shape, G4double min[3], G4double max[3]) const;
+
+	// Node spacing of n nodes along an axis, zero for an invariant axis
+	static G4double Spacing(G4double min, G4double max, G4int n) {
+		return n > 1 ? (max - min) / (n - 1) : 0.;
+	}
+
+	// Opera style table of a shape with n[i] nodes along each axis
+	void WriteTable(Shape shape, const G4int n[3], std::ostream& output) const;
+
+	// .npy array of a shape, with its header file next to it
+	void WriteNpy(Shape shape, const G4int n[3], const G4String& fileName) const;
+
+	// Table file of a shape in the validation directory, written as a text
+	// table or an .npy array after its extension, and removed
+	G4String FileName(Shape shape, const G4int n[3], const G4String& extension) const;
+	G4String WriteFile(Shape shape, const G4int n[3], const G4String& extension) const;
+	void RemoveFile(const G4String& fileName) const;
+
+	// One row for each performance mode
+	G4bool RunModes(std::ostream& output);
+
+	// Writes, loads and measures a single configuration
+	G4bool Check(std::ostream& output, Shape shape, const G4int n[3], const Configuration& configuration,
+				 const G4String& extension);
+
+	// Loads a table file with a configuration and places it in the engine
+	void Load(const G4String& fileName, const Configuration& configuration, Engine& engine) const;
+
+	// Largest first and second derivative along each axis, over all components
+	void Derivatives(Shape shape, G4double firstDerivative[3], G4double secondDerivative[3]) const;
+
+	// Largest third derivative d3F/dx_k2 dx_j over all components
+	void ThirdDerivatives(Shape shape, G4double thirdDerivative[3][3]) const;
+
+	// Gradient of the reference by central differences, gradient[3 * i + j]
+	// being dF_i/dx_j
+	void ReferenceGradient(Shape shape, const G4double point[3], G4double gradient[9]) const;
+
+	Result Measure(Shape shape, const G4int n[3], const Configuration& configuration, const Engine& engine,
+				   Pattern pattern) const;
+
+	// Gradient errors, scaled by the reference length to compare with fields
+	Result MeasureGradient(Shape shape, const G4int n[3], const Engine& engine) const;
+	void Points(Shape shape, const G4int n[3], Pattern pattern, std::vector<G4double>& points) const;
+	G4bool Report(std::ostream& output, Shape shape, const G4int n[3], const Configuration& configuration,
+				  Pattern pattern, const Result& result) const;
+
+	TsParameterManager* fPm;
+	TsVGeometryComponent* fComponent;
+	G4String fOutputFileName;
+	G4String fDirectory;
+	G4double fSafetyFactor;
+	G4int fNumberOfQueries;
+	G4int fLayoutNodes;
+	G4bool fAbortOnFailure;
+	std::vector<Configuration> fConfigurations;
+	HGMEVAnalyticEvaluator* fReferences[kShapes];
+
+	// Placement of the component, and of the table in it
+	G4AffineTransform fToWorld;
+	G4AffineTransform fToLocal;
+	G4double fOffset[3];
+};
+
+#endif
@@ -0,0 +1,322 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMEFieldQueryTrace.hh"
+#include "HGMEFieldRegions.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4AutoLock.hh"
+#include "G4SystemOfUnits.hh"
+#include "G4Threading.hh"
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	G4Mutex traceMutex = G4MUTEX_INITIALIZER;
+
+	// Trace files of this process, created (and truncated) by the first
+	// recorder that names them, with the format that recorder wrote in the
+	// header. Later recorders write in that format.
+	struct TraceFile {
+		std::weak_ptr<std::ofstream> file;
+		G4bool trackContext;
+		G4int sampling;
+		G4bool reported;
+	};
+	std::map<G4String,TraceFile> traceFiles;
+
+	// Trace files already replayed by this process
+	std::set<G4String> replayedFiles;
+
+	const char traceMagic[8] = {'H','G','M','E','F','Q','0','1'};
+
+	// Keeps the timed replay loop from being optimised away
+	volatile G4double replaySink;
+
+	// Hardware counter of the calling thread, or an invalid one where the
+	// system does not give access to it
+	class Counter {
+	public:
+		Counter(uint32_t type, uint64_t config): fDescriptor(-1) {
+#ifdef __linux__
+			perf_event_attr attributes;
+			std::memset(&attributes, 0, sizeof(attributes));
+			attributes.size = sizeof(attributes);
+			attributes.type = type;
+			attributes.config = config;
+			attributes.disabled = 1;
+			attributes.exclude_kernel = 1;
+			attributes.exclude_hv = 1;
+			fDescriptor = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#else
+			(void)type;
+			(void)config;
+#endif
+		}
+
+		~Counter() {
+#ifdef __linux__
+			if (fDescriptor >= 0) close(fDescriptor);
+#endif
+		}
+
+		G4bool IsValid() const { return fDescriptor >= 0; }
+
+		void Start() {
+#ifdef __linux__
+			if (fDescriptor < 0) return;
+			ioctl(fDescriptor, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fDescriptor, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+		}
+
+		uint64_t Stop() {
+			uint64_t count = 0;
+#ifdef __linux__
+			if (fDescriptor < 0) return 0;
+			ioctl(fDescriptor, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fDescriptor, &count, sizeof(count)) != sizeof(count))
+				count = 0;
+#endif
+			return count;
+		}
+
+	private:
+		long fDescriptor;
+	};
+}
+
+HGMEFieldQueryTrace::HGMEFieldQueryTrace(const G4String& fileName, G4int sampling, G4bool trackContext):
+fFileName(fileName), fSampling(sampling > 0 ? sampling : 1), fTrackContext(trackContext),
+fThread(G4Threading::G4GetThreadId()), fCalls(0) {
+	fBuffer.reserve(kBufferSize);
+
+	G4AutoLock lock(&traceMutex);
+	TraceFile& traceFile = traceFiles[fFileName];
+	fFile = traceFile.file.lock();
+	if (!fFile) {
+		fFile = std::make_shared<std::ofstream>(fFileName, std::ios::binary | std::ios::trunc);
+		const uint32_t header[2] = {fTrackContext ? 1U : 0U, (uint32_t)fSampling};
+		fFile->write(traceMagic, sizeof(traceMagic));
+		fFile->write(reinterpret_cast<const char*>(header), sizeof(header));
+		traceFile.file = fFile;
+		traceFile.trackContext = fTrackContext;
+		traceFile.sampling = fSampling;
+		traceFile.reported = false;
+		if (!*fFile)
+			G4cout << "Cannot write field query trace " << fFileName << G4endl;
+		else
+			G4cout << "Recording one in " << fSampling << " field queries to " << fFileName << G4endl;
+	} else if (fTrackContext != traceFile.trackContext || fSampling != traceFile.sampling) {
+		fTrackContext = traceFile.trackContext;
+		fSampling = traceFile.sampling;
+		if (!traceFile.reported) {
+			G4cout << "Field query trace " << fFileName << " keeps one in " << fSampling << " queries "
+			<< (fTrackContext ? "with" : "without") << " track context, as set by its first recorder" << G4endl;
+			traceFile.reported = true;
+		}
+	}
+}
+
+HGMEFieldQueryTrace* HGMEFieldQueryTrace::Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+													 const HGMEFieldRegions& regions, G4bool trackContext) {
+	if (pM->ParameterExists(component->GetFullParmName("FieldQueryReplayFile"))) {
+		const G4String replayFile = pM->GetStringParameter(component->GetFullParmName("FieldQueryReplayFile"));
+		G4int repeat = 1;
+		if (pM->ParameterExists(component->GetFullParmName("FieldQueryReplayRepeat")))
+			repeat = pM->GetIntegerParameter(component->GetFullParmName("FieldQueryReplayRepeat"));
+		if (repeat < 1) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "The parameter: " << component->GetFullParmName("FieldQueryReplayRepeat") << G4endl;
+			G4cerr << "must be at least 1." << G4endl;
+			pM->AbortSession(1);
+		}
+
+		G4bool first;
+		{
+			G4AutoLock lock(&traceMutex);
+			first = replayedFiles.insert(replayFile).second;
+		}
+		if (first)
+			Replay(replayFile, regions, repeat, component->GetName());
+	}
+
+	if (!pM->ParameterExists(component->GetFullParmName("FieldQueryTraceFile")))
+		return 0;
+
+	G4int sampling = 100;
+	if (pM->ParameterExists(component->GetFullParmName("FieldQueryTraceSampling")))
+		sampling = pM->GetIntegerParameter(component->GetFullParmName("FieldQueryTraceSampling"));
+	if (sampling < 1) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The parameter: " << component->GetFullParmName("FieldQueryTraceSampling") << G4endl;
+		G4cerr << "must be at least 1." << G4endl;
+		pM->AbortSession(1);
+	}
+
+	G4bool context = false;
+	if (trackContext && pM->ParameterExists(component->GetFullParmName("FieldQueryTraceContext")))
+		context = pM->GetBooleanParameter(component->GetFullParmName("FieldQueryTraceContext"));
+
+	return new HGMEFieldQueryTrace(pM->GetStringParameter(component->GetFullParmName("FieldQueryTraceFile")),
+								   sampling, context);
+}
+
+HGMEFieldQueryTrace::~HGMEFieldQueryTrace() {
+	Flush();
+}
+
+void HGMEFieldQueryTrace::Flush() {
+	if (fBuffer.empty())
+		return;
+
+	// Packed in the file format before taking the lock
+	const size_t recordSize = fTrackContext ? 24 : 16;
+	std::vector<char> block(fBuffer.size() * recordSize);
+	for (size_t q = 0; q < fBuffer.size(); q++) {
+		char* record = &block[q * recordSize];
+		std::memcpy(record, fBuffer[q].position, 12);
+		int32_t values[3] = {fBuffer[q].thread, fBuffer[q].trackID, fBuffer[q].stepNumber};
+		std::memcpy(record + 12, values, recordSize - 12);
+	}
+	fBuffer.clear();
+
+	G4AutoLock lock(&traceMutex);
+	fFile->write(&block[0], block.size());
+	fFile->flush();
+}
+
+G4bool HGMEFieldQueryTrace::Read(const G4String& fileName, std::vector<Query>& queries, G4bool& trackContext) {
+	std::ifstream input(fileName, std::ios::binary);
+	char magic[8];
+	uint32_t header[2];
+	input.read(magic, sizeof(magic));
+	input.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!input || std::memcmp(magic, traceMagic, sizeof(magic)) != 0)
+		return false;
+
+	trackContext = header[0] & 1U;
+	const size_t recordSize = trackContext ? 24 : 16;
+	char record[24];
+	queries.clear();
+	while (input.read(record, recordSize)) {
+		Query query;
+		int32_t values[3] = {0, 0, 0};
+		std::memcpy(query.position, record, 12);
+		std::memcpy(values, record + 12, recordSize - 12);
+		query.thread = values[0];
+		query.trackID = values[1];
+		query.stepNumber = values[2];
+		queries.push_back(query);
+	}
+	return true;
+}
+
+void HGMEFieldQueryTrace::Replay(const G4String& fileName, const HGMEFieldRegions& regions, G4int repeat, const G4String& name) {
+	std::vector<Query> queries;
+	G4bool trackContext = false;
+	if (!Read(fileName, queries, trackContext) || queries.empty()) {
+		G4cout << "Field query trace " << fileName << " is missing, empty or not a trace" << G4endl;
+		return;
+	}
+
+	std::vector<G4double> points(3 * queries.size());
+	std::set<G4int> threads, tracks;
+	for (size_t q = 0; q < queries.size(); q++) {
+		for (G4int axis = 0; axis < 3; axis++)
+			points[3 * q + axis] = queries[q].position[axis];
+		threads.insert(queries[q].thread);
+		if (trackContext)
+			tracks.insert(queries[q].trackID);
+	}
+
+#ifdef __linux__
+	Counter references(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+	Counter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	Counter l1Misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+					 (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	Counter tlbMisses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+					  (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+	Counter references(0, 0), misses(0, 0), l1Misses(0, 0), tlbMisses(0, 0);
+#endif
+
+	// One untimed pass brings the table to the state of a running job
+	G4double field[3];
+	G4double sum = 0.;
+	G4long inside = 0;
+	for (size_t q = 0; q < queries.size(); q++)
+		inside += regions.Evaluate(&points[3 * q], field);
+
+	references.Start();
+	misses.Start();
+	l1Misses.Start();
+	tlbMisses.Start();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (G4int r = 0; r < repeat; r++) {
+		for (size_t q = 0; q < queries.size(); q++) {
+			regions.Evaluate(&points[3 * q], field);
+			sum += field[0];
+		}
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	const G4double total = (G4double)queries.size() * repeat;
+	const uint64_t counts[4] = {tlbMisses.Stop(), l1Misses.Stop(), misses.Stop(), references.Stop()};
+
+	G4cout << "Replay of " << fileName << " on " << name << ": " << queries.size() << " queries from "
+	<< threads.size() << " threads";
+	if (trackContext)
+		G4cout << " and " << tracks.size() << " track IDs";
+	G4cout << ", " << 100. * inside / queries.size() << "% inside the maps" << G4endl;
+	G4cout << "  " << std::chrono::duration<G4double, std::nano>(stop - start).count() / total << " ns/query over "
+	<< repeat << " passes" << G4endl;
+	if (references.IsValid())
+		G4cout << "  per query: " << counts[3] / total << " cache references, " << counts[2] / total << " cache misses" << G4endl;
+	if (l1Misses.IsValid() || tlbMisses.IsValid())
+		G4cout << "  per query: " << counts[1] / total << " L1 data read misses, " << counts[0] / total << " data TLB read misses" << G4endl;
+	if (!references.IsValid() && !tlbMisses.IsValid())
+		G4cout << "  hardware counters unavailable (see /proc/sys/kernel/perf_event_paranoid)" << G4endl;
+
+	replaySink = sum;
+}
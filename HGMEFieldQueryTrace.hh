@@ -0,0 +1,117 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldQueryTrace_hh
+#define HGMEFieldQueryTrace_hh
+
+#include "G4String.hh"
+#include "G4Types.hh"
+
+#include <fstream>
+#include <memory>
+#include <vector>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+class HGMEFieldRegions;
+
+// Sampled record of the points at which a field map is queried, and replay
+// of such a record against a map configuration.
+//
+// Every thread keeps its own recorder and buffers one in every N queries,
+// in the component frame, with its thread id and optionally the track ID
+// and step number. Buffers are appended to a trace file that all threads
+// share, in blocks, so the queries of one thread stay in order. The first
+// recorder of a file sets its sampling and context, which the others
+// follow, with track ID and step number 0 where they have none.
+//
+// Format: "HGMEFQ01", uint32 flags (bit 0: track context), uint32 sampling,
+// then records of float x, y, z (mm) and int32 thread, followed by int32
+// track ID and step number when bit 0 is set.
+class HGMEFieldQueryTrace
+{
+public:
+	struct Query {
+		G4float position[3];
+		G4int thread;
+		G4int trackID;
+		G4int stepNumber;
+	};
+
+	HGMEFieldQueryTrace(const G4String& fileName, G4int sampling, G4bool trackContext);
+	~HGMEFieldQueryTrace();
+
+	// Replays FieldQueryReplayFile against the maps of a component, once per
+	// file and process, and returns a recorder for FieldQueryTraceFile, or 0
+	// when the component does not record its queries
+	static HGMEFieldQueryTrace* Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+										  const HGMEFieldRegions& regions, G4bool trackContext);
+
+	// Called on every query, keeps one in every sampling
+	void Record(const G4double point[3], G4int trackID, G4int stepNumber) {
+		if (++fCalls < fSampling)
+			return;
+		fCalls = 0;
+		Query query;
+		query.position[0] = (G4float)point[0];
+		query.position[1] = (G4float)point[1];
+		query.position[2] = (G4float)point[2];
+		query.thread = fThread;
+		query.trackID = trackID;
+		query.stepNumber = stepNumber;
+		fBuffer.push_back(query);
+		if (fBuffer.size() >= kBufferSize)
+			Flush();
+	}
+
+	G4bool GetTrackContext() const { return fTrackContext; }
+
+	// Appends the buffered queries to the trace file
+	void Flush();
+
+	// Reads a trace file, returning false if it is not one
+	static G4bool Read(const G4String& fileName, std::vector<Query>& queries, G4bool& trackContext);
+
+	// Runs the queries of a trace, repeat times, through the maps and prints
+	// ns/query and, where the system allows it, cache and TLB misses per query
+	static void Replay(const G4String& fileName, const HGMEFieldRegions& regions, G4int repeat, const G4String& name);
+
+private:
+	static const size_t kBufferSize = 65536;
+
+	G4String fFileName;
+	G4int fSampling;
+	G4bool fTrackContext;
+	G4int fThread;
+	G4int fCalls;
+	std::vector<Query> fBuffer;
+	std::shared_ptr<std::ofstream> fFile;
+};
+
+#endif
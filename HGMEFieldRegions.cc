@@ -0,0 +1,344 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldRegions.hh"
+#include "HGMEFieldMapLoader.hh"
+
+#include "TsParameterManager.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4LogicalVolume.hh"
+#include "G4VSolid.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace {
+	// Finest index cells along an axis, relative to the smallest region
+	const G4int kCellsPerRegion = 2;
+	const G4int kMaxCellsPerAxis = 64;
+
+	// Queries never leave the envelope of the component, so a table needs
+	// no nodes beyond its bounding box, taken to the frame of the table
+	void CropToComponent(TsVGeometryComponent* component, const G4double offset[3], HGMEFieldMapLoader& loader) {
+		G4ThreeVector min, max;
+		component->GetEnvelopeLogicalVolume()->GetSolid()->BoundingLimits(min, max);
+		const G4double boxMin[3] = {min.x() - offset[0], min.y() - offset[1], min.z() - offset[2]};
+		const G4double boxMax[3] = {max.x() - offset[0], max.y() - offset[1], max.z() - offset[2]};
+		loader.SetCropBox(boxMin, boxMax);
+	}
+
+	// Offset of a map region in the component frame
+	void ReadOffset(TsParameterManager* pM, TsVGeometryComponent* component, const G4String& regionPrefix, G4double offset[3]) {
+		const char* axisNames[3] = {"X", "Y", "Z"};
+		for (G4int axis = 0; axis < 3; axis++) {
+			offset[axis] = 0.;
+			G4String transName = component->GetFullParmName((regionPrefix + "Trans" + axisNames[axis]).c_str());
+			if (pM->ParameterExists(transName))
+				offset[axis] = pM->GetDoubleParameter(transName, "Length");
+		}
+	}
+}
+
+HGMEFieldRegions::HGMEFieldRegions(): fSingle(0) {
+	for (G4int axis = 0; axis < 3; axis++) {
+		fMin[axis] = 0.;
+		fMax[axis] = 0.;
+		fCells[axis] = 1;
+		fInverseCell[axis] = 0.;
+	}
+}
+
+HGMEFieldRegions::HGMEFieldRegions(const HGMEFieldRegions& other) {
+	*this = other;
+}
+
+HGMEFieldRegions& HGMEFieldRegions::operator=(const HGMEFieldRegions& other) {
+	fRegions = other.fRegions;
+	for (G4int axis = 0; axis < 3; axis++) {
+		fMin[axis] = other.fMin[axis];
+		fMax[axis] = other.fMax[axis];
+		fCells[axis] = other.fCells[axis];
+		fInverseCell[axis] = other.fInverseCell[axis];
+	}
+	fCellStart = other.fCellStart;
+	fCellRegions = other.fCellRegions;
+
+	// The lone table is the one of this copy
+	fSingle = other.fSingle ? &fRegions[0].table : 0;
+	return *this;
+}
+
+HGMEFieldRegions::~HGMEFieldRegions() {;}
+
+void HGMEFieldRegions::GetLoaders(TsParameterManager* pM, TsVGeometryComponent* component, const char* fieldUnit,
+								  const G4String& prefix, std::vector<std::shared_ptr<HGMEFieldMapLoader> >& loaders) {
+	const G4double origin[3] = {0., 0., 0.};
+
+	G4String name = component->GetFullParmName((prefix + "FieldMapRegions").c_str());
+	if (!pM->ParameterExists(name)) {
+		std::shared_ptr<HGMEFieldMapLoader> loader = std::make_shared<HGMEFieldMapLoader>(pM, fieldUnit);
+		loader->ReadOptions(component, prefix);
+		CropToComponent(component, origin, *loader);
+		loaders.push_back(loader);
+		return;
+	}
+
+	G4int nRegions = pM->GetVectorLength(name);
+	G4String* regionNames = pM->GetStringVector(name);
+	if (nRegions < 1 || nRegions > 65535) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << name << " must name between 1 and 65535 map regions." << G4endl;
+		pM->AbortSession(1);
+	}
+
+	for (G4int r = 0; r < nRegions; r++) {
+		G4String regionPrefix = prefix + "FieldMapRegion/" + regionNames[r] + "/";
+		G4double offset[3];
+		ReadOffset(pM, component, regionPrefix, offset);
+
+		std::shared_ptr<HGMEFieldMapLoader> loader = std::make_shared<HGMEFieldMapLoader>(pM, fieldUnit);
+		loader->ReadOptions(component, regionPrefix);
+		CropToComponent(component, offset, *loader);
+		loaders.push_back(loader);
+	}
+	delete[] regionNames;
+}
+
+void HGMEFieldRegions::Load(TsParameterManager* pM, TsVGeometryComponent* component, const char* fieldUnit,
+							const G4String& prefix) {
+	fRegions.clear();
+	std::vector<std::shared_ptr<HGMEFieldMapLoader> > loaders;
+	GetLoaders(pM, component, fieldUnit, prefix, loaders);
+
+	G4String name = component->GetFullParmName((prefix + "FieldMapRegions").c_str());
+	if (!pM->ParameterExists(name)) {
+		const G4double origin[3] = {0., 0., 0.};
+		HGMEFieldMapLoader& loader = *loaders[0];
+		HGMEFieldTable table;
+		loader.Load(&table);
+		AddRegion(loader.GetFileName(), table, origin, 0, loader.GetSmoothness());
+		G4double min[3], max[3];
+		if (loader.HasEnvelope())
+			SetEnvelope(0, loader.GetEnvelope(min, max), min, max);
+		BuildIndex();
+		return;
+	}
+
+	G4String* regionNames = pM->GetStringVector(name);
+	for (size_t r = 0; r < loaders.size(); r++) {
+		G4String regionPrefix = prefix + "FieldMapRegion/" + regionNames[r] + "/";
+		G4double offset[3];
+		ReadOffset(pM, component, regionPrefix, offset);
+
+		HGMEFieldMapLoader& loader = *loaders[r];
+		HGMEFieldTable table;
+		loader.Load(&table);
+
+		G4int priority = 0;
+		G4String priorityName = component->GetFullParmName((regionPrefix + "Priority").c_str());
+		if (pM->ParameterExists(priorityName))
+			priority = pM->GetIntegerParameter(priorityName);
+
+		AddRegion(regionNames[r], table, offset, priority, loader.GetSmoothness());
+		G4double min[3], max[3];
+		if (loader.HasEnvelope())
+			SetEnvelope(r, loader.GetEnvelope(min, max), min, max);
+	}
+	delete[] regionNames;
+
+	BuildIndex();
+
+	size_t entries = fCellRegions.size();
+	size_t cells = fCellStart.size() - 1;
+	G4cout << component->GetName() << ": " << fRegions.size() << " field map regions, index of "
+	<< fCells[0] << " x " << fCells[1] << " x " << fCells[2] << " cells, "
+	<< (cells > 0 ? G4double(entries) / cells : 0.) << " regions per cell" << G4endl;
+}
+
+void HGMEFieldRegions::AddRegion(const G4String& name, const HGMEFieldTable& table, const G4double offset[3], G4int priority,
+								 const std::shared_ptr<const HGMEFieldSmoothness>& smoothness) {
+	Region region;
+	region.name = name;
+	region.table = table;
+	region.smoothness = smoothness;
+	region.priority = priority;
+	region.hasField = true;
+	G4double min[3], max[3];
+	table.GetBounds(min, max);
+	for (G4int axis = 0; axis < 3; axis++) {
+		region.offset[axis] = offset[axis];
+		region.min[axis] = min[axis] + offset[axis];
+		region.max[axis] = max[axis] + offset[axis];
+		region.envelopeMin[axis] = region.min[axis];
+		region.envelopeMax[axis] = region.max[axis];
+	}
+	fRegions.push_back(region);
+	fSingle = 0;
+}
+
+void HGMEFieldRegions::SetEnvelope(size_t region, G4bool hasField, const G4double min[3], const G4double max[3]) {
+	Region& target = fRegions[region];
+	target.hasField = hasField;
+	for (G4int axis = 0; axis < 3 && hasField; axis++) {
+		target.envelopeMin[axis] = min[axis] + target.offset[axis];
+		target.envelopeMax[axis] = max[axis] + target.offset[axis];
+	}
+}
+
+G4bool HGMEFieldRegions::GetEnvelope(size_t region, G4double min[3], G4double max[3]) const {
+	const Region& source = fRegions[region];
+	for (G4int axis = 0; axis < 3; axis++) {
+		min[axis] = source.envelopeMin[axis];
+		max[axis] = source.envelopeMax[axis];
+	}
+	return source.hasField;
+}
+
+void HGMEFieldRegions::BuildIndex() {
+	fSingle = 0;
+	fCellStart.clear();
+	fCellRegions.clear();
+	if (fRegions.empty())
+		return;
+
+	if (fRegions.size() == 1 && fRegions[0].offset[0] == 0. && fRegions[0].offset[1] == 0. && fRegions[0].offset[2] == 0.)
+		fSingle = &fRegions[0].table;
+
+	// Regions by decreasing priority, in declaration order among equals
+	std::vector<size_t> order(fRegions.size());
+	for (size_t r = 0; r < order.size(); r++)
+		order[r] = r;
+	std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+		return fRegions[a].priority > fRegions[b].priority;
+	});
+
+	// Cells a fraction of the smallest region wide along each axis. Axes
+	// where any region is invariant, and so unbounded, get a single cell.
+	for (G4int axis = 0; axis < 3; axis++) {
+		fMin[axis] = DBL_MAX;
+		fMax[axis] = -DBL_MAX;
+		G4double smallest = DBL_MAX;
+		for (size_t r = 0; r < fRegions.size(); r++) {
+			fMin[axis] = std::min(fMin[axis], fRegions[r].min[axis]);
+			fMax[axis] = std::max(fMax[axis], fRegions[r].max[axis]);
+			smallest = std::min(smallest, fRegions[r].max[axis] - fRegions[r].min[axis]);
+		}
+
+		G4double extent = fMax[axis] - fMin[axis];
+		fCells[axis] = 1;
+		if (fMin[axis] > -DBL_MAX && fMax[axis] < DBL_MAX && smallest > 0.)
+			fCells[axis] = (G4int)std::min<G4double>(kMaxCellsPerAxis, std::ceil(kCellsPerRegion * extent / smallest));
+		fCells[axis] = std::max(fCells[axis], 1);
+		fInverseCell[axis] = fCells[axis] > 1 ? fCells[axis] / extent : 0.;
+	}
+
+	// Overlap of each cell, widened by a rounding margin, with each region
+	fCellStart.push_back(0);
+	for (G4int ix = 0; ix < fCells[0]; ix++) {
+		for (G4int iy = 0; iy < fCells[1]; iy++) {
+			for (G4int iz = 0; iz < fCells[2]; iz++) {
+				const G4int index[3] = {ix, iy, iz};
+				for (size_t o = 0; o < order.size(); o++) {
+					const Region& region = fRegions[order[o]];
+					G4bool overlaps = true;
+					for (G4int axis = 0; axis < 3 && overlaps; axis++) {
+						if (fCells[axis] == 1)
+							continue;
+						G4double width = 1. / fInverseCell[axis];
+						G4double low = fMin[axis] + index[axis] * width - 1.e-9 * width;
+						G4double high = fMin[axis] + (index[axis] + 1) * width + 1.e-9 * width;
+						overlaps = region.max[axis] >= low && region.min[axis] <= high;
+					}
+					if (overlaps)
+						fCellRegions.push_back((unsigned short)order[o]);
+				}
+				fCellStart.push_back((unsigned int)fCellRegions.size());
+			}
+		}
+	}
+}
+
+const HGMEFieldRegions::Region* HGMEFieldRegions::Find(const G4double point[3], G4double local[3]) const {
+	if (point[0] < fMin[0] || point[0] > fMax[0] ||
+		point[1] < fMin[1] || point[1] > fMax[1] ||
+		point[2] < fMin[2] || point[2] > fMax[2] || fCellStart.empty())
+		return 0;
+
+	G4int index[3];
+	for (G4int axis = 0; axis < 3; axis++)
+		index[axis] = std::min(fCells[axis] - 1, (G4int)((point[axis] - fMin[axis]) * fInverseCell[axis]));
+	const size_t cell = ((size_t)index[0] * fCells[1] + index[1]) * fCells[2] + index[2];
+
+	for (unsigned int e = fCellStart[cell]; e < fCellStart[cell + 1]; e++) {
+		const Region& region = fRegions[fCellRegions[e]];
+		for (G4int axis = 0; axis < 3; axis++)
+			local[axis] = point[axis] - region.offset[axis];
+		if (region.table.IsInside(local))
+			return &region;
+	}
+	return 0;
+}
+
+G4bool HGMEFieldRegions::Route(const G4double point[3], G4double field[3]) const {
+	G4double local[3];
+	if (const Region* region = Find(point, local))
+		return region->table.Evaluate(local, field);
+
+	field[0] = 0.;
+	field[1] = 0.;
+	field[2] = 0.;
+	return false;
+}
+
+G4double HGMEFieldRegions::GetStepLimit(const G4double point[3], G4double relativeChange) const {
+	G4double local[3];
+	const Region* region = fSingle ? &fRegions[0] : Find(point, local);
+	if (!region || !region->smoothness)
+		return DBL_MAX;
+
+	// The smoothness table covers the grid, (r, z) for axisymmetric tables
+	G4double grid[3];
+	region->table.ToGrid(fSingle ? point : local, grid);
+	return region->smoothness->GetStepLimit(grid, relativeChange);
+}
+
+G4bool HGMEFieldRegions::RouteGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+	G4double local[3];
+	if (const Region* region = Find(point, local))
+		return region->table.EvaluateGradient(local, field, gradient);
+
+	std::fill(gradient, gradient + 9, 0.);
+	field[0] = 0.;
+	field[1] = 0.;
+	field[2] = 0.;
+	return false;
+}
@@ -0,0 +1,150 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldRegions_hh
+#define HGMEFieldRegions_hh
+
+#include "HGMEFieldTable.hh"
+#include "HGMEFieldSmoothness.hh"
+
+#include "G4String.hh"
+
+#include <memory>
+#include <vector>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+class HGMEFieldMapLoader;
+
+// The field maps of one component: a single table, or several map regions
+// that may overlap, the one of highest priority winning.
+//
+// Queries are routed through a uniform grid over the union of the regions.
+// Each cell lists, by decreasing priority, the regions that overlap it, so a
+// query tests only those and a point outside every region costs a box test
+// or an empty cell lookup.
+class HGMEFieldRegions
+{
+public:
+	HGMEFieldRegions();
+	HGMEFieldRegions(const HGMEFieldRegions& other);
+	HGMEFieldRegions& operator=(const HGMEFieldRegions& other);
+	~HGMEFieldRegions();
+
+	// Loads the regions named by FieldMapRegions or, without it, the single
+	// map of the component. fieldUnit is passed to HGMEFieldMapLoader, and
+	// prefix goes before every parameter name, for components with several
+	// maps.
+	void Load(TsParameterManager* pM, TsVGeometryComponent* component, const char* fieldUnit,
+			  const G4String& prefix = "");
+
+	// Loaders of the tables Load reads, one per region, with their options
+	// read, so that the tables can be loaded ahead of it
+	static void GetLoaders(TsParameterManager* pM, TsVGeometryComponent* component, const char* fieldUnit,
+						   const G4String& prefix, std::vector<std::shared_ptr<HGMEFieldMapLoader> >& loaders);
+
+	// Region whose table is placed with its origin at offset in the
+	// component frame, with its smoothness table if there is one.
+	// BuildIndex must be called once all are added.
+	void AddRegion(const G4String& name, const HGMEFieldTable& table, const G4double offset[3], G4int priority,
+				   const std::shared_ptr<const HGMEFieldSmoothness>& smoothness = std::shared_ptr<const HGMEFieldSmoothness>());
+	void BuildIndex();
+
+	// Field at a point of the component frame. Returns false, and a zero
+	// field, outside every region.
+	G4bool Evaluate(const G4double point[3], G4double field[3]) const {
+		if (fSingle)
+			return fSingle->Evaluate(point, field);
+		return Route(point, field);
+	}
+
+	// Field and its derivatives dF_i/dx_j in gradient[3 * i + j], from one
+	// lookup, see HGMEFieldTable::EvaluateGradient
+	G4bool EvaluateGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+		if (fSingle)
+			return fSingle->EvaluateGradient(point, field, gradient);
+		return RouteGradient(point, field, gradient);
+	}
+
+	// Step over which the field of the region holding a point changes by at
+	// most relativeChange of its local maximum, see HGMEFieldSmoothness.
+	// DBL_MAX outside the regions or without smoothness tables.
+	G4double GetStepLimit(const G4double point[3], G4double relativeChange) const;
+
+	size_t GetNumberOfRegions() const { return fRegions.size(); }
+	const HGMEFieldTable& GetTable(size_t region) const { return fRegions[region].table; }
+	const G4double* GetOffset(size_t region) const { return fRegions[region].offset; }
+
+	// Part of a region outside of which its field is zero or negligible, in
+	// the component frame. It is the box of the region unless set, with a
+	// box of the table frame, by SetEnvelope. GetEnvelope returns false if
+	// the region has no field at all.
+	void SetEnvelope(size_t region, G4bool hasField, const G4double min[3], const G4double max[3]);
+	G4bool GetEnvelope(size_t region, G4double min[3], G4double max[3]) const;
+
+	// Box holding every region, in the component frame
+	const G4double* GetMin() const { return fMin; }
+	const G4double* GetMax() const { return fMax; }
+
+private:
+	struct Region {
+		G4String name;
+		HGMEFieldTable table;
+		std::shared_ptr<const HGMEFieldSmoothness> smoothness;
+		G4double offset[3];
+		G4double min[3];
+		G4double max[3];
+		G4int priority;
+		G4bool hasField;
+		G4double envelopeMin[3];
+		G4double envelopeMax[3];
+	};
+
+	// Region of highest priority holding a point, and the point in its frame
+	const Region* Find(const G4double point[3], G4double local[3]) const;
+	G4bool Route(const G4double point[3], G4double field[3]) const;
+	G4bool RouteGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const;
+
+	std::vector<Region> fRegions;
+
+	// Table of a lone region placed at the origin, queried directly
+	const HGMEFieldTable* fSingle;
+
+	G4double fMin[3];
+	G4double fMax[3];
+
+	// Index grid: cells along each axis, inverse cell size, and for each cell
+	// the range of fCellRegions listing its regions
+	G4int fCells[3];
+	G4double fInverseCell[3];
+	std::vector<unsigned int> fCellStart;
+	std::vector<unsigned short> fCellRegions;
+};
+
+#endif
@@ -0,0 +1,181 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldResampler.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+HGMEFieldResampler::HGMEFieldResampler(G4double maxError):
+fMaxError(maxError), fMaxDeviation(0.), fOriginalMemory(0), fResampledMemory(0) {
+}
+
+HGMEFieldResampler::~HGMEFieldResampler() {;}
+
+G4bool HGMEFieldResampler::Resample(HGMEFieldTable* table) {
+	const HGMEFieldTable::Interpolation interpolation = table->GetInterpolation();
+	table->SetInterpolation(HGMEFieldTable::kTrilinear);
+
+	const G4int original[3] = {table->GetNX(), table->GetNY(), table->GetNZ()};
+	G4int n[3] = {original[0], original[1], original[2]};
+	G4int rejected[3] = {0, 0, 0};
+	G4double deviation = 0.;
+	fMaxDeviation = 0.;
+	fOriginalMemory = table->GetMemorySize();
+	fResampledMemory = fOriginalMemory;
+
+	// Halve the axis whose reduction is largest while the error allows
+	while (true) {
+		G4int bestAxis = -1;
+		G4double bestRatio = 1.;
+		G4double bestDeviation = 0.;
+		for (G4int axis = 0; axis < 3; axis++) {
+			if (n[axis] <= 2 || rejected[axis] != 0) continue;
+			G4int trial[3] = {n[0], n[1], n[2]};
+			trial[axis] = n[axis] / 2 + 1;
+			G4double ratio = G4double(trial[axis]) / n[axis];
+			if (Accept(*table, trial, deviation)) {
+				if (ratio < bestRatio) {
+					bestAxis = axis;
+					bestRatio = ratio;
+					bestDeviation = deviation;
+				}
+			} else {
+				rejected[axis] = trial[axis];
+			}
+		}
+		if (bestAxis < 0) break;
+		n[bestAxis] = n[bestAxis] / 2 + 1;
+		fMaxDeviation = bestDeviation;
+	}
+
+	// Between an accepted and a rejected size, find the smallest that passes
+	for (G4int axis = 0; axis < 3; axis++) {
+		G4int low = rejected[axis];
+		G4int high = n[axis];
+		while (low != 0 && high - low > 1) {
+			G4int trial[3] = {n[0], n[1], n[2]};
+			trial[axis] = (low + high) / 2;
+			if (Accept(*table, trial, deviation)) {
+				high = trial[axis];
+				n[axis] = high;
+				fMaxDeviation = deviation;
+			} else {
+				low = trial[axis];
+			}
+		}
+	}
+
+	if (n[0] == original[0] && n[1] == original[1] && n[2] == original[2]) {
+		table->SetInterpolation(interpolation);
+		return false;
+	}
+
+	HGMEFieldTable coarse;
+	Build(*table, n, &coarse);
+	fMaxDeviation = Deviation(*table, coarse);
+	Build(*table, n, table);
+	fResampledMemory = table->GetMemorySize();
+	table->SetInterpolation(interpolation);
+	return true;
+}
+
+G4bool HGMEFieldResampler::Accept(const HGMEFieldTable& source, const G4int n[3], G4double& deviation) const {
+	HGMEFieldTable coarse;
+	Build(source, n, &coarse);
+	deviation = Deviation(source, coarse);
+	return deviation <= fMaxError;
+}
+
+void HGMEFieldResampler::Build(const HGMEFieldTable& source, const G4int n[3], HGMEFieldTable* coarse) const {
+	const G4double first[3] = {source.GetFirst(0), source.GetFirst(1), source.GetFirst(2)};
+	const G4double last[3] = {source.GetLast(0), source.GetLast(1), source.GetLast(2)};
+
+	// Sampled into a scratch table first, coarse may be the source itself
+	HGMEFieldTable result;
+	result.SetHugePages(source.GetHugePages());
+	result.Allocate(n[0], n[1], n[2], source.GetPrecision());
+	result.SetLimits(first[0], first[1], first[2], last[0], last[1], last[2]);
+
+	G4double position[3], field[3];
+	for (G4int ix = 0; ix < n[0]; ix++) {
+		for (G4int iy = 0; iy < n[1]; iy++) {
+			for (G4int iz = 0; iz < n[2]; iz++) {
+				result.GetNodePosition(ix, iy, iz, position);
+				source.Evaluate(position, field);
+				result.SetNode(ix, iy, iz, field[0], field[1], field[2]);
+			}
+		}
+	}
+	std::swap(*coarse, result);
+}
+
+G4double HGMEFieldResampler::Deviation(const HGMEFieldTable& source, const HGMEFieldTable& coarse) const {
+	// Both interpolants are trilinear within every box bounded by the nodes
+	// of either grid, so the norm of their difference is largest at a corner
+	// of such a box: each coordinate taken from a node of either grid
+	std::vector<G4double> coordinates[3];
+	const HGMEFieldTable* tables[2] = {&source, &coarse};
+	G4double position[3];
+	for (G4int axis = 0; axis < 3; axis++) {
+		for (G4int t = 0; t < 2; t++) {
+			const G4int n = axis == 0 ? tables[t]->GetNX() : (axis == 1 ? tables[t]->GetNY() : tables[t]->GetNZ());
+			for (G4int i = 0; i < n; i++) {
+				tables[t]->GetNodePosition(axis == 0 ? i : 0, axis == 1 ? i : 0, axis == 2 ? i : 0, position);
+				coordinates[axis].push_back(position[axis]);
+			}
+		}
+		std::sort(coordinates[axis].begin(), coordinates[axis].end());
+		const G4double tolerance = 1.e-9 * (coordinates[axis].back() - coordinates[axis].front());
+		coordinates[axis].erase(std::unique(coordinates[axis].begin(), coordinates[axis].end(),
+											[tolerance](G4double a, G4double b) { return b - a <= tolerance; }),
+								coordinates[axis].end());
+	}
+
+	G4double largest = 0.;
+	G4double reference[3], field[3];
+	for (size_t ix = 0; ix < coordinates[0].size(); ix++) {
+		position[0] = coordinates[0][ix];
+		for (size_t iy = 0; iy < coordinates[1].size(); iy++) {
+			position[1] = coordinates[1][iy];
+			for (size_t iz = 0; iz < coordinates[2].size(); iz++) {
+				position[2] = coordinates[2][iz];
+				source.Evaluate(position, reference);
+				coarse.Evaluate(position, field);
+				G4double dx = field[0] - reference[0];
+				G4double dy = field[1] - reference[1];
+				G4double dz = field[2] - reference[2];
+				largest = std::max(largest, std::sqrt(dx * dx + dy * dy + dz * dz));
+				if (largest > fMaxError) return largest;
+			}
+		}
+	}
+	return largest;
+}
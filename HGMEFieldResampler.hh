@@ -0,0 +1,74 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldResampler_hh
+#define HGMEFieldResampler_hh
+
+#include "HGMEFieldTable.hh"
+
+// Replaces an oversampled table by the coarsest regular grid whose
+// trilinear interpolation stays within a given field error of the trilinear
+// interpolation of the original table, everywhere in the table.
+//
+// The number of nodes is halved along whichever axis saves most memory for
+// as long as the error allows it, then each axis is refined by bisection
+// between the last accepted and the first rejected node count.
+class HGMEFieldResampler
+{
+public:
+	HGMEFieldResampler(G4double maxError);
+	~HGMEFieldResampler();
+
+	// Resamples the table in place. Returns false, leaving it untouched, if
+	// no coarser grid meets the tolerance.
+	G4bool Resample(HGMEFieldTable* table);
+
+	// Largest deviation |F_coarse - F_original| of the interpolants and
+	// the memory of the original and resampled tables
+	G4double GetMaxDeviation() const { return fMaxDeviation; }
+	size_t GetOriginalMemory() const { return fOriginalMemory; }
+	size_t GetResampledMemory() const { return fResampledMemory; }
+
+private:
+	// Coarse table of the given size, interpolated from the source
+	void Build(const HGMEFieldTable& source, const G4int n[3], HGMEFieldTable* coarse) const;
+
+	// Largest deviation, giving up as soon as it exceeds the tolerance
+	G4double Deviation(const HGMEFieldTable& source, const HGMEFieldTable& coarse) const;
+
+	// Whether a grid of the given size meets the tolerance
+	G4bool Accept(const HGMEFieldTable& source, const G4int n[3], G4double& deviation) const;
+
+	G4double fMaxError;
+	G4double fMaxDeviation;
+	size_t fOriginalMemory;
+	size_t fResampledMemory;
+};
+
+#endif
@@ -0,0 +1,163 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldSeriesFitter.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+HGMEFieldSeriesFitter::HGMEFieldSeriesFitter(G4int order, G4int patchesX, G4int patchesY):
+fOrder(order), fPatchesX(patchesX), fPatchesY(patchesY), fMaxResidual(0.), fRmsResidual(0.), fMaxField(0.) {
+}
+
+HGMEFieldSeriesFitter::~HGMEFieldSeriesFitter() {;}
+
+G4bool HGMEFieldSeriesFitter::Fit(const HGMEFieldTable& table) {
+	typedef std::complex<G4double> Complex;
+	const size_t stride = 4 + 2 * (size_t)fOrder;
+	fCoefficients.assign(stride * fPatchesX * fPatchesY, 0.);
+
+	const G4double min[2] = {table.GetMinX(), table.GetMinY()};
+	const G4double width[2] = {(table.GetMaxX() - min[0]) / fPatchesX, (table.GetMaxY() - min[1]) / fPatchesY};
+	const G4double radius = 0.5 * std::sqrt(width[0] * width[0] + width[1] * width[1]);
+
+	for (G4int px = 0; px < fPatchesX; px++) {
+		for (G4int py = 0; py < fPatchesY; py++) {
+			const G4double low[2] = {min[0] + px * width[0], min[1] + py * width[1]};
+			const G4double high[2] = {low[0] + width[0], low[1] + width[1]};
+			const G4double center[2] = {0.5 * (low[0] + high[0]), 0.5 * (low[1] + high[1])};
+
+			// Nodes of the patch, boundaries shared with the neighbours
+			std::vector<Complex> z, data;
+			G4double fz = 0.;
+			G4double position[3], field[3];
+			for (G4int ix = 0; ix < table.GetNX(); ix++) {
+				for (G4int iy = 0; iy < table.GetNY(); iy++) {
+					table.GetNodePosition(ix, iy, 0, position);
+					const G4double margin = 1.e-9 * radius;
+					if (position[0] < low[0] - margin || position[0] > high[0] + margin ||
+						position[1] < low[1] - margin || position[1] > high[1] + margin)
+						continue;
+					table.GetNode(ix, iy, 0, field);
+					z.push_back(Complex(position[0] - center[0], position[1] - center[1]) / radius);
+					data.push_back(Complex(field[1], field[0]));
+					fz += field[2];
+				}
+			}
+			const size_t m = z.size();
+			const size_t n = fOrder;
+			if (m < n)
+				return false;
+
+			// Modified Gram-Schmidt QR of the columns z^k, then R c = Q^H data
+			std::vector<Complex> q(m * n);
+			std::vector<Complex> r(n * n, Complex(0., 0.));
+			for (size_t i = 0; i < m; i++) {
+				Complex power(1., 0.);
+				for (size_t k = 0; k < n; k++) {
+					q[k * m + i] = power;
+					power *= z[i];
+				}
+			}
+			for (size_t k = 0; k < n; k++) {
+				Complex* column = &q[k * m];
+				for (size_t j = 0; j < k; j++) {
+					const Complex* previous = &q[j * m];
+					Complex dot(0., 0.);
+					for (size_t i = 0; i < m; i++)
+						dot += std::conj(previous[i]) * column[i];
+					r[j * n + k] = dot;
+					for (size_t i = 0; i < m; i++)
+						column[i] -= dot * previous[i];
+				}
+				G4double norm = 0.;
+				for (size_t i = 0; i < m; i++)
+					norm += std::norm(column[i]);
+				norm = std::sqrt(norm);
+				r[k * n + k] = norm;
+				if (norm > 0.)
+					for (size_t i = 0; i < m; i++)
+						column[i] /= norm;
+			}
+
+			std::vector<Complex> c(n);
+			for (size_t k = 0; k < n; k++) {
+				Complex dot(0., 0.);
+				for (size_t i = 0; i < m; i++)
+					dot += std::conj(q[k * m + i]) * data[i];
+				c[k] = dot;
+			}
+			for (size_t k = n; k-- > 0;) {
+				for (size_t j = k + 1; j < n; j++)
+					c[k] -= r[k * n + j] * c[j];
+				c[k] = std::abs(r[k * n + k]) > 0. ? c[k] / r[k * n + k] : Complex(0., 0.);
+			}
+
+			G4double* patch = &fCoefficients[((size_t)px * fPatchesY + py) * stride];
+			patch[0] = center[0];
+			patch[1] = center[1];
+			patch[2] = 1. / radius;
+			patch[3] = fz / m;
+			for (size_t k = 0; k < n; k++) {
+				patch[4 + 2 * k] = c[k].real();
+				patch[5 + 2 * k] = c[k].imag();
+			}
+		}
+	}
+
+	// Residual of the series as the kernel will evaluate it
+	HGMEFieldTable series(table);
+	Apply(&series);
+	fMaxResidual = 0.;
+	fRmsResidual = 0.;
+	fMaxField = 0.;
+	G4double position[3], reference[3], field[3];
+	for (G4int ix = 0; ix < table.GetNX(); ix++) {
+		for (G4int iy = 0; iy < table.GetNY(); iy++) {
+			table.GetNodePosition(ix, iy, 0, position);
+			table.GetNode(ix, iy, 0, reference);
+			series.Evaluate(position, field);
+			G4double d2 = 0., f2 = 0.;
+			for (G4int c = 0; c < 3; c++) {
+				d2 += (field[c] - reference[c]) * (field[c] - reference[c]);
+				f2 += reference[c] * reference[c];
+			}
+			fMaxResidual = std::max(fMaxResidual, std::sqrt(d2));
+			fMaxField = std::max(fMaxField, std::sqrt(f2));
+			fRmsResidual += d2;
+		}
+	}
+	fRmsResidual = std::sqrt(fRmsResidual / ((G4double)table.GetNX() * table.GetNY()));
+	return true;
+}
+
+void HGMEFieldSeriesFitter::Apply(HGMEFieldTable* table) const {
+	table->SetSeries(fOrder, fPatchesX, fPatchesY, fCoefficients);
+}
@@ -0,0 +1,73 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldSeriesFitter_hh
+#define HGMEFieldSeriesFitter_hh
+
+#include "HGMEFieldTable.hh"
+
+#include <vector>
+
+// Least squares fit of a Z-invariant table to truncated multipole series.
+//
+// In a source free region a field that does not depend on z has constant Fz
+// and F_y + i F_x analytic in x + i y, so it is a power series in x + i y.
+// The x-y extent of the table is cut into patches; each is fitted on its own
+// nodes with the series about its centre, scaled by its half diagonal.
+class HGMEFieldSeriesFitter
+{
+public:
+	HGMEFieldSeriesFitter(G4int order, G4int patchesX, G4int patchesY);
+	~HGMEFieldSeriesFitter();
+
+	// Fits the table, which must have nz = 1 and at least two nodes along x
+	// and y, and measures the residual at every node. Returns false if some
+	// patch has fewer nodes than coefficients.
+	G4bool Fit(const HGMEFieldTable& table);
+
+	// Replaces the nodes of the table by the fitted series
+	void Apply(HGMEFieldTable* table) const;
+
+	// Largest and RMS |F_series - F_node| over the nodes, and largest |F|
+	G4double GetMaxResidual() const { return fMaxResidual; }
+	G4double GetRmsResidual() const { return fRmsResidual; }
+	G4double GetMaxField() const { return fMaxField; }
+	size_t GetNumberOfCoefficients() const { return fCoefficients.size(); }
+
+private:
+	G4int fOrder;
+	G4int fPatchesX;
+	G4int fPatchesY;
+	std::vector<G4double> fCoefficients;
+	G4double fMaxResidual;
+	G4double fRmsResidual;
+	G4double fMaxField;
+};
+
+#endif
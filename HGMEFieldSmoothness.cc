@@ -0,0 +1,177 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldSmoothness.hh"
+#include "HGMEFieldTable.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+HGMEFieldSmoothness::HGMEFieldSmoothness(const HGMEFieldTable& table, G4int block):
+fBlock(std::max(1, block)), fMaxField(0.), fMaxGradient(0.) {
+	fN[0] = table.GetNX();
+	fN[1] = table.GetNY();
+	fN[2] = table.GetNZ();
+	const G4double min[3] = {table.GetMinX(), table.GetMinY(), table.GetMinZ()};
+	const G4double max[3] = {table.GetMaxX(), table.GetMaxY(), table.GetMaxZ()};
+	G4int cells[3];
+	G4double spacing[3];
+	for (G4int axis = 0; axis < 3; axis++) {
+		fMin[axis] = min[axis];
+		fMax[axis] = max[axis];
+		fFirst[axis] = table.GetFirst(axis);
+		cells[axis] = std::max(1, fN[axis] - 1);
+		spacing[axis] = fN[axis] > 1 ? (table.GetLast(axis) - fFirst[axis]) / (fN[axis] - 1) : 0.;
+		fInverseSpacing[axis] = spacing[axis] != 0. ? 1. / spacing[axis] : 0.;
+		fBlocks[axis] = (cells[axis] + fBlock - 1) / fBlock;
+	}
+	const size_t nBlocks = (size_t)fBlocks[0] * fBlocks[1] * fBlocks[2];
+	fField.assign(nBlocks, 0.f);
+	fGradient.assign(nBlocks, 0.f);
+
+	// For node tables, the gradient of the trilinear interpolant is largest
+	// on the cell edges, where it is the difference of the two nodes. Series
+	// tables give their own gradient at the nodes.
+	const G4bool series = table.GetSeriesOrder() > 0;
+	const G4bool axisymmetric = table.GetGeometry() == HGMEFieldTable::kAxisymmetric;
+	for (G4int cx = 0; cx < cells[0]; cx++) {
+		for (G4int cy = 0; cy < cells[1]; cy++) {
+			for (G4int cz = 0; cz < cells[2]; cz++) {
+				// Corners of the cell, bits x, y, z from the highest; invariant
+				// axes repeat the single node
+				const G4int cell[3] = {cx, cy, cz};
+				G4double nodes[8][3];
+				G4double field = 0., gradient = 0.;
+				for (G4int k = 0; k < 8; k++) {
+					G4int index[3];
+					for (G4int axis = 0; axis < 3; axis++)
+						index[axis] = std::min(fN[axis] - 1, cell[axis] + ((k >> (2 - axis)) & 1));
+					if (series) {
+						G4double position[3], derivatives[9], norm = 0.;
+						table.GetNodePosition(index[0], index[1], index[2], position);
+						table.EvaluateGradient(position, nodes[k], derivatives);
+						for (G4int d = 0; d < 9; d++)
+							norm += derivatives[d] * derivatives[d];
+						gradient = std::max(gradient, std::sqrt(norm));
+					} else {
+						table.GetNode(index[0], index[1], index[2], nodes[k]);
+					}
+					field = std::max(field, std::sqrt(nodes[k][0] * nodes[k][0] + nodes[k][1] * nodes[k][1] + nodes[k][2] * nodes[k][2]));
+				}
+
+				if (!series) {
+					// Largest derivative of each component along each axis, over
+					// the four edges of the cell along that axis
+					G4double sum = 0.;
+					for (G4int axis = 0; axis < 3; axis++) {
+						const G4int bit = 4 >> axis;
+						for (G4int c = 0; c < 3; c++) {
+							G4double derivative = 0.;
+							for (G4int k = 0; k < 8; k++)
+								if (!(k & bit))
+									derivative = std::max(derivative, std::fabs(nodes[k | bit][c] - nodes[k][c]));
+							derivative *= std::fabs(fInverseSpacing[axis]);
+							sum += derivative * derivative;
+						}
+					}
+
+					// Turning the radial and azimuthal components with the point
+					// adds F_r / r and F_phi / r off the axis of (r, z) grids
+					if (axisymmetric) {
+						G4double turning = 0.;
+						for (G4int k = 0; k < 8; k++) {
+							const G4int ix = std::min(fN[0] - 1, cx + ((k >> 2) & 1));
+							const G4double r = std::fabs(fFirst[0] + ix / fInverseSpacing[0]);
+							if (r > 0.)
+								turning = std::max(turning, (nodes[k][0] * nodes[k][0] + nodes[k][1] * nodes[k][1]) / (r * r));
+						}
+						sum += turning;
+					}
+					gradient = std::sqrt(sum);
+				}
+
+				const size_t b = ((size_t)(cx / fBlock) * fBlocks[1] + cy / fBlock) * fBlocks[2] + cz / fBlock;
+				fField[b] = std::max(fField[b], (float)field);
+				fGradient[b] = std::max(fGradient[b], (float)gradient);
+				fMaxField = std::max(fMaxField, field);
+				fMaxGradient = std::max(fMaxGradient, gradient);
+			}
+		}
+	}
+
+	Dilate(fField);
+	Dilate(fGradient);
+}
+
+HGMEFieldSmoothness::~HGMEFieldSmoothness() {;}
+
+void HGMEFieldSmoothness::Dilate(std::vector<float>& values) const {
+	// Maximum over the neighbours, one axis at a time
+	const size_t stride[3] = {(size_t)fBlocks[1] * fBlocks[2], (size_t)fBlocks[2], 1};
+	for (G4int axis = 0; axis < 3; axis++) {
+		if (fBlocks[axis] == 1)
+			continue;
+		std::vector<float> source(values);
+		for (size_t b = 0; b < values.size(); b++) {
+			const G4int index = (G4int)(b / stride[axis] % fBlocks[axis]);
+			if (index > 0)
+				values[b] = std::max(values[b], source[b - stride[axis]]);
+			if (index + 1 < fBlocks[axis])
+				values[b] = std::max(values[b], source[b + stride[axis]]);
+		}
+	}
+}
+
+G4bool HGMEFieldSmoothness::Lookup(const G4double point[3], G4double& maxField, G4double& maxGradient) const {
+	if (point[0] < fMin[0] || point[0] > fMax[0] ||
+		point[1] < fMin[1] || point[1] > fMax[1] ||
+		point[2] < fMin[2] || point[2] > fMax[2]) {
+		maxField = 0.;
+		maxGradient = 0.;
+		return false;
+	}
+
+	G4int index[3];
+	for (G4int axis = 0; axis < 3; axis++) {
+		const G4int cell = (G4int)((point[axis] - fFirst[axis]) * fInverseSpacing[axis]);
+		index[axis] = std::min(fBlocks[axis] - 1, std::max(0, cell / fBlock));
+	}
+	const size_t b = ((size_t)index[0] * fBlocks[1] + index[1]) * fBlocks[2] + index[2];
+	maxField = fField[b];
+	maxGradient = fGradient[b];
+	return true;
+}
+
+G4double HGMEFieldSmoothness::GetStepLimit(const G4double point[3], G4double relativeChange) const {
+	G4double maxField, maxGradient;
+	if (!Lookup(point, maxField, maxGradient) || maxGradient <= 0.)
+		return DBL_MAX;
+	return relativeChange * maxField / maxGradient;
+}
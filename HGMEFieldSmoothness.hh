@@ -0,0 +1,89 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldSmoothness_hh
+#define HGMEFieldSmoothness_hh
+
+#include "G4Types.hh"
+
+#include <vector>
+
+class HGMEFieldTable;
+
+// Coarse table of how fast a field map varies: for blocks of block x block
+// x block cells, the largest field magnitude and the largest gradient norm
+// of the interpolated field. Each block also takes the values of its 26
+// neighbours, so a step shorter than a block that starts in it stays within
+// the region its values describe.
+//
+// The step over which the field changes by a fraction of its local maximum
+// follows directly, which lets a step limiter allow long steps where the
+// map is uniform and short ones only where it varies.
+class HGMEFieldSmoothness
+{
+public:
+	HGMEFieldSmoothness(const HGMEFieldTable& table, G4int block);
+	~HGMEFieldSmoothness();
+
+	// Values of the block holding a point of the table frame. Returns false
+	// outside the table.
+	G4bool Lookup(const G4double point[3], G4double& maxField, G4double& maxGradient) const;
+
+	// Length over which the field cannot change by more than relativeChange
+	// times its largest magnitude around the point; DBL_MAX where the field
+	// is uniform or outside the table
+	G4double GetStepLimit(const G4double point[3], G4double relativeChange) const;
+
+	G4int GetBlock() const { return fBlock; }
+	G4int GetNumberOfBlocks(G4int axis) const { return fBlocks[axis]; }
+	G4double GetMaxField() const { return fMaxField; }
+	G4double GetMaxGradient() const { return fMaxGradient; }
+	size_t GetMemorySize() const { return (fField.size() + fGradient.size()) * sizeof(float); }
+
+private:
+	void Dilate(std::vector<float>& values) const;
+
+	G4int fBlock;
+	G4int fBlocks[3];
+
+	// Node count, first node and cells per unit length along each axis,
+	// negative for tables read inverted; zero along invariant axes
+	G4int fN[3];
+	G4double fFirst[3];
+	G4double fInverseSpacing[3];
+	G4double fMin[3];
+	G4double fMax[3];
+
+	std::vector<float> fField;
+	std::vector<float> fGradient;
+	G4double fMaxField;
+	G4double fMaxGradient;
+};
+
+#endif
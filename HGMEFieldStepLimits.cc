@@ -0,0 +1,129 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMEFieldStepLimits.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4AutoLock.hh"
+#include "G4LogicalVolume.hh"
+#include "G4SystemOfUnits.hh"
+#include "G4Track.hh"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace {
+	G4Mutex stepLimitsMutex = G4MUTEX_INITIALIZER;
+
+	// Whether two sets of maps share their tables and placements, as those
+	// built by the worker threads of one run do
+	G4bool SameRegions(const HGMEFieldRegions& a, const HGMEFieldRegions& b) {
+		if (a.GetNumberOfRegions() != b.GetNumberOfRegions())
+			return false;
+		for (size_t r = 0; r < a.GetNumberOfRegions(); r++) {
+			if (&a.GetTable(r).GetStorage() != &b.GetTable(r).GetStorage())
+				return false;
+			for (G4int axis = 0; axis < 3; axis++)
+				if (a.GetOffset(r)[axis] != b.GetOffset(r)[axis])
+					return false;
+		}
+		return true;
+	}
+
+	G4bool SameMaps(const std::vector<HGMEFieldRegions>& a, const HGMEFieldRegions* b, G4int nMaps) {
+		if ((G4int)a.size() != nMaps)
+			return false;
+		for (G4int m = 0; m < nMaps; m++)
+			if (!SameRegions(a[m], b[m]))
+				return false;
+		return true;
+	}
+}
+
+HGMEFieldStepLimits::HGMEFieldStepLimits(const G4UserLimits& previous, const HGMEFieldRegions* maps, G4int nMaps,
+										 const G4AffineTransform& toWorld, G4double relativeChange, G4double minimumStep):
+G4UserLimits(previous), fMaps(maps, maps + nMaps), fToLocal(toWorld.Inverse()), fRelativeChange(relativeChange), fMinimumStep(minimumStep) {
+}
+
+HGMEFieldStepLimits::~HGMEFieldStepLimits() {;}
+
+G4double HGMEFieldStepLimits::GetMaxAllowedStep(const G4Track& track) {
+	const G4ThreeVector localPoint = fToLocal.TransformPoint(track.GetPosition());
+	const G4double local[3] = {localPoint.x(), localPoint.y(), localPoint.z()};
+	G4double step = DBL_MAX;
+	for (size_t m = 0; m < fMaps.size(); m++)
+		step = std::min(step, fMaps[m].GetStepLimit(local, fRelativeChange));
+	// The minimum only applies to the mapped limit, never to the one taken over
+	return std::min(fMaxStep, std::max(fMinimumStep, step));
+}
+
+void HGMEFieldStepLimits::Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+									const HGMEFieldRegions* maps, G4int nMaps, const G4AffineTransform& toWorld) {
+	G4String name = component->GetFullParmName("FieldStepLimiter");
+	if (!pM->ParameterExists(name) || !pM->GetBooleanParameter(name))
+		return;
+
+	G4double relativeChange = 0.01;
+	name = component->GetFullParmName("FieldStepLimitRelativeChange");
+	if (pM->ParameterExists(name))
+		relativeChange = pM->GetUnitlessParameter(name);
+	if (relativeChange <= 0.) {
+		G4cerr << "" << G4endl;
+		G4cerr << "Topas is exiting due to a serious error." << G4endl;
+		G4cerr << "The parameter: " << name << G4endl;
+		G4cerr << "must be positive." << G4endl;
+		pM->AbortSession(1);
+	}
+
+	G4double minimumStep = 0.01 * mm;
+	name = component->GetFullParmName("FieldStepLimitMinimum");
+	if (pM->ParameterExists(name))
+		minimumStep = pM->GetDoubleParameter(name, "Length");
+
+	// The first thread to build its field sets the limits, the others find
+	// them. They are only changed when a new run brings other maps or values.
+	G4AutoLock lock(&stepLimitsMutex);
+	G4LogicalVolume* envelope = component->GetEnvelopeLogicalVolume();
+	G4UserLimits* current = envelope->GetUserLimits();
+	HGMEFieldStepLimits* limits = dynamic_cast<HGMEFieldStepLimits*>(current);
+	if (!limits) {
+		// Takes over the values of any limits already set, which it replaces
+		envelope->SetUserLimits(new HGMEFieldStepLimits(current ? *current : G4UserLimits(), maps, nMaps, toWorld,
+														relativeChange, minimumStep));
+		delete current;
+	} else if (!SameMaps(limits->fMaps, maps, nMaps) || limits->fToLocal != toWorld.Inverse() ||
+			   limits->fRelativeChange != relativeChange || limits->fMinimumStep != minimumStep) {
+		limits->fMaps.assign(maps, maps + nMaps);
+		limits->fToLocal = toWorld.Inverse();
+		limits->fRelativeChange = relativeChange;
+		limits->fMinimumStep = minimumStep;
+	}
+}
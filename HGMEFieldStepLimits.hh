@@ -0,0 +1,80 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldStepLimits_hh
+#define HGMEFieldStepLimits_hh
+
+#include "HGMEFieldRegions.hh"
+
+#include "G4AffineTransform.hh"
+#include "G4UserLimits.hh"
+
+#include <vector>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+
+// User limits of the envelope of a mapped-field component whose maximum
+// step follows the smoothness tables of its maps: long where the field is
+// uniform, short where it varies, so the chord finder starts from steps it
+// can accept. With several maps, such as the magnetic and electric maps of a
+// combined field, the shortest step wins. Geant4 applies them through the G4StepLimiter process, which
+// the physics list must include.
+//
+// Limits the envelope already had, such as those of MaxStepSize, are taken
+// over: their maximum step still caps the mapped one, and their track length,
+// time, kinetic energy and range cuts are kept. Geant4 does not pass user
+// limits on to daughter volumes, so steps there are not limited by the maps
+// although the field reaches them.
+//
+// Limits belong to the logical volume, which all worker threads share, so
+// they hold their own copy of the maps and are only updated between runs.
+class HGMEFieldStepLimits : public G4UserLimits
+{
+public:
+	HGMEFieldStepLimits(const G4UserLimits& previous, const HGMEFieldRegions* maps, G4int nMaps,
+						const G4AffineTransform& toWorld, G4double relativeChange, G4double minimumStep);
+	~HGMEFieldStepLimits();
+
+	G4double GetMaxAllowedStep(const G4Track& track);
+
+	// Sets or updates the limits of the envelope of a component when
+	// FieldStepLimiter is set: FieldStepLimitRelativeChange (default 0.01) and
+	// FieldStepLimitMinimum (default 0.01 mm)
+	static void Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+						  const HGMEFieldRegions* maps, G4int nMaps, const G4AffineTransform& toWorld);
+
+private:
+	std::vector<HGMEFieldRegions> fMaps;
+	G4AffineTransform fToLocal;
+	G4double fRelativeChange;
+	G4double fMinimumStep;
+};
+
+#endif
@@ -0,0 +1,448 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldStorage.hh"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace {
+	const size_t kHugePageSize = 2 * 1024 * 1024;
+
+	size_t RoundUp(size_t size, size_t multiple) {
+		return (size + multiple - 1) / multiple * multiple;
+	}
+
+	// First page of a shared segment, the data follows it
+	struct SegmentHeader {
+		char magic[8];
+		uint64_t size;
+		uint32_t complete;
+	};
+
+	const char segmentMagic[8] = {'H','G','M','E','S','H','M','1'};
+
+	// Named POSIX shared memory segment, or -1
+	int OpenSegment(const G4String& name, int flags) {
+		return shm_open(("/" + name).c_str(), flags, 0644);
+	}
+
+#ifdef __linux__
+	// NUMA node of a CPU, from the nodeN link in its sysfs directory
+	G4int NodeOfCPU(G4int cpu) {
+		std::ostringstream path;
+		path << "/sys/devices/system/cpu/cpu" << cpu;
+		DIR* directory = opendir(path.str().c_str());
+		if (!directory)
+			return -1;
+		G4int node = -1;
+		while (dirent* entry = readdir(directory)) {
+			G4String name = entry->d_name;
+			if (name.size() > 4 && name.compare(0, 4, "node") == 0 && name.find_first_not_of("0123456789", 4) == std::string::npos) {
+				node = atoi(name.c_str() + 4);
+				break;
+			}
+		}
+		closedir(directory);
+		return node;
+	}
+#endif
+}
+
+HGMEFieldStorage::HGMEFieldStorage():
+fData(0), fSize(0), fMapping(0), fMappingSize(0),
+fRequestedHugePages(kNoHugePages), fHugePages(kNoHugePages), fNode(-1), fUsers(-1) {
+}
+
+HGMEFieldStorage::~HGMEFieldStorage() {
+	Release();
+}
+
+void HGMEFieldStorage::Release() {
+	if (fMapping)
+		munmap(fMapping, fMappingSize);
+	if (fUsers >= 0)
+		ReleaseShared();
+	fData = 0;
+	fSize = 0;
+	fMapping = 0;
+	fMappingSize = 0;
+	fMappedFile = "";
+}
+
+void HGMEFieldStorage::Allocate(size_t size, HugePages hugePages, G4int node) {
+	Release();
+	fSize = size;
+	fRequestedHugePages = hugePages;
+	fHugePages = kNoHugePages;
+	fNode = -1;
+	if (size == 0)
+		return;
+
+#ifdef __linux__
+	if (hugePages == kExplicitHugePages) {
+		fMappingSize = RoundUp(size, kHugePageSize);
+		fMapping = mmap(0, fMappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (fMapping == MAP_FAILED) {
+			fMapping = 0;
+			hugePages = kTransparentHugePages;
+		} else {
+			fHugePages = kExplicitHugePages;
+			fData = fMapping;
+		}
+	}
+
+	if (!fMapping && hugePages == kTransparentHugePages) {
+		// Over-allocated so that the table starts on a huge page boundary
+		fMappingSize = RoundUp(size, kHugePageSize) + kHugePageSize;
+		fMapping = mmap(0, fMappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fMapping == MAP_FAILED) {
+			fMapping = 0;
+		} else {
+			fData = reinterpret_cast<void*>(RoundUp(reinterpret_cast<size_t>(fMapping), kHugePageSize));
+			if (madvise(fData, RoundUp(size, kHugePageSize), MADV_HUGEPAGE) == 0)
+				fHugePages = kTransparentHugePages;
+		}
+	}
+#endif
+
+	if (!fMapping) {
+		fMappingSize = RoundUp(size, sysconf(_SC_PAGESIZE));
+		fMapping = mmap(0, fMappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fMapping == MAP_FAILED)
+			throw std::bad_alloc();
+		fData = fMapping;
+	}
+
+#ifdef __linux__
+	// Bound before the first touch, so every page is placed on the node
+	if (node >= 0 && node < (G4int)(8 * sizeof(unsigned long))) {
+		unsigned long mask = 1UL << node;
+		if (syscall(SYS_mbind, fMapping, fMappingSize, MPOL_BIND, &mask, 8 * sizeof(mask), 0) == 0)
+			fNode = node;
+	}
+#else
+	(void)node;
+#endif
+}
+
+HGMEFieldStorage::SharedLock::SharedLock(const G4String& directory, const G4String& name) {
+	// The last user of a segment removes the lock file while holding it, so
+	// a lock obtained on a file that is no longer there is taken again on
+	// the file that replaced it
+	const G4String path = directory + "/" + name + ".lock";
+	while (true) {
+		fDescriptor = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+		if (fDescriptor < 0)
+			return;
+		int result;
+		while ((result = flock(fDescriptor, LOCK_EX)) != 0 && errno == EINTR);
+		struct stat held, current;
+		if (result == 0 && fstat(fDescriptor, &held) == 0 && stat(path.c_str(), &current) == 0 &&
+			held.st_dev == current.st_dev && held.st_ino == current.st_ino)
+			return;
+		close(fDescriptor);
+		fDescriptor = -1;
+		if (result != 0)
+			return;
+	}
+}
+
+HGMEFieldStorage::SharedLock::~SharedLock() {
+	// Closing the file drops the lock
+	if (fDescriptor >= 0)
+		close(fDescriptor);
+}
+
+G4bool HGMEFieldStorage::AttachUsers(const G4String& directory, const G4String& name) {
+	fUsers = open((directory + "/" + name + ".users").c_str(), O_RDWR | O_CREAT, 0600);
+	if (fUsers < 0)
+		return false;
+	while (flock(fUsers, LOCK_SH) != 0 && errno == EINTR);
+	fSharedDirectory = directory;
+	fSharedName = name;
+	return true;
+}
+
+void HGMEFieldStorage::ReleaseShared() {
+	SharedLock lock(fSharedDirectory, fSharedName);
+
+	// Only the last user gets the exclusive lock. Without the lock another
+	// process may be attaching, the files are left for the next release.
+	if (lock.IsLocked() && flock(fUsers, LOCK_EX | LOCK_NB) == 0) {
+		const G4String path = fSharedDirectory + "/" + fSharedName;
+		shm_unlink(("/" + fSharedName).c_str());
+		unlink(path.c_str());
+		unlink((path + ".users").c_str());
+		unlink((path + ".lock").c_str());
+	}
+	close(fUsers);
+	fUsers = -1;
+	fSharedFile = "";
+}
+
+G4bool HGMEFieldStorage::OpenShared(const G4String& directory, const G4String& name) {
+	Release();
+
+	G4String file;
+	int descriptor = OpenSegment(name, O_RDONLY);
+	if (descriptor < 0) {
+		file = directory + "/" + name;
+		descriptor = open(file.c_str(), O_RDONLY);
+	}
+	if (descriptor < 0)
+		return false;
+
+	// Segments left incomplete by a crashed creator are not used
+	struct stat status;
+	SegmentHeader header;
+	const size_t pageSize = sysconf(_SC_PAGESIZE);
+	if (fstat(descriptor, &status) != 0 || (size_t)status.st_size < pageSize ||
+		pread(descriptor, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+		std::memcmp(header.magic, segmentMagic, sizeof(segmentMagic)) != 0 || !header.complete ||
+		pageSize + header.size > (size_t)status.st_size) {
+		close(descriptor);
+		return false;
+	}
+
+	void* mapping = mmap(0, pageSize + header.size, PROT_READ, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (mapping == MAP_FAILED)
+		return false;
+	if (!AttachUsers(directory, name)) {
+		munmap(mapping, pageSize + header.size);
+		return false;
+	}
+
+	fMapping = mapping;
+	fMappingSize = pageSize + header.size;
+	fData = static_cast<char*>(mapping) + pageSize;
+	fSize = header.size;
+	fSharedFile = file;
+	return true;
+}
+
+void HGMEFieldStorage::CreateShared(const G4String& directory, const G4String& name, size_t size) {
+	Release();
+	fRequestedHugePages = kNoHugePages;
+	fHugePages = kNoHugePages;
+	fNode = -1;
+
+	// A segment found here is incomplete or unused, it is replaced
+	G4String file;
+	shm_unlink(("/" + name).c_str());
+	int descriptor = OpenSegment(name, O_RDWR | O_CREAT | O_EXCL);
+	if (descriptor < 0) {
+		file = directory + "/" + name;
+		unlink(file.c_str());
+		descriptor = open(file.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+
+	const size_t pageSize = sysconf(_SC_PAGESIZE);
+	void* mapping = MAP_FAILED;
+	if (descriptor >= 0 && ftruncate(descriptor, pageSize + size) == 0)
+		mapping = mmap(0, pageSize + size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	if (descriptor >= 0)
+		close(descriptor);
+	if (mapping == MAP_FAILED || !AttachUsers(directory, name)) {
+		if (mapping != MAP_FAILED)
+			munmap(mapping, pageSize + size);
+		if (file != "")
+			unlink(file.c_str());
+		else
+			shm_unlink(("/" + name).c_str());
+		// No process uses the name, the lock file held by the caller goes too
+		unlink((directory + "/" + name + ".lock").c_str());
+		throw std::bad_alloc();
+	}
+
+	fMapping = mapping;
+	fMappingSize = pageSize + size;
+	fData = static_cast<char*>(mapping) + pageSize;
+	fSize = size;
+	fSharedFile = file;
+}
+
+void HGMEFieldStorage::PublishShared() {
+	SegmentHeader* header = static_cast<SegmentHeader*>(fMapping);
+	std::memcpy(header->magic, segmentMagic, sizeof(segmentMagic));
+	header->size = fSize;
+	header->complete = 1;
+	mprotect(fMapping, fMappingSize, PROT_READ);
+}
+
+G4bool HGMEFieldStorage::MapFile(const G4String& fileName) {
+	Release();
+	fRequestedHugePages = kNoHugePages;
+	fHugePages = kNoHugePages;
+	fNode = -1;
+
+	int descriptor = open(fileName.c_str(), O_RDONLY);
+	if (descriptor < 0)
+		return false;
+	struct stat status;
+	void* mapping = MAP_FAILED;
+	if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+		mapping = mmap(0, status.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	// Read ahead while the table is being set up
+	madvise(mapping, status.st_size, MADV_WILLNEED);
+	fMapping = mapping;
+	fMappingSize = status.st_size;
+	fData = mapping;
+	fSize = status.st_size;
+	fMappedFile = fileName;
+	return true;
+}
+
+G4String HGMEFieldStorage::Describe() const {
+	std::ostringstream description;
+	if (!fData)
+		return "empty";
+	if (fUsers >= 0)
+		description << "shared with the processes of the node through "
+		<< (fSharedFile != "" ? fSharedFile : G4String("/dev/shm/" + fSharedName)) << ", ";
+	if (fMappedFile != "")
+		description << "mapped from " << fMappedFile << ", ";
+	if (fHugePages != fRequestedHugePages)
+		description << (fRequestedHugePages == kExplicitHugePages ? "explicit" : "transparent")
+		<< " huge pages unavailable, ";
+
+#ifdef __linux__
+	// Find the mapping in the smaps of the process
+	std::ifstream smaps("/proc/self/smaps");
+	const size_t address = reinterpret_cast<size_t>(fData);
+	G4String line;
+	G4bool found = false;
+	G4int pageSize = 0, hugeSize = 0, size = 0;
+	while (getline(smaps, line)) {
+		size_t dash = line.find('-');
+		size_t space = line.find(' ');
+		if (dash != std::string::npos && space != std::string::npos && dash < space &&
+			line.find_first_not_of("0123456789abcdef") == dash) {
+			if (found) break;
+			size_t start = std::stoull(line.substr(0, dash), 0, 16);
+			size_t end = std::stoull(line.substr(dash + 1, space - dash - 1), 0, 16);
+			found = address >= start && address < end;
+		} else if (found) {
+			std::istringstream fields(line);
+			G4String key;
+			G4int value = 0;
+			fields >> key >> value;
+			if (key == "Size:") size = value;
+			else if (key == "KernelPageSize:") pageSize = value;
+			else if (key == "AnonHugePages:") hugeSize = value;
+		}
+	}
+	if (found) {
+		description << pageSize << " kB pages";
+		if (fHugePages != kExplicitHugePages && fUsers < 0 && fMappedFile == "")
+			description << ", " << hugeSize << " of " << size << " kB in transparent huge pages";
+	}
+
+	int node = -1;
+	if (syscall(SYS_get_mempolicy, &node, 0, 0, fData, MPOL_F_NODE | MPOL_F_ADDR) == 0)
+		description << ", first page on NUMA node " << node;
+	if (fNode >= 0)
+		description << " (bound to node " << fNode << ")";
+#else
+	description << "system pages";
+#endif
+	return description.str();
+}
+
+G4int HGMEFieldStorage::GetNumberOfNodes() {
+#ifdef __linux__
+	// The online list reads like "0-1" or "0,2-3"
+	std::ifstream online("/sys/devices/system/node/online");
+	G4String list;
+	if (!(online >> list))
+		return -1;
+	G4int count = 0;
+	std::istringstream ranges(list);
+	G4String range;
+	while (getline(ranges, range, ',')) {
+		size_t dash = range.find('-');
+		if (dash == std::string::npos)
+			count++;
+		else
+			count += atoi(range.c_str() + dash + 1) - atoi(range.c_str()) + 1;
+	}
+	return count;
+#else
+	return -1;
+#endif
+}
+
+G4int HGMEFieldStorage::GetThreadNode() {
+#ifdef __linux__
+	cpu_set_t affinity;
+	if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0) {
+		G4int node = -1;
+		for (G4int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &affinity))
+				continue;
+			G4int cpuNode = NodeOfCPU(cpu);
+			if (node >= 0 && cpuNode != node) {
+				node = -1;
+				break;
+			}
+			node = cpuNode;
+		}
+		if (node >= 0)
+			return node;
+	}
+
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, 0) == 0)
+		return node;
+#endif
+	return -1;
+}
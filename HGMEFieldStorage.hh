@@ -0,0 +1,144 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldStorage_hh
+#define HGMEFieldStorage_hh
+
+#include "G4String.hh"
+#include "G4Types.hh"
+
+#include <stddef.h>
+
+// Page aligned, zero filled memory for the nodes of a field table.
+//
+// Random lookups into a large table miss the TLB on almost every query with
+// 4 kB pages, so the memory can be backed by transparent or explicit (2 MB)
+// huge pages. It can also be bound to a NUMA node, so that each socket reads
+// its own replica of a shared table instead of going through the
+// interconnect.
+//
+// Tables read by many processes of one node can live in a named POSIX
+// shared memory segment instead, created by the first process and mapped
+// read-only by the others. Every process attached to a segment holds a
+// shared lock on a users file next to the lock file; the last one to
+// release the segment removes it, with the users and lock files. The
+// kernel drops the locks of crashed processes, so their segments are still
+// removed. The lock and users files are only open to the owner, so the
+// processes sharing a segment must run as the same user.
+//
+// A file can also be mapped read-only, so tables stored in a binary format
+// the kernels read directly are used in place from the page cache.
+class HGMEFieldStorage
+{
+public:
+	enum HugePages { kNoHugePages, kTransparentHugePages, kExplicitHugePages };
+
+	HGMEFieldStorage();
+	~HGMEFieldStorage();
+
+	// Allocates size zeroed bytes. node >= 0 binds the pages to that NUMA
+	// node. Explicit huge pages fall back to transparent ones when the system
+	// has none reserved; GetHugePages tells what was obtained.
+	void Allocate(size_t size, HugePages hugePages, G4int node = -1);
+
+	// Serialises the creation and removal of a shared segment between the
+	// processes of the node, through a lock file in directory. IsLocked is
+	// false when the lock file cannot be created or locked, the segment must
+	// then not be touched.
+	class SharedLock {
+	public:
+		SharedLock(const G4String& directory, const G4String& name);
+		~SharedLock();
+		G4bool IsLocked() const { return fDescriptor >= 0; }
+	private:
+		int fDescriptor;
+	};
+
+	// Maps the complete segment of this name read-only, returning false if
+	// no process has published it. Must be called under a SharedLock.
+	G4bool OpenShared(const G4String& directory, const G4String& name);
+
+	// Creates the segment with size writable bytes, replacing an incomplete
+	// one. Falls back to a file in directory where POSIX shared memory is
+	// not available. Must be called under a SharedLock, followed by
+	// PublishShared once the data is written.
+	void CreateShared(const G4String& directory, const G4String& name, size_t size);
+
+	// Marks the created segment complete and makes it read-only
+	void PublishShared();
+
+	G4bool IsShared() const { return fUsers >= 0; }
+
+	// Maps the whole file read-only, returning false if it cannot be mapped
+	G4bool MapFile(const G4String& fileName);
+	G4bool IsMappedFile() const { return !fMappedFile.empty(); }
+
+	void* GetData() const { return fData; }
+	size_t GetSize() const { return fSize; }
+	HugePages GetHugePages() const { return fHugePages; }
+	G4int GetNode() const { return fNode; }
+
+	// Backing of the memory as reported by the kernel: page size, the part
+	// held in transparent huge pages and the NUMA node of the first page
+	G4String Describe() const;
+
+	// Number of NUMA nodes of the system, and the node a thread should use:
+	// the one holding all the CPUs of its affinity mask or, if the mask spans
+	// several nodes, the one it runs on. -1 where NUMA is not supported.
+	static G4int GetNumberOfNodes();
+	static G4int GetThreadNode();
+
+private:
+	HGMEFieldStorage(const HGMEFieldStorage&);
+	HGMEFieldStorage& operator=(const HGMEFieldStorage&);
+
+	void Release();
+	void ReleaseShared();
+	G4bool AttachUsers(const G4String& directory, const G4String& name);
+
+	void* fData;
+	size_t fSize;
+	void* fMapping;
+	size_t fMappingSize;
+	HugePages fRequestedHugePages;
+	HugePages fHugePages;
+	G4int fNode;
+
+	// Shared segment, with the descriptor of its users file (-1 when the
+	// memory is private) and the path of the file backing it in the fallback
+	G4String fSharedDirectory;
+	G4String fSharedName;
+	G4String fSharedFile;
+	int fUsers;
+
+	// File of a read-only mapping, empty otherwise
+	G4String fMappedFile;
+};
+
+#endif
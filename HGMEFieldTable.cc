@@ -0,0 +1,878 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMEFieldTable.hh"
+
+#include <cfloat>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+HGMEFieldTable::HGMEFieldTable():
+fMinX(0.), fMinY(0.), fMinZ(0.), fMaxX(0.), fMaxY(0.), fMaxZ(0.), fDX(0.), fDY(0.), fDZ(0.),
+fInvertX(false), fInvertY(false), fInvertZ(false), fNX(0), fNY(0), fNZ(0),
+fPrecision(kDouble), fInterpolation(kTrilinear), fKernel(&HGMEFieldTable::Outside),
+fGradientKernel(&HGMEFieldTable::OutsideGradient), fGeometry(kCartesian), fGridKernel(&HGMEFieldTable::Outside),
+fGridGradientKernel(&HGMEFieldTable::OutsideGradient), fScale(1.), fLayout(kRowMajor),
+fSeriesOrder(0), fPatchesX(0), fPatchesY(0), fInversePatchX(0.), fInversePatchY(0.),
+fHugePages(HGMEFieldStorage::kNoHugePages), fStorage(std::make_shared<HGMEFieldStorage>()), fData(0) {
+	std::fill(fStride, fStride + 3, 0);
+	SetScales();
+}
+
+HGMEFieldTable::~HGMEFieldTable() {;}
+
+namespace {
+	// Offsets along one axis of n nodes, grouped in tiles of edge nodes, for
+	// a storage where a step of one tile along this axis spans tileStride
+	// elements and a step of one node inside a tile spans nodeStride
+	void FillOffsets(std::vector<size_t>& offsets, G4int n, G4int edge, size_t tileStride, size_t nodeStride) {
+		offsets.resize(n + 1);
+		for (G4int i = 0; i < n; i++)
+			offsets[i] = (i / edge) * tileStride + (i % edge) * nodeStride;
+		offsets[n] = n > 0 ? offsets[n - 1] : 0;
+	}
+}
+
+void HGMEFieldTable::Allocate(G4int nx, G4int ny, G4int nz, Precision precision) {
+	const size_t size = SetDimensions(nx, ny, nz, precision);
+
+	// A new storage, copies sharing the old one keep it
+	fStorage = std::make_shared<HGMEFieldStorage>();
+	fStorage->Allocate(size, fHugePages);
+	fData = fStorage->GetData();
+
+	SelectKernel();
+}
+
+size_t HGMEFieldTable::SetDimensions(G4int nx, G4int ny, G4int nz, Precision precision) {
+	fNX = nx;
+	fNY = ny;
+	fNZ = nz;
+	fPrecision = precision;
+	fSeriesOrder = 0;
+	fScale = 1.;
+	SetScales();
+
+	if (fLayout == kPadded) {
+		// Axes of more than one node gain a halo node at each end
+		const G4int n[3] = {nx, ny, nz};
+		size_t size = 3;
+		for (G4int axis = 2; axis >= 0; axis--) {
+			fStride[axis] = n[axis] > 1 ? size : 0;
+			size *= n[axis] > 1 ? n[axis] + 2 : 1;
+		}
+		std::vector<size_t>* offsets[3] = {&fOffsetX, &fOffsetY, &fOffsetZ};
+		for (G4int axis = 0; axis < 3; axis++) {
+			offsets[axis]->resize(std::max(n[axis], 0) + 1);
+			for (G4int i = 0; i < n[axis]; i++)
+				(*offsets[axis])[i] = (i + 1) * fStride[axis];
+			(*offsets[axis])[std::max(n[axis], 0)] = n[axis] > 0 ? (*offsets[axis])[n[axis] - 1] : 0;
+		}
+		return size * (fPrecision == kDouble ? sizeof(double) : sizeof(float));
+	}
+
+	// Row-major order is the tiled order with single node tiles. Short axes
+	// are not split, a tile never holds more nodes than the axis.
+	const G4int tile = fLayout == kTiled ? 4 : 1;
+	const G4int edge[3] = {std::min(tile, std::max(nx, 1)), std::min(tile, std::max(ny, 1)), std::min(tile, std::max(nz, 1))};
+	const size_t tiles[3] = {(size_t)(nx + edge[0] - 1) / edge[0], (size_t)(ny + edge[1] - 1) / edge[1], (size_t)(nz + edge[2] - 1) / edge[2]};
+	const size_t tileSize = 3 * (size_t)edge[0] * edge[1] * edge[2];
+	FillOffsets(fOffsetZ, nz, edge[2], tileSize, 3);
+	FillOffsets(fOffsetY, ny, edge[1], tileSize * tiles[2], 3 * (size_t)edge[2]);
+	FillOffsets(fOffsetX, nx, edge[0], tileSize * tiles[2] * tiles[1], 3 * (size_t)edge[2] * edge[1]);
+	return tileSize * tiles[0] * tiles[1] * tiles[2] * (fPrecision == kDouble ? sizeof(double) : sizeof(float));
+}
+
+void HGMEFieldTable::SetLayout(Layout layout) {
+	if (layout == fLayout || fSeriesOrder > 0)
+		return;
+
+	HGMEFieldTable relaid(*this);
+	relaid.fLayout = layout;
+	relaid.Allocate(fNX, fNY, fNZ, fPrecision);
+	CopyNodes(relaid);
+	*this = relaid;
+}
+
+HGMEFieldTable HGMEFieldTable::Unscaled() const {
+	HGMEFieldTable unscaled(*this);
+	unscaled.Allocate(fNX, fNY, fNZ, fPrecision);
+	CopyNodes(unscaled);
+	return unscaled;
+}
+
+void HGMEFieldTable::CopyNodes(HGMEFieldTable& target) const {
+	G4double field[3];
+	for (G4int ix = 0; ix < fNX; ix++) {
+		for (G4int iy = 0; iy < fNY; iy++) {
+			for (G4int iz = 0; iz < fNZ; iz++) {
+				GetNode(ix, iy, iz, field);
+				target.SetNode(ix, iy, iz, field[0], field[1], field[2]);
+			}
+		}
+	}
+}
+
+void HGMEFieldTable::SetSeries(G4int order, G4int patchesX, G4int patchesY, const std::vector<G4double>& coefficients) {
+	fSeriesOrder = order;
+	fPatchesX = patchesX;
+	fPatchesY = patchesY;
+	fInversePatchX = patchesX / fDX;
+	fInversePatchY = patchesY / fDY;
+	fScale = 1.;
+
+	// The coefficients take the place of the nodes
+	fStorage = std::make_shared<HGMEFieldStorage>();
+	fStorage->Allocate(coefficients.size() * sizeof(G4double), fHugePages);
+	fData = fStorage->GetData();
+	std::memcpy(fData, coefficients.data(), coefficients.size() * sizeof(G4double));
+	SelectKernel();
+}
+
+HGMEFieldTable HGMEFieldTable::Replicate(G4int node) const {
+	HGMEFieldTable replica(*this);
+	replica.fStorage = std::make_shared<HGMEFieldStorage>();
+	replica.fStorage->Allocate(GetMemorySize(), fHugePages, node);
+	replica.fData = replica.fStorage->GetData();
+	if (GetMemorySize() > 0)
+		std::memcpy(replica.fData, fData, GetMemorySize());
+	replica.SelectKernel();
+	return replica;
+}
+
+void HGMEFieldTable::SetNode(G4int ix, G4int iy, G4int iz, G4double fx, G4double fy, G4double fz) {
+	if (fScale != 1.) {
+		fx /= fScale;
+		fy /= fScale;
+		fz /= fScale;
+	}
+	const G4double values[3] = {fx, fy, fz};
+	SetStored(NodeIndex(ix, iy, iz), values);
+	if (fLayout == kPadded)
+		FillHalo(ix, iy, iz);
+}
+
+void HGMEFieldTable::SetStored(size_t index, const G4double values[3]) {
+	for (G4int c = 0; c < 3; c++) {
+		if (fPrecision == kDouble)
+			static_cast<double*>(fData)[index + c] = values[c];
+		else
+			static_cast<float*>(fData)[index + c] = values[c];
+	}
+}
+
+void HGMEFieldTable::FillHalo(G4int ix, G4int iy, G4int iz) {
+	// Halo nodes are linear extrapolations of the two nodes next to them, so
+	// the halo cell continues the interpolant and its derivative across the
+	// edge. Storage positions along an axis are the node index plus one; a
+	// node is used by the halo at the near end if it is one of the first two
+	// nodes, by the one at the far end if it is one of the last two.
+	const G4int index[3] = {ix, iy, iz};
+	const G4int n[3] = {fNX, fNY, fNZ};
+	G4int positions[3][3];
+	G4int count[3];
+	for (G4int axis = 0; axis < 3; axis++) {
+		positions[axis][0] = index[axis] + 1;
+		count[axis] = 1;
+		if (n[axis] > 1 && index[axis] <= 1)
+			positions[axis][count[axis]++] = 0;
+		if (n[axis] > 1 && index[axis] >= n[axis] - 2)
+			positions[axis][count[axis]++] = n[axis] + 1;
+	}
+
+	for (G4int a = 0; a < count[0]; a++) {
+		for (G4int b = 0; b < count[1]; b++) {
+			for (G4int c = 0; c < count[2]; c++) {
+				if (a == 0 && b == 0 && c == 0)
+					continue;
+				const G4int position[3] = {positions[0][a], positions[1][b], positions[2][c]};
+
+				// Nodes and weights of the extrapolation along each axis
+				G4int nodes[3][2];
+				G4double weights[3][2];
+				G4int terms[3];
+				for (G4int axis = 0; axis < 3; axis++) {
+					if (position[axis] == 0) {
+						nodes[axis][0] = 0;
+						nodes[axis][1] = 1;
+					} else if (position[axis] == n[axis] + 1) {
+						nodes[axis][0] = n[axis] - 1;
+						nodes[axis][1] = n[axis] - 2;
+					} else {
+						nodes[axis][0] = position[axis] - 1;
+						weights[axis][0] = 1.;
+						terms[axis] = 1;
+						continue;
+					}
+					weights[axis][0] = 2.;
+					weights[axis][1] = -1.;
+					terms[axis] = 2;
+				}
+
+				G4double values[3] = {0., 0., 0.};
+				for (G4int i = 0; i < terms[0]; i++) {
+					for (G4int j = 0; j < terms[1]; j++) {
+						for (G4int k = 0; k < terms[2]; k++) {
+							const size_t node = NodeIndex(nodes[0][i], nodes[1][j], nodes[2][k]);
+							const G4double weight = weights[0][i] * weights[1][j] * weights[2][k];
+							for (G4int v = 0; v < 3; v++)
+								values[v] += weight * (fPrecision == kDouble ? Data<double>()[node + v] : Data<float>()[node + v]);
+						}
+					}
+				}
+				SetStored(position[0] * fStride[0] + position[1] * fStride[1] + position[2] * fStride[2], values);
+			}
+		}
+	}
+}
+
+void HGMEFieldTable::GetNode(G4int ix, G4int iy, G4int iz, G4double field[3]) const {
+	size_t index = NodeIndex(ix, iy, iz);
+	for (G4int c = 0; c < 3; c++)
+		field[c] = (fPrecision == kDouble ? Data<double>()[index + c] : Data<float>()[index + c]) * fScale;
+}
+
+void HGMEFieldTable::SetLimits(G4double firstX, G4double firstY, G4double firstZ,
+							   G4double lastX, G4double lastY, G4double lastZ) {
+	fMinX = firstX;
+	fMinY = firstY;
+	fMinZ = firstZ;
+	fMaxX = lastX;
+	fMaxY = lastY;
+	fMaxZ = lastZ;
+
+	fInvertX = fMaxX < fMinX;
+	fInvertY = fMaxY < fMinY;
+	fInvertZ = fMaxZ < fMinZ;
+	if (fInvertX) std::swap(fMaxX, fMinX);
+	if (fInvertY) std::swap(fMaxY, fMinY);
+	if (fInvertZ) std::swap(fMaxZ, fMinZ);
+
+	fDX = fMaxX - fMinX;
+	fDY = fMaxY - fMinY;
+	fDZ = fMaxZ - fMinZ;
+
+	// An axis with a single node is invariant, the table then covers all of it
+	if (fNX == 1) SetInvariant(fMinX, fMaxX, fDX, fInvertX);
+	if (fNY == 1) SetInvariant(fMinY, fMaxY, fDY, fInvertY);
+	if (fNZ == 1) SetInvariant(fMinZ, fMaxZ, fDZ, fInvertZ);
+	SetScales();
+}
+
+void HGMEFieldTable::SetScales() {
+	const G4int n[3] = {fNX, fNY, fNZ};
+	const G4double delta[3] = {fDX, fDY, fDZ};
+	const G4double min[3] = {fMinX, fMinY, fMinZ};
+	const G4double max[3] = {fMaxX, fMaxY, fMaxZ};
+	const G4bool invert[3] = {fInvertX, fInvertY, fInvertZ};
+	for (G4int axis = 0; axis < 3; axis++) {
+		const G4bool varies = n[axis] > 1 && delta[axis] > 0.;
+		fGradientScale[axis] = varies ? fScale * (invert[axis] ? 1 - n[axis] : n[axis] - 1) / delta[axis] : 0.;
+
+		// The first node is at position 1, after the halo. The direction of
+		// inverted axes is folded into the sign of the scale. Invariant axes
+		// map every point to position 1, which has a zero stride.
+		fIndexScale[axis] = varies ? (invert[axis] ? 1 - n[axis] : n[axis] - 1) / delta[axis] : 0.;
+		fIndexOffset[axis] = varies ? 1. - (invert[axis] ? max[axis] : min[axis]) * fIndexScale[axis] : 1.;
+	}
+}
+
+G4double HGMEFieldTable::GetFirst(G4int axis) const {
+	if (axis == 0) return fNX > 1 ? (fInvertX ? fMaxX : fMinX) : 0.;
+	if (axis == 1) return fNY > 1 ? (fInvertY ? fMaxY : fMinY) : 0.;
+	return fNZ > 1 ? (fInvertZ ? fMaxZ : fMinZ) : 0.;
+}
+
+G4double HGMEFieldTable::GetLast(G4int axis) const {
+	if (axis == 0) return fNX > 1 ? (fInvertX ? fMinX : fMaxX) : 0.;
+	if (axis == 1) return fNY > 1 ? (fInvertY ? fMinY : fMaxY) : 0.;
+	return fNZ > 1 ? (fInvertZ ? fMinZ : fMaxZ) : 0.;
+}
+
+void HGMEFieldTable::GetNodePosition(G4int ix, G4int iy, G4int iz, G4double position[3]) const {
+	const G4int index[3] = {ix, iy, iz};
+	const G4int n[3] = {fNX, fNY, fNZ};
+	for (G4int axis = 0; axis < 3; axis++)
+		position[axis] = n[axis] > 1 ?
+		GetFirst(axis) + (GetLast(axis) - GetFirst(axis)) * index[axis] / (n[axis] - 1) : 0.;
+}
+
+void HGMEFieldTable::SetInvariant(G4double& min, G4double& max, G4double& delta, G4bool& invert) {
+	min = -DBL_MAX;
+	max = DBL_MAX;
+	delta = 0.;
+	invert = false;
+}
+
+namespace {
+	const char binaryMagic[8] = {'H','G','M','E','F','T','0','2'};
+
+	// Nodes of an image start on their own page
+	const size_t imageHeaderSize = 4096;
+}
+
+void HGMEFieldTable::GetHeader(G4int header[8], G4double limits[6]) const {
+	const G4int values[8] = {fNX, fNY, fNZ, fPrecision, fInvertX, fInvertY, fInvertZ, fLayout};
+	const G4double bounds[6] = {fMinX, fMinY, fMinZ, fMaxX, fMaxY, fMaxZ};
+	std::copy(values, values + 8, header);
+	std::copy(bounds, bounds + 6, limits);
+}
+
+void HGMEFieldTable::SetHeader(const G4int header[8], const G4double limits[6]) {
+	fInvertX = header[4];
+	fInvertY = header[5];
+	fInvertZ = header[6];
+	fMinX = limits[0];
+	fMinY = limits[1];
+	fMinZ = limits[2];
+	fMaxX = limits[3];
+	fMaxY = limits[4];
+	fMaxZ = limits[5];
+	fDX = fNX > 1 ? fMaxX - fMinX : 0.;
+	fDY = fNY > 1 ? fMaxY - fMinY : 0.;
+	fDZ = fNZ > 1 ? fMaxZ - fMinZ : 0.;
+	SetScales();
+}
+
+void HGMEFieldTable::WriteBinary(std::ostream& output) const {
+	// Only node tables have a binary image
+	if (fSeriesOrder > 0) {
+		output.setstate(std::ios::failbit);
+		return;
+	}
+	if (fScale != 1.) {
+		Unscaled().WriteBinary(output);
+		return;
+	}
+
+	output.write(binaryMagic, sizeof(binaryMagic));
+
+	G4int header[8];
+	G4double limits[6];
+	GetHeader(header, limits);
+	output.write(reinterpret_cast<const char*>(header), sizeof(header));
+	output.write(reinterpret_cast<const char*>(limits), sizeof(limits));
+
+	output.write(static_cast<const char*>(fData), GetMemorySize());
+}
+
+G4bool HGMEFieldTable::ReadBinary(std::istream& input) {
+	char magic[8];
+	input.read(magic, sizeof(magic));
+	if (!input || std::memcmp(magic, binaryMagic, sizeof(magic)) != 0)
+		return false;
+
+	G4int header[8];
+	G4double limits[6];
+	input.read(reinterpret_cast<char*>(header), sizeof(header));
+	input.read(reinterpret_cast<char*>(limits), sizeof(limits));
+	if (!input || header[0] < 1 || header[1] < 1 || header[2] < 1)
+		return false;
+
+	if (header[7] != kRowMajor && header[7] != kTiled && header[7] != kPadded)
+		return false;
+	fLayout = static_cast<Layout>(header[7]);
+	Allocate(header[0], header[1], header[2], header[3] == kFloat ? kFloat : kDouble);
+	input.read(static_cast<char*>(fData), GetMemorySize());
+	if (!input) {
+		Allocate(0, 0, 0, fPrecision);
+		return false;
+	}
+
+	SetHeader(header, limits);
+	SelectKernel();
+	return true;
+}
+
+size_t HGMEFieldTable::GetImageSize() const {
+	return imageHeaderSize + GetMemorySize();
+}
+
+void HGMEFieldTable::WriteImage(void* image) const {
+	if (fScale != 1.) {
+		Unscaled().WriteImage(image);
+		return;
+	}
+
+	char* bytes = static_cast<char*>(image);
+	G4int header[8];
+	G4double limits[6];
+	GetHeader(header, limits);
+	std::memcpy(bytes, binaryMagic, sizeof(binaryMagic));
+	std::memcpy(bytes + sizeof(binaryMagic), header, sizeof(header));
+	std::memcpy(bytes + sizeof(binaryMagic) + sizeof(header), limits, sizeof(limits));
+	std::memcpy(bytes + imageHeaderSize, fData, GetMemorySize());
+}
+
+G4bool HGMEFieldTable::MapImage(const std::shared_ptr<HGMEFieldStorage>& storage) {
+	const char* bytes = static_cast<const char*>(storage->GetData());
+	G4int header[8];
+	G4double limits[6];
+	if (storage->GetSize() < imageHeaderSize || std::memcmp(bytes, binaryMagic, sizeof(binaryMagic)) != 0)
+		return false;
+	std::memcpy(header, bytes + sizeof(binaryMagic), sizeof(header));
+	std::memcpy(limits, bytes + sizeof(binaryMagic) + sizeof(header), sizeof(limits));
+	if (header[0] < 1 || header[1] < 1 || header[2] < 1)
+		return false;
+
+	if (header[7] != kRowMajor && header[7] != kTiled && header[7] != kPadded)
+		return false;
+	fLayout = static_cast<Layout>(header[7]);
+	if (imageHeaderSize + SetDimensions(header[0], header[1], header[2], header[3] == kFloat ? kFloat : kDouble) > storage->GetSize())
+		return false;
+	fStorage = storage;
+	fData = const_cast<char*>(bytes) + imageHeaderSize;
+	SetHeader(header, limits);
+	SelectKernel();
+	return true;
+}
+
+G4bool HGMEFieldTable::MapNodes(const std::shared_ptr<HGMEFieldStorage>& storage, size_t offset,
+								G4int nx, G4int ny, G4int nz, Precision precision, G4double scale) {
+	if (nx < 1 || ny < 1 || nz < 1)
+		return false;
+	fLayout = kRowMajor;
+	if (offset + SetDimensions(nx, ny, nz, precision) > storage->GetSize())
+		return false;
+	fStorage = storage;
+	fData = static_cast<char*>(storage->GetData()) + offset;
+	fScale = scale;
+	SetScales();
+	SelectKernel();
+	return true;
+}
+
+G4bool HGMEFieldTable::SetGeometry(Geometry geometry) {
+	if (geometry == kAxisymmetric && (fNY != 1 || fNX < 2 || fMinX < 0. || fSeriesOrder > 0))
+		return false;
+	fGeometry = geometry;
+	SelectKernel();
+	return true;
+}
+
+G4double HGMEFieldTable::ClearAxis() {
+	// The node at r = 0, the first or the last one along x
+	const G4int axis = fInvertX ? fNX - 1 : 0;
+	if (fNX < 2 || fNY != 1 || fMinX != 0.)
+		return 0.;
+
+	G4double largest = 0.;
+	G4double field[3];
+	for (G4int iz = 0; iz < fNZ; iz++) {
+		GetNode(axis, 0, iz, field);
+		largest = std::max(largest, std::max(std::fabs(field[0]), std::fabs(field[1])));
+	}
+	if (largest == 0.)
+		return 0.;
+
+	if (fStorage->IsShared() || fStorage->IsMappedFile() || fScale != 1.)
+		*this = Unscaled();
+	for (G4int iz = 0; iz < fNZ; iz++) {
+		GetNode(axis, 0, iz, field);
+		SetNode(axis, 0, iz, 0., 0., field[2]);
+	}
+	return largest;
+}
+
+void HGMEFieldTable::GetBounds(G4double min[3], G4double max[3]) const {
+	const G4double low[3] = {fMinX, fMinY, fMinZ};
+	const G4double high[3] = {fMaxX, fMaxY, fMaxZ};
+	std::copy(low, low + 3, min);
+	std::copy(high, high + 3, max);
+	if (fGeometry == kAxisymmetric) {
+		min[0] = min[1] = -fMaxX;
+		max[0] = max[1] = fMaxX;
+	}
+}
+
+void HGMEFieldTable::SetInterpolation(Interpolation interpolation) {
+	fInterpolation = interpolation;
+	SelectKernel();
+}
+
+size_t HGMEFieldTable::GetMemorySize() const {
+	// Mapped images and files hold a header before the nodes
+	return fStorage->GetSize() - (static_cast<const char*>(fData) - static_cast<const char*>(fStorage->GetData()));
+}
+
+void HGMEFieldTable::Locate(G4double value, G4double min, G4double delta, G4int n, G4bool invert,
+							G4int& index, G4double& local) const {
+	if (n == 1) {
+		index = 0;
+		local = 0.;
+		return;
+	}
+
+	// Position of given point within region, normalized to the range [0,1]
+	G4double fraction = (value - min) / delta;
+	if (invert)
+		fraction = 1 - fraction;
+
+	G4double dIndex;
+	local = std::modf(fraction * (n - 1), &dIndex);
+	index = static_cast<G4int>(dIndex);
+
+	// In rare cases, value is all the way to the end of the last bin.
+	// Need to make sure it is assigned to that bin and not to the non-existant next bin.
+	if (index + 1 == n) {
+		index--;
+		local = 1;
+	}
+}
+
+template <typename T, HGMEFieldTable::Layout L>
+inline void HGMEFieldTable::Corners(const G4double point[3], const T* corner[8], G4double local[3]) const {
+	if (L == kPadded) {
+		// Points inside the table fall between the first and the last node, up
+		// to rounding, which the halo absorbs
+		size_t offset[3];
+		for (G4int axis = 0; axis < 3; axis++) {
+			const G4double position = point[axis] * fIndexScale[axis] + fIndexOffset[axis];
+			const G4int index = static_cast<G4int>(position);
+			local[axis] = position - index;
+			offset[axis] = index * fStride[axis];
+		}
+		const T* base = Data<T>() + offset[0] + offset[1] + offset[2];
+		const size_t x = fStride[0], y = fStride[1], z = fStride[2];
+		corner[0] = base;
+		corner[1] = base + z;
+		corner[2] = base + y;
+		corner[3] = base + y + z;
+		corner[4] = base + x;
+		corner[5] = base + x + z;
+		corner[6] = base + x + y;
+		corner[7] = base + x + y + z;
+		return;
+	}
+
+	G4int xIndex, yIndex, zIndex;
+	Locate(point[0], fMinX, fDX, fNX, fInvertX, xIndex, local[0]);
+	Locate(point[1], fMinY, fDY, fNY, fInvertY, yIndex, local[1]);
+	Locate(point[2], fMinZ, fDZ, fNZ, fInvertZ, zIndex, local[2]);
+
+	// Offsets of the two planes of the cell along each axis; the far one is
+	// the near one along invariant axes
+	size_t x0, x1, y0, y1, z0, z1;
+	if (L == kRowMajor) {
+		z0 = 3 * (size_t)zIndex;
+		z1 = fNZ > 1 ? z0 + 3 : z0;
+		y0 = 3 * (size_t)yIndex * fNZ;
+		y1 = fNY > 1 ? y0 + 3 * (size_t)fNZ : y0;
+		x0 = 3 * (size_t)xIndex * fNZ * fNY;
+		x1 = fNX > 1 ? x0 + 3 * (size_t)fNZ * fNY : x0;
+	} else {
+		x0 = fOffsetX[xIndex];
+		x1 = fOffsetX[xIndex + 1];
+		y0 = fOffsetY[yIndex];
+		y1 = fOffsetY[yIndex + 1];
+		z0 = fOffsetZ[zIndex];
+		z1 = fOffsetZ[zIndex + 1];
+	}
+
+	// Corner index bits are x, y, z from the highest
+	corner[0] = Data<T>() + x0 + y0 + z0;
+	corner[1] = Data<T>() + x0 + y0 + z1;
+	corner[2] = Data<T>() + x0 + y1 + z0;
+	corner[3] = Data<T>() + x0 + y1 + z1;
+	corner[4] = Data<T>() + x1 + y0 + z0;
+	corner[5] = Data<T>() + x1 + y0 + z1;
+	corner[6] = Data<T>() + x1 + y1 + z0;
+	corner[7] = Data<T>() + x1 + y1 + z1;
+}
+
+template <typename T, HGMEFieldTable::Layout L>
+G4bool HGMEFieldTable::Trilinear(const G4double point[3], G4double field[3]) const {
+	if (!IsInsideGrid(point))
+		return Outside(point, field);
+
+	const T* c[8];
+	G4double local[3];
+	Corners<T, L>(point, c, local);
+	const G4double xLocal = local[0], yLocal = local[1], zLocal = local[2];
+
+	const G4double w00 = (1 - yLocal) * (1 - zLocal);
+	const G4double w01 = (1 - yLocal) *      zLocal;
+	const G4double w10 =      yLocal  * (1 - zLocal);
+	const G4double w11 =      yLocal  *      zLocal;
+	const G4double wLow = (1 - xLocal) * fScale;
+	const G4double wHigh = xLocal * fScale;
+
+	for (G4int k = 0; k < 3; k++) {
+		G4double low = c[0][k] * w00 + c[1][k] * w01 + c[2][k] * w10 + c[3][k] * w11;
+		G4double high = c[4][k] * w00 + c[5][k] * w01 + c[6][k] * w10 + c[7][k] * w11;
+		field[k] = low * wLow + high * wHigh;
+	}
+	return true;
+}
+
+template <typename T, HGMEFieldTable::Layout L, HGMEFieldTable::Interpolation I>
+G4bool HGMEFieldTable::CellGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+	if (!IsInsideGrid(point)) {
+		std::fill(gradient, gradient + 9, 0.);
+		return Outside(point, field);
+	}
+
+	const T* c[8];
+	G4double local[3];
+	Corners<T, L>(point, c, local);
+	const G4double x = local[0], y = local[1], z = local[2];
+
+	// Weights of the four edges along each axis, and the derivatives of the
+	// interpolant along the cell, scaled to the table frame
+	const G4double wyz[4] = {(1 - y) * (1 - z), (1 - y) * z, y * (1 - z), y * z};
+	const G4double wxz[4] = {(1 - x) * (1 - z), (1 - x) * z, x * (1 - z), x * z};
+	const G4double wxy[4] = {(1 - x) * (1 - y), (1 - x) * y, x * (1 - y), x * y};
+	for (G4int k = 0; k < 3; k++) {
+		const G4double low = c[0][k] * wyz[0] + c[1][k] * wyz[1] + c[2][k] * wyz[2] + c[3][k] * wyz[3];
+		const G4double high = c[4][k] * wyz[0] + c[5][k] * wyz[1] + c[6][k] * wyz[2] + c[7][k] * wyz[3];
+		field[k] = (low * (1 - x) + high * x) * fScale;
+		gradient[3 * k] = (high - low) * fGradientScale[0];
+		gradient[3 * k + 1] = ((c[2][k] - c[0][k]) * wxz[0] + (c[3][k] - c[1][k]) * wxz[1] +
+							   (c[6][k] - c[4][k]) * wxz[2] + (c[7][k] - c[5][k]) * wxz[3]) * fGradientScale[1];
+		gradient[3 * k + 2] = ((c[1][k] - c[0][k]) * wxy[0] + (c[3][k] - c[2][k]) * wxy[1] +
+							   (c[5][k] - c[4][k]) * wxy[2] + (c[7][k] - c[6][k]) * wxy[3]) * fGradientScale[2];
+	}
+
+	// The nearest node is a corner of the same cell
+	if (I == kNearest) {
+		const T* node = c[(x >= 0.5 ? 4 : 0) + (y >= 0.5 ? 2 : 0) + (z >= 0.5 ? 1 : 0)];
+		field[0] = node[0] * fScale;
+		field[1] = node[1] * fScale;
+		field[2] = node[2] * fScale;
+	}
+	return true;
+}
+
+template <typename T, HGMEFieldTable::Layout L>
+G4bool HGMEFieldTable::Nearest(const G4double point[3], G4double field[3]) const {
+	if (!IsInsideGrid(point))
+		return Outside(point, field);
+
+	if (L == kPadded) {
+		size_t index = 0;
+		for (G4int axis = 0; axis < 3; axis++)
+			index += static_cast<G4int>(point[axis] * fIndexScale[axis] + fIndexOffset[axis] + 0.5) * fStride[axis];
+		const T* node = Data<T>() + index;
+		field[0] = node[0] * fScale;
+		field[1] = node[1] * fScale;
+		field[2] = node[2] * fScale;
+		return true;
+	}
+
+	G4int xIndex, yIndex, zIndex;
+	G4double xLocal, yLocal, zLocal;
+	Locate(point[0], fMinX, fDX, fNX, fInvertX, xIndex, xLocal);
+	Locate(point[1], fMinY, fDY, fNY, fInvertY, yIndex, yLocal);
+	Locate(point[2], fMinZ, fDZ, fNZ, fInvertZ, zIndex, zLocal);
+	if (xLocal >= 0.5) xIndex++;
+	if (yLocal >= 0.5) yIndex++;
+	if (zLocal >= 0.5) zIndex++;
+
+	const T* node = Data<T>() + (L == kRowMajor ? 3 * (((size_t)xIndex * fNY + yIndex) * fNZ + zIndex) :
+								 NodeIndex(xIndex, yIndex, zIndex));
+	field[0] = node[0] * fScale;
+	field[1] = node[1] * fScale;
+	field[2] = node[2] * fScale;
+	return true;
+}
+
+G4bool HGMEFieldTable::Series(const G4double point[3], G4double field[3]) const {
+	if (!IsInsideGrid(point))
+		return Outside(point, field);
+
+	const G4int px = std::min(fPatchesX - 1, static_cast<G4int>((point[0] - fMinX) * fInversePatchX));
+	const G4int py = std::min(fPatchesY - 1, static_cast<G4int>((point[1] - fMinY) * fInversePatchY));
+	const G4double* patch = Data<G4double>() + ((size_t)px * fPatchesY + py) * (4 + 2 * (size_t)fSeriesOrder);
+	const G4double u = (point[0] - patch[0]) * patch[2];
+	const G4double v = (point[1] - patch[1]) * patch[2];
+	const G4double* c = patch + 4;
+
+	// Complex Horner steps, (re + i im) (u + i v) + c_n
+	G4double re = c[2 * fSeriesOrder - 2];
+	G4double im = c[2 * fSeriesOrder - 1];
+	for (G4int n = fSeriesOrder - 2; n >= 0; n--) {
+		const G4double nextRe = std::fma(re, u, std::fma(-im, v, c[2 * n]));
+		im = std::fma(re, v, std::fma(im, u, c[2 * n + 1]));
+		re = nextRe;
+	}
+	field[0] = im;
+	field[1] = re;
+	field[2] = patch[3];
+	return true;
+}
+
+G4bool HGMEFieldTable::SeriesGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+	std::fill(gradient, gradient + 9, 0.);
+	if (!IsInsideGrid(point))
+		return Outside(point, field);
+
+	const G4int px = std::min(fPatchesX - 1, static_cast<G4int>((point[0] - fMinX) * fInversePatchX));
+	const G4int py = std::min(fPatchesY - 1, static_cast<G4int>((point[1] - fMinY) * fInversePatchY));
+	const G4double* patch = Data<G4double>() + ((size_t)px * fPatchesY + py) * (4 + 2 * (size_t)fSeriesOrder);
+	const G4double u = (point[0] - patch[0]) * patch[2];
+	const G4double v = (point[1] - patch[1]) * patch[2];
+	const G4double* c = patch + 4;
+
+	// Horner steps for the series f and its derivative f' together
+	G4double re = c[2 * fSeriesOrder - 2];
+	G4double im = c[2 * fSeriesOrder - 1];
+	G4double dRe = 0.;
+	G4double dIm = 0.;
+	for (G4int n = fSeriesOrder - 2; n >= 0; n--) {
+		const G4double nextDRe = std::fma(dRe, u, std::fma(-dIm, v, re));
+		dIm = std::fma(dRe, v, std::fma(dIm, u, im));
+		dRe = nextDRe;
+		const G4double nextRe = std::fma(re, u, std::fma(-im, v, c[2 * n]));
+		im = std::fma(re, v, std::fma(im, u, c[2 * n + 1]));
+		re = nextRe;
+	}
+	field[0] = im;
+	field[1] = re;
+	field[2] = patch[3];
+
+	// F_y + i F_x is analytic in x + i y: its x derivative is f' / R and its
+	// y derivative i f' / R
+	dRe *= patch[2];
+	dIm *= patch[2];
+	gradient[0] = dIm;
+	gradient[1] = dRe;
+	gradient[3] = dRe;
+	gradient[4] = -dIm;
+	return true;
+}
+
+// The kernel is picked once per configuration so that Evaluate costs a
+// single indirect call instead of branching on every option per query
+void HGMEFieldTable::SelectKernel() {
+	if (fNX == 0) {
+		fKernel = &HGMEFieldTable::Outside;
+		fGradientKernel = &HGMEFieldTable::OutsideGradient;
+	} else if (fSeriesOrder > 0) {
+		fKernel = &HGMEFieldTable::Series;
+		fGradientKernel = &HGMEFieldTable::SeriesGradient;
+	} else if (fPrecision == kDouble) {
+		SelectNodeKernel<double>();
+	} else {
+		SelectNodeKernel<float>();
+	}
+
+	// Axisymmetric tables query the grid through the rotation
+	fGridKernel = fKernel;
+	fGridGradientKernel = fGradientKernel;
+	if (fGeometry == kAxisymmetric && fNX > 0) {
+		fKernel = &HGMEFieldTable::Axisymmetric;
+		fGradientKernel = &HGMEFieldTable::AxisymmetricGradient;
+	}
+}
+
+template <typename T>
+void HGMEFieldTable::SelectNodeKernel() {
+	const G4bool nearest = fInterpolation == kNearest;
+	if (fLayout == kRowMajor) {
+		fKernel = nearest ? &HGMEFieldTable::Nearest<T, kRowMajor> : &HGMEFieldTable::Trilinear<T, kRowMajor>;
+		fGradientKernel = nearest ? &HGMEFieldTable::CellGradient<T, kRowMajor, kNearest> : &HGMEFieldTable::CellGradient<T, kRowMajor, kTrilinear>;
+	} else if (fLayout == kTiled) {
+		fKernel = nearest ? &HGMEFieldTable::Nearest<T, kTiled> : &HGMEFieldTable::Trilinear<T, kTiled>;
+		fGradientKernel = nearest ? &HGMEFieldTable::CellGradient<T, kTiled, kNearest> : &HGMEFieldTable::CellGradient<T, kTiled, kTrilinear>;
+	} else {
+		fKernel = nearest ? &HGMEFieldTable::Nearest<T, kPadded> : &HGMEFieldTable::Trilinear<T, kPadded>;
+		fGradientKernel = nearest ? &HGMEFieldTable::CellGradient<T, kPadded, kNearest> : &HGMEFieldTable::CellGradient<T, kPadded, kTrilinear>;
+	}
+}
+
+G4bool HGMEFieldTable::Axisymmetric(const G4double point[3], G4double field[3]) const {
+	const G4double r = std::sqrt(point[0] * point[0] + point[1] * point[1]);
+	const G4double grid[3] = {r, 0., point[2]};
+	G4double cylindrical[3];
+	const G4bool inside = (this->*fGridKernel)(grid, cylindrical);
+
+	// On the axis the radial and azimuthal components vanish
+	const G4double cosPhi = r > 0. ? point[0] / r : 0.;
+	const G4double sinPhi = r > 0. ? point[1] / r : 0.;
+	field[0] = cylindrical[0] * cosPhi - cylindrical[1] * sinPhi;
+	field[1] = cylindrical[0] * sinPhi + cylindrical[1] * cosPhi;
+	field[2] = cylindrical[2];
+	return inside;
+}
+
+G4bool HGMEFieldTable::AxisymmetricGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+	const G4double r = std::sqrt(point[0] * point[0] + point[1] * point[1]);
+	const G4double grid[3] = {r, 0., point[2]};
+	G4double cylindrical[3], derivatives[9];
+	const G4bool inside = (this->*fGridGradientKernel)(grid, cylindrical, derivatives);
+
+	// Derivatives along r and z of F_r, F_phi and F_z
+	const G4double drR = derivatives[0], dzR = derivatives[2];
+	const G4double drPhi = derivatives[3], dzPhi = derivatives[5];
+	const G4double drZ = derivatives[6], dzZ = derivatives[8];
+
+	// F_r / r and F_phi / r come from turning the components with the point;
+	// on the axis they tend to the radial derivatives
+	G4double c = 0., s = 0., radial = drR, azimuthal = drPhi;
+	if (r > 0.) {
+		c = point[0] / r;
+		s = point[1] / r;
+		radial = cylindrical[0] / r;
+		azimuthal = cylindrical[1] / r;
+	}
+	field[0] = cylindrical[0] * c - cylindrical[1] * s;
+	field[1] = cylindrical[0] * s + cylindrical[1] * c;
+	field[2] = cylindrical[2];
+
+	if (r > 0.) {
+		gradient[0] = c * c * drR + s * s * radial - c * s * (drPhi - azimuthal);
+		gradient[1] = c * s * (drR - radial) - s * s * drPhi - c * c * azimuthal;
+		gradient[3] = c * s * (drR - radial) + c * c * drPhi + s * s * azimuthal;
+		gradient[4] = s * s * drR + c * c * radial + c * s * (drPhi - azimuthal);
+	} else {
+		gradient[0] = radial;
+		gradient[1] = -azimuthal;
+		gradient[3] = azimuthal;
+		gradient[4] = radial;
+	}
+	gradient[2] = c * dzR - s * dzPhi;
+	gradient[5] = s * dzR + c * dzPhi;
+	gradient[6] = c * drZ;
+	gradient[7] = s * drZ;
+	gradient[8] = dzZ;
+	return inside;
+}
+
+G4bool HGMEFieldTable::Outside(const G4double[3], G4double field[3]) const {
+	field[0] = 0.;
+	field[1] = 0.;
+	field[2] = 0.;
+	return false;
+}
+
+G4bool HGMEFieldTable::OutsideGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+	std::fill(gradient, gradient + 9, 0.);
+	return Outside(point, field);
+}
@@ -0,0 +1,314 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMEFieldTable_hh
+#define HGMEFieldTable_hh
+
+#include "HGMEFieldStorage.hh"
+
+#include "G4Types.hh"
+
+#include <cmath>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+// Regular grid of three component field values together with the
+// interpolation kernel used by the mapped field classes.
+//
+// Nodes are stored interleaved, so the three components of one node share a
+// cache line. In the row-major layout x runs slowest and z fastest; the tiled
+// layout stores bricks of 4x4x4 nodes contiguously, so the corners of a cell
+// and its neighbours in every direction share pages and cache lines. The
+// padded layout is row-major with a halo node on each side of every axis
+// that has more than one node, extrapolated from the edge, so its kernel finds
+// the cell by a multiplication and a truncation without edge or direction
+// cases. Coordinates passed to Evaluate are in the frame of the table (the
+// component frame).
+//
+// Copies share the node storage, so one table can serve every worker thread.
+// Nodes must only be set before the table is shared.
+class HGMEFieldTable
+{
+public:
+	enum Precision { kDouble, kFloat };
+	enum Interpolation { kTrilinear, kNearest };
+	enum Layout { kRowMajor, kTiled, kPadded };
+	enum Geometry { kCartesian, kAxisymmetric };
+
+	HGMEFieldTable();
+	~HGMEFieldTable();
+
+	// Page backing used by the following Allocate calls
+	void SetHugePages(HGMEFieldStorage::HugePages hugePages) { fHugePages = hugePages; }
+	HGMEFieldStorage::HugePages GetHugePages() const { return fHugePages; }
+
+	// Allocates a zero filled table of nx*ny*nz nodes
+	void Allocate(G4int nx, G4int ny, G4int nz, Precision precision);
+
+	// Node order used by the following Allocate calls. Changing the layout of
+	// an allocated table reorders its nodes into new storage.
+	void SetLayout(Layout layout);
+	Layout GetLayout() const { return fLayout; }
+
+	// Copy of the table with its own storage bound to a NUMA node
+	HGMEFieldTable Replicate(G4int node) const;
+
+	// Replaces the nodes of a Z-invariant table by a multipole series on a
+	// grid of patchesX x patchesY patches over the x-y extent of the table.
+	// Each patch holds, as given by HGMEFieldSeriesFitter, its centre x and
+	// y, the inverse of its scale radius, Fz and then order pairs of series
+	// coefficients (real, imaginary) for
+	//   F_y + i F_x = sum_n c_n ((x - x0 + i (y - y0)) / R)^n
+	void SetSeries(G4int order, G4int patchesX, G4int patchesY, const std::vector<G4double>& coefficients);
+	G4int GetSeriesOrder() const { return fSeriesOrder; }
+
+	// Storage of the nodes, for reports
+	const HGMEFieldStorage& GetStorage() const { return *fStorage; }
+	void SetNode(G4int ix, G4int iy, G4int iz, G4double fx, G4double fy, G4double fz);
+	void GetNode(G4int ix, G4int iy, G4int iz, G4double field[3]) const;
+
+	// Positions of the first and the last node of the table. The first node
+	// may have the larger coordinate, the table is then read inverted.
+	// Axes with a single node are invariant: the field is the same for every
+	// coordinate along them (a Z-invariant 2D map has nz = 1).
+	// Must be called after Allocate.
+	void SetLimits(G4double firstX, G4double firstY, G4double firstZ,
+				   G4double lastX, G4double lastY, G4double lastZ);
+
+	void SetInterpolation(Interpolation interpolation);
+
+	// An axisymmetric table is a grid over (r, z): x is the distance from the
+	// z axis of the table frame, y has a single node, and the components are
+	// F_r, F_phi and F_z. Queries interpolate at the radius of the point and
+	// rotate the result about the axis. Returns false, leaving the geometry
+	// unchanged, if the grid does not have this form (one node along y, at
+	// least two along r, none at a negative radius) or holds a series.
+	// Set it after the nodes, limits and layout.
+	G4bool SetGeometry(Geometry geometry);
+	Geometry GetGeometry() const { return fGeometry; }
+
+	// Sets the radial and azimuthal components of the nodes on the axis of
+	// an (r, z) grid to zero, as they are for any regular field, so the
+	// rotated field is continuous across the axis. Nodes used in place are
+	// copied first. Returns the largest component removed.
+	G4double ClearAxis();
+
+	// Whether a point of the table frame is covered by the table
+	G4bool IsInside(const G4double point[3]) const {
+		if (fGeometry == kAxisymmetric) {
+			G4double grid[3];
+			ToGrid(point, grid);
+			return IsInsideGrid(grid);
+		}
+		return IsInsideGrid(point);
+	}
+
+	// Point of the grid for a point of the table frame: itself, or (r, 0, z)
+	// for axisymmetric tables
+	void ToGrid(const G4double point[3], G4double grid[3]) const {
+		grid[0] = fGeometry == kAxisymmetric ? std::sqrt(point[0] * point[0] + point[1] * point[1]) : point[0];
+		grid[1] = fGeometry == kAxisymmetric ? 0. : point[1];
+		grid[2] = point[2];
+	}
+
+	// Box of the table frame covered by the table: the limits, or for
+	// axisymmetric tables the box around the cylinder of the largest radius
+	void GetBounds(G4double min[3], G4double max[3]) const;
+
+	// Interpolated field at a point of the table frame. Returns false, and a
+	// zero field, for points outside the table.
+	G4bool Evaluate(const G4double point[3], G4double field[3]) const {
+		return (this->*fKernel)(point, field);
+	}
+
+	// Field and its derivatives from the same lookup, gradient[3 * i + j]
+	// being dF_i/dx_j in the table frame. The derivatives are those of the
+	// interpolant: for tables, of the trilinear interpolation in the cell
+	// holding the point (also with nearest node interpolation, which has
+	// none); for series, of the series. Zero outside the table.
+	G4bool EvaluateGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const {
+		return (this->*fGradientKernel)(point, field, gradient);
+	}
+
+	// Limits and dimensions are those of the grid, in (r, z) for
+	// axisymmetric tables
+	G4int GetNX() const { return fNX; }
+	G4int GetNY() const { return fNY; }
+	G4int GetNZ() const { return fNZ; }
+	G4double GetMinX() const { return fMinX; }
+	G4double GetMinY() const { return fMinY; }
+	G4double GetMinZ() const { return fMinZ; }
+	G4double GetMaxX() const { return fMaxX; }
+	G4double GetMaxY() const { return fMaxY; }
+	G4double GetMaxZ() const { return fMaxZ; }
+	Precision GetPrecision() const { return fPrecision; }
+
+	// Coordinates of the first and last node along an axis (0, 1, 2 for x,
+	// y, z) as given to SetLimits, and of any node. Invariant axes give 0.
+	G4double GetFirst(G4int axis) const;
+	G4double GetLast(G4int axis) const;
+	void GetNodePosition(G4int ix, G4int iy, G4int iz, G4double position[3]) const;
+	Interpolation GetInterpolation() const { return fInterpolation; }
+
+	// Bytes held by the node storage
+	size_t GetMemorySize() const;
+
+	// Native binary image of the table, used as a cache for generated tables.
+	// ReadBinary returns false if the stream does not hold a complete table.
+	void WriteBinary(std::ostream& output) const;
+	G4bool ReadBinary(std::istream& input);
+
+	// The same image in memory, with the nodes starting on a page of their
+	// own. MapImage uses the nodes of an image in place, without a copy, and
+	// returns false if the storage does not hold a complete image.
+	size_t GetImageSize() const;
+	void WriteImage(void* image) const;
+	G4bool MapImage(const std::shared_ptr<HGMEFieldStorage>& storage);
+
+	// Uses row-major nodes held in storage from byte offset on, such as those
+	// of a memory mapped file, in place. The stored values are multiplied by
+	// scale on every read, so files in other field units need no copy.
+	// Returns false if the storage is too small. Set the limits afterwards.
+	G4bool MapNodes(const std::shared_ptr<HGMEFieldStorage>& storage, size_t offset,
+					G4int nx, G4int ny, G4int nz, Precision precision, G4double scale);
+	G4double GetScale() const { return fScale; }
+
+private:
+	typedef G4bool (HGMEFieldTable::*Kernel)(const G4double[3], G4double[3]) const;
+	typedef G4bool (HGMEFieldTable::*GradientKernel)(const G4double[3], G4double[3], G4double[9]) const;
+
+	void SelectKernel();
+	template <typename T> void SelectNodeKernel();
+
+	// Sets the dimensions and node offsets, returning the bytes of storage
+	size_t SetDimensions(G4int nx, G4int ny, G4int nz, Precision precision);
+
+	// Dimensions, precision, orientation, layout and limits of the image formats
+	void GetHeader(G4int header[8], G4double limits[6]) const;
+	void SetHeader(const G4int header[8], const G4double limits[6]);
+	void SetInvariant(G4double& min, G4double& max, G4double& delta, G4bool& invert);
+	G4bool IsInsideGrid(const G4double point[3]) const {
+		return point[0] >= fMinX && point[0] <= fMaxX &&
+		point[1] >= fMinY && point[1] <= fMaxY &&
+		point[2] >= fMinZ && point[2] <= fMaxZ;
+	}
+	G4bool Outside(const G4double point[3], G4double field[3]) const;
+	G4bool OutsideGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const;
+	// Gradient scale, and index mapping of the padded layout, for the current
+	// dimensions and limits
+	void SetScales();
+
+	// Writes the three stored values of the node at a storage index
+	void SetStored(size_t index, const G4double values[3]);
+
+	// Recomputes the halo nodes of a padded table that depend on a node
+	void FillHalo(G4int ix, G4int iy, G4int iz);
+
+	// Copies the nodes into target, which has the dimensions of this table
+	void CopyNodes(HGMEFieldTable& target) const;
+
+	// Copy with its own storage holding the field values, for the images
+	HGMEFieldTable Unscaled() const;
+
+	template <typename T> const T* Data() const { return static_cast<const T*>(fData); }
+	template <typename T, Layout L> void Corners(const G4double point[3], const T* corner[8], G4double local[3]) const;
+	template <typename T, Layout L> G4bool Trilinear(const G4double point[3], G4double field[3]) const;
+	template <typename T, Layout L, Interpolation I>
+	G4bool CellGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const;
+	template <typename T, Layout L> G4bool Nearest(const G4double point[3], G4double field[3]) const;
+	G4bool Series(const G4double point[3], G4double field[3]) const;
+	G4bool SeriesGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const;
+	G4bool Axisymmetric(const G4double point[3], G4double field[3]) const;
+	G4bool AxisymmetricGradient(const G4double point[3], G4double field[3], G4double gradient[9]) const;
+
+	// Position in the storage of the first component of a node
+	size_t NodeIndex(G4int ix, G4int iy, G4int iz) const {
+		return fOffsetX[ix] + fOffsetY[iy] + fOffsetZ[iz];
+	}
+
+	// Index of the cell holding a coordinate and the position inside it
+	void Locate(G4double value, G4double min, G4double delta, G4int n, G4bool invert,
+				G4int& index, G4double& local) const;
+
+	// Physical limits of the defined region
+	G4double fMinX, fMinY, fMinZ, fMaxX, fMaxY, fMaxZ;
+
+	// Physical extent of the defined region
+	G4double fDX, fDY, fDZ;
+
+	// Allows handling of either direction of min and max positions
+	G4bool fInvertX, fInvertY, fInvertZ;
+
+	// Dimensions of the table
+	G4int fNX, fNY, fNZ;
+
+	Precision fPrecision;
+	Interpolation fInterpolation;
+	Kernel fKernel;
+	GradientKernel fGradientKernel;
+
+	// Kernels of the grid, called by those of axisymmetric tables
+	Geometry fGeometry;
+	Kernel fGridKernel;
+	GradientKernel fGridGradientKernel;
+
+	// Factor from the stored values to the field, one except for mapped nodes
+	G4double fScale;
+
+	// Derivative of the position in the cell along each axis, zero along
+	// invariant axes, times fScale
+	G4double fGradientScale[3];
+
+	// Padded layout: position along each axis in nodes of the storage, halo
+	// included, is point * fIndexScale + fIndexOffset; fStride is the storage
+	// step of one node, zero along invariant axes
+	G4double fIndexScale[3];
+	G4double fIndexOffset[3];
+	size_t fStride[3];
+
+	// Storage offset of each index along each axis, the sum of the three
+	// gives the node. One extra entry repeats the last index, so the far
+	// neighbour of a single node axis is the node itself.
+	Layout fLayout;
+	std::vector<size_t> fOffsetX, fOffsetY, fOffsetZ;
+
+	// Series representation, in use when the order is not zero
+	G4int fSeriesOrder;
+	G4int fPatchesX, fPatchesY;
+	G4double fInversePatchX, fInversePatchY;
+
+	// Nodes of fPrecision type, held by fStorage
+	HGMEFieldStorage::HugePages fHugePages;
+	std::shared_ptr<HGMEFieldStorage> fStorage;
+	void* fData;
+};
+
+#endif
@@ -0,0 +1,344 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMELaplaceSolver.hh"
+
+#include "G4SystemOfUnits.hh"
+#include "G4PhysicalConstants.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <condition_variable>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace {
+	// Reusable barrier for the worker threads of one relaxation
+	class Barrier
+	{
+	public:
+		Barrier(G4int count) : fCount(count), fWaiting(0), fGeneration(0) {}
+
+		void Wait() {
+			std::unique_lock<std::mutex> lock(fMutex);
+			G4int generation = fGeneration;
+			if (++fWaiting == fCount) {
+				fWaiting = 0;
+				fGeneration++;
+				fCondition.notify_all();
+			} else {
+				fCondition.wait(lock, [this, generation] { return generation != fGeneration; });
+			}
+		}
+
+	private:
+		std::mutex fMutex;
+		std::condition_variable fCondition;
+		G4int fCount;
+		G4int fWaiting;
+		G4int fGeneration;
+	};
+
+	G4double Coordinate(G4int index, G4int n, G4double halfLength) {
+		return n > 1 ? -halfLength + 2. * halfLength * index / (n - 1) : 0.;
+	}
+}
+
+HGMELaplaceSolver::HGMELaplaceSolver(const G4int n[3], const G4double halfLength[3]):
+fGroundedBoundary(false), fTolerance(1.e-6), fMaxIterations(100000), fNumberOfThreads(1) {
+	for (G4int axis = 0; axis < 3; axis++) {
+		fN[axis] = n[axis];
+		fHalfLength[axis] = halfLength[axis];
+	}
+}
+
+HGMELaplaceSolver::~HGMELaplaceSolver() {;}
+
+G4String HGMELaplaceSolver::GetDescription() const {
+	std::ostringstream description;
+	description << std::setprecision(17) << "laplace " << fN[0] << " " << fN[1] << " " << fN[2];
+	for (G4int axis = 0; axis < 3; axis++)
+		description << " " << fHalfLength[axis];
+	description << " " << fGroundedBoundary << " " << fTolerance;
+	for (size_t e = 0; e < fElectrodes.size(); e++) {
+		const Electrode& electrode = fElectrodes[e];
+		description << " | " << electrode.shape << " " << electrode.axis << " " << electrode.position << " "
+		<< electrode.radius << " " << electrode.potential;
+		for (G4int axis = 0; axis < 3; axis++)
+			description << " " << electrode.center[axis] << " " << electrode.halfLength[axis];
+	}
+	return description.str();
+}
+
+void HGMELaplaceSolver::Solve(HGMEFieldTable* table, HGMEFieldTable::Precision precision) {
+	// Levels from finest to coarsest; each axis roughly halves, down to 9 nodes
+	std::vector<Level> levels(1);
+	for (G4int axis = 0; axis < 3; axis++)
+		levels[0].n[axis] = fN[axis];
+
+	while (true) {
+		Level coarse;
+		G4bool coarser = false;
+		for (G4int axis = 0; axis < 3; axis++) {
+			G4int n = levels.back().n[axis];
+			coarse.n[axis] = n > 9 ? (n + 1) / 2 : n;
+			if (coarse.n[axis] != n) coarser = true;
+		}
+		if (!coarser) break;
+		levels.push_back(coarse);
+	}
+
+	for (size_t l = 0; l < levels.size(); l++) {
+		Level& level = levels[l];
+		size_t size = 1;
+		for (G4int axis = 0; axis < 3; axis++) {
+			level.h[axis] = level.n[axis] > 1 ? 2. * fHalfLength[axis] / (level.n[axis] - 1) : 0.;
+			size *= level.n[axis];
+		}
+		level.potential.assign(size, 0.);
+		level.fixed.assign(size, 0);
+	}
+
+	for (G4int l = (G4int)levels.size() - 1; l >= 0; l--) {
+		if (l < (G4int)levels.size() - 1) {
+			Prolongate(levels[l + 1], levels[l]);
+			std::vector<G4double>().swap(levels[l + 1].potential);
+			std::vector<char>().swap(levels[l + 1].fixed);
+		}
+		Rasterize(levels[l]);
+		G4int iterations = Relax(levels[l]);
+		G4cout << "Laplace solver level " << levels[l].n[0] << "x" << levels[l].n[1] << "x" << levels[l].n[2]
+		<< ": " << iterations << " iterations" << G4endl;
+	}
+
+	// E = -grad(phi), central differences inside and one sided on the faces
+	const Level& level = levels[0];
+	const G4int* n = level.n;
+	table->Allocate(n[0], n[1], n[2], precision);
+	G4int index[3];
+	for (index[0] = 0; index[0] < n[0]; index[0]++) {
+		for (index[1] = 0; index[1] < n[1]; index[1]++) {
+			for (index[2] = 0; index[2] < n[2]; index[2]++) {
+				G4double field[3] = {0., 0., 0.};
+				for (G4int axis = 0; axis < 3; axis++) {
+					if (n[axis] == 1) continue;
+					G4int low[3] = {index[0], index[1], index[2]};
+					G4int high[3] = {index[0], index[1], index[2]};
+					if (low[axis] > 0) low[axis]--;
+					if (high[axis] < n[axis] - 1) high[axis]++;
+					size_t lowIndex = ((size_t)low[0] * n[1] + low[1]) * n[2] + low[2];
+					size_t highIndex = ((size_t)high[0] * n[1] + high[1]) * n[2] + high[2];
+					field[axis] = -(level.potential[highIndex] - level.potential[lowIndex]) /
+					((high[axis] - low[axis]) * level.h[axis]);
+				}
+				table->SetNode(index[0], index[1], index[2], field[0], field[1], field[2]);
+			}
+		}
+	}
+	table->SetLimits(-fHalfLength[0], -fHalfLength[1], -fHalfLength[2],
+					 fHalfLength[0], fHalfLength[1], fHalfLength[2]);
+}
+
+void HGMELaplaceSolver::Rasterize(Level& level) const {
+	const G4int* n = level.n;
+	G4double position[3];
+	G4int index[3];
+
+	for (index[0] = 0; index[0] < n[0]; index[0]++) {
+		position[0] = Coordinate(index[0], n[0], fHalfLength[0]);
+		for (index[1] = 0; index[1] < n[1]; index[1]++) {
+			position[1] = Coordinate(index[1], n[1], fHalfLength[1]);
+			for (index[2] = 0; index[2] < n[2]; index[2]++) {
+				position[2] = Coordinate(index[2], n[2], fHalfLength[2]);
+				size_t i = ((size_t)index[0] * n[1] + index[1]) * n[2] + index[2];
+
+				if (fGroundedBoundary) {
+					for (G4int axis = 0; axis < 3; axis++) {
+						if (n[axis] > 1 && (index[axis] == 0 || index[axis] == n[axis] - 1)) {
+							level.fixed[i] = 1;
+							level.potential[i] = 0.;
+						}
+					}
+				}
+
+				// Every electrode covers at least the nodes closest to it, so
+				// electrodes thinner than the grid spacing are not lost
+				for (size_t e = 0; e < fElectrodes.size(); e++) {
+					const Electrode& electrode = fElectrodes[e];
+					G4bool inside = true;
+					if (electrode.shape == Electrode::kPlane) {
+						inside = std::fabs(position[electrode.axis] - electrode.position) <= 0.5 * level.h[electrode.axis];
+					} else if (electrode.shape == Electrode::kWire) {
+						G4double dx = position[0] - electrode.center[0];
+						G4double dy = position[1] - electrode.center[1];
+						inside = (dx * dx + dy * dy <= electrode.radius * electrode.radius) ||
+						(std::fabs(dx) <= 0.5 * level.h[0] && std::fabs(dy) <= 0.5 * level.h[1]);
+					} else {
+						for (G4int axis = 0; axis < 3 && inside; axis++) {
+							if (n[axis] == 1) continue;
+							inside = std::fabs(position[axis] - electrode.center[axis]) <=
+							std::max(electrode.halfLength[axis], 0.5 * level.h[axis]);
+						}
+					}
+					if (inside) {
+						level.fixed[i] = 1;
+						level.potential[i] = electrode.potential;
+					}
+				}
+			}
+		}
+	}
+}
+
+void HGMELaplaceSolver::Prolongate(const Level& coarse, Level& fine) const {
+	G4int index[3];
+	for (index[0] = 0; index[0] < fine.n[0]; index[0]++) {
+		for (index[1] = 0; index[1] < fine.n[1]; index[1]++) {
+			for (index[2] = 0; index[2] < fine.n[2]; index[2]++) {
+				// Trilinear interpolation of the coarse solution at the fine node
+				G4int low[3];
+				G4double weight[3];
+				for (G4int axis = 0; axis < 3; axis++) {
+					if (coarse.n[axis] == 1) {
+						low[axis] = 0;
+						weight[axis] = 0.;
+						continue;
+					}
+					G4double u = (G4double)index[axis] * (coarse.n[axis] - 1) / (fine.n[axis] - 1);
+					low[axis] = std::min((G4int)u, coarse.n[axis] - 2);
+					weight[axis] = u - low[axis];
+				}
+
+				G4double value = 0.;
+				for (G4int corner = 0; corner < 8; corner++) {
+					G4double w = 1.;
+					G4int c[3];
+					for (G4int axis = 0; axis < 3; axis++) {
+						G4int bit = (corner >> axis) & 1;
+						if (coarse.n[axis] == 1 && bit) w = 0.;
+						c[axis] = low[axis] + bit;
+						w *= bit ? weight[axis] : 1. - weight[axis];
+					}
+					if (w == 0.) continue;
+					value += w * coarse.potential[((size_t)c[0] * coarse.n[1] + c[1]) * coarse.n[2] + c[2]];
+				}
+				fine.potential[((size_t)index[0] * fine.n[1] + index[1]) * fine.n[2] + index[2]] = value;
+			}
+		}
+	}
+}
+
+G4int HGMELaplaceSolver::Relax(Level& level) const {
+	// Potential range sets the scale of the convergence criterion
+	G4double low = fGroundedBoundary ? 0. : DBL_MAX;
+	G4double high = fGroundedBoundary ? 0. : -DBL_MAX;
+	for (size_t e = 0; e < fElectrodes.size(); e++) {
+		low = std::min(low, fElectrodes[e].potential);
+		high = std::max(high, fElectrodes[e].potential);
+	}
+	G4double range = high > low ? high - low : 1. * volt;
+	const G4double tolerance = fTolerance * range;
+
+	G4int largest = std::max(level.n[0], std::max(level.n[1], level.n[2]));
+	const G4double omega = 2. / (1. + std::sin(pi / largest));
+
+	G4int threads = std::max(1, std::min(fNumberOfThreads, level.n[0] / 4));
+	std::vector<G4double> largestUpdate(threads, 0.);
+	Barrier barrier(threads);
+	G4int iterations = 0;
+
+	auto work = [&](G4int thread) {
+		G4int firstX = level.n[0] * thread / threads;
+		G4int lastX = level.n[0] * (thread + 1) / threads;
+		for (G4int iteration = 0; iteration < fMaxIterations; iteration++) {
+			G4double update = Sweep(level, 0, omega, firstX, lastX);
+			barrier.Wait();
+			update = std::max(update, Sweep(level, 1, omega, firstX, lastX));
+			largestUpdate[thread] = update;
+			barrier.Wait();
+
+			// Every thread reaches the same decision from the same numbers
+			G4double global = *std::max_element(largestUpdate.begin(), largestUpdate.end());
+			if (thread == 0) iterations = iteration + 1;
+			if (global < tolerance) break;
+			barrier.Wait();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (G4int thread = 1; thread < threads; thread++)
+		workers.push_back(std::thread(work, thread));
+	work(0);
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	return iterations;
+}
+
+G4double HGMELaplaceSolver::Sweep(Level& level, G4int color, G4double omega, G4int firstX, G4int lastX) const {
+	const G4int* n = level.n;
+	G4double weight[3], sumOfWeights = 0.;
+	for (G4int axis = 0; axis < 3; axis++) {
+		weight[axis] = n[axis] > 1 ? 1. / (level.h[axis] * level.h[axis]) : 0.;
+		sumOfWeights += 2. * weight[axis];
+	}
+
+	const size_t strideY = n[2];
+	const size_t strideX = (size_t)n[1] * n[2];
+	G4double* phi = level.potential.data();
+	G4double largestUpdate = 0.;
+
+	for (G4int i = firstX; i < lastX; i++) {
+		// Missing neighbours on the faces are mirrored: zero normal derivative
+		const G4long xm = i > 0 ? -(G4long)strideX : (n[0] > 1 ? (G4long)strideX : 0);
+		const G4long xp = i < n[0] - 1 ? (G4long)strideX : (n[0] > 1 ? -(G4long)strideX : 0);
+		for (G4int j = 0; j < n[1]; j++) {
+			const G4long ym = j > 0 ? -(G4long)strideY : (n[1] > 1 ? (G4long)strideY : 0);
+			const G4long yp = j < n[1] - 1 ? (G4long)strideY : (n[1] > 1 ? -(G4long)strideY : 0);
+			// Red-black ordering: only nodes with (i + j + k) % 2 == color
+			for (G4int k = (i + j + color) & 1; k < n[2]; k += 2) {
+				const size_t index = ((size_t)i * n[1] + j) * n[2] + k;
+				if (level.fixed[index]) continue;
+
+				const G4long zm = k > 0 ? -1 : (n[2] > 1 ? 1 : 0);
+				const G4long zp = k < n[2] - 1 ? 1 : (n[2] > 1 ? -1 : 0);
+				G4double target = (weight[0] * (phi[index + xm] + phi[index + xp]) +
+								   weight[1] * (phi[index + ym] + phi[index + yp]) +
+								   weight[2] * (phi[index + zm] + phi[index + zp])) / sumOfWeights;
+				G4double update = omega * (target - phi[index]);
+				phi[index] += update;
+				largestUpdate = std::max(largestUpdate, std::fabs(update));
+			}
+		}
+	}
+	return largestUpdate;
+}
@@ -0,0 +1,110 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMELaplaceSolver_hh
+#define HGMELaplaceSolver_hh
+
+#include "HGMEFieldTable.hh"
+
+#include "G4String.hh"
+
+#include <vector>
+
+// Finite difference solver for the electrostatic potential of simple
+// electrode geometries on a regular grid centred on the component origin.
+//
+// The potential is relaxed with red-black successive over-relaxation in a
+// coarse-to-fine multigrid cascade: every level is solved on a grid with
+// roughly half the nodes per axis of the next finer one and its solution,
+// interpolated, is the starting point of the finer level. Electrodes are
+// rasterised separately on every level, so thin wires and planes stay
+// pinned at any resolution. A grid with a single node along Z is solved as
+// a Z-invariant 2D problem.
+class HGMELaplaceSolver
+{
+public:
+	struct Electrode {
+		enum Shape { kPlane, kWire, kBox };
+		Shape shape;
+		// Plane: axis normal to the plane and its position along that axis
+		G4int axis;
+		G4double position;
+		// Wire (along Z): centre in X and Y and radius.
+		// Box: centre and half lengths.
+		G4double center[3];
+		G4double halfLength[3];
+		G4double radius;
+		// Potential in Geant4 units
+		G4double potential;
+	};
+
+	// Grid of n[0]*n[1]*n[2] nodes spanning [-halfLength, halfLength]
+	HGMELaplaceSolver(const G4int n[3], const G4double halfLength[3]);
+	~HGMELaplaceSolver();
+
+	void AddElectrode(const Electrode& electrode) { fElectrodes.push_back(electrode); }
+
+	// Grounded outer boundary, otherwise the normal derivative vanishes there
+	void SetGroundedBoundary(G4bool grounded) { fGroundedBoundary = grounded; }
+
+	// Convergence when the largest update of a sweep drops below tolerance
+	// times the potential range of the electrodes
+	void SetTolerance(G4double tolerance) { fTolerance = tolerance; }
+	void SetMaxIterations(G4int iterations) { fMaxIterations = iterations; }
+	void SetNumberOfThreads(G4int threads) { fNumberOfThreads = threads; }
+
+	// Solves for the potential and fills the table with E = -grad(phi)
+	void Solve(HGMEFieldTable* table, HGMEFieldTable::Precision precision);
+
+	// Canonical description of the problem, used as the cache key
+	G4String GetDescription() const;
+
+private:
+	struct Level {
+		G4int n[3];
+		G4double h[3];
+		std::vector<G4double> potential;
+		std::vector<char> fixed;
+	};
+
+	void Rasterize(Level& level) const;
+	void Prolongate(const Level& coarse, Level& fine) const;
+	G4int Relax(Level& level) const;
+	G4double Sweep(Level& level, G4int color, G4double omega, G4int firstX, G4int lastX) const;
+
+	G4int fN[3];
+	G4double fHalfLength[3];
+	std::vector<Electrode> fElectrodes;
+	G4bool fGroundedBoundary;
+	G4double fTolerance;
+	G4int fMaxIterations;
+	G4int fNumberOfThreads;
+};
+
+#endif
@@ -0,0 +1,57 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+
+#include "HGMETabulation.hh"
+
+#include "TsParameterManager.hh"
+
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+
+G4String HGMETabulation::CacheName(const G4String& directory, const G4String& prefix, uint64_t key) {
+	std::ostringstream name;
+	if (directory != "")
+		name << directory << "/";
+	name << prefix << "_" << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+	return name.str();
+}
+
+G4String HGMETabulation::TemporaryName(const G4String& cacheName) {
+	return cacheName + ".tmp" + std::to_string((long)getpid());
+}
+
+void HGMETabulation::Abort(TsParameterManager* pM, const G4String& name, const G4String& message) {
+	G4cerr << "" << G4endl;
+	G4cerr << "Topas is exiting due to a serious error." << G4endl;
+	G4cerr << "The parameter: " << name << G4endl;
+	G4cerr << message << G4endl;
+	pM->AbortSession(1);
+}
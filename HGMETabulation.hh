@@ -0,0 +1,219 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+
+#ifndef HGMETabulation_hh
+#define HGMETabulation_hh
+
+#include "G4AutoLock.hh"
+#include "G4String.hh"
+#include "G4Types.hh"
+#include "G4ios.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class TsParameterManager;
+
+// Common pieces of the tables precomputed from the field maps: the transfer
+// maps, the drift tables and the Laplace solutions.
+//
+// Their nodes are independent integrations spread over threads, the
+// integrations are adaptive fourth order Runge-Kutta, the tables are kept
+// per component and shared by the worker threads, and they are cached on
+// disk under a hash of their content.
+namespace HGMETabulation
+{
+	// Runs work(index) for every index below count on threads threads
+	template <typename Work>
+	void ParallelFor(size_t count, G4int threads, Work work) {
+		std::atomic<size_t> next(0);
+		auto worker = [&]() {
+			for (size_t index = next++; index < count; index = next++)
+				work(index);
+		};
+		std::vector<std::thread> workers;
+		for (G4int thread = 1; thread < threads; thread++)
+			workers.push_back(std::thread(worker));
+		worker();
+		for (size_t t = 0; t < workers.size(); t++)
+			workers[t].join();
+	}
+
+	// Classical fourth order Runge-Kutta step. derivatives(y, dyds) returns
+	// false where the motion stops, and so does the step.
+	template <G4int N, typename Derivatives>
+	G4bool Step(const G4double y[N], G4double h, G4double out[N], Derivatives& derivatives) {
+		G4double k1[N], k2[N], k3[N], k4[N], t[N];
+		if (!derivatives(y, k1)) return false;
+		for (G4int i = 0; i < N; i++) t[i] = y[i] + 0.5 * h * k1[i];
+		if (!derivatives(t, k2)) return false;
+		for (G4int i = 0; i < N; i++) t[i] = y[i] + 0.5 * h * k2[i];
+		if (!derivatives(t, k3)) return false;
+		for (G4int i = 0; i < N; i++) t[i] = y[i] + h * k3[i];
+		if (!derivatives(t, k4)) return false;
+		for (G4int i = 0; i < N; i++)
+			out[i] = y[i] + h / 6. * (k1[i] + 2. * k2[i] + 2. * k3[i] + k4[i]);
+		return true;
+	}
+
+	struct Steps {
+		G4double initial;
+		G4double maximum;
+		// Steps shorter than this end the integration
+		G4double minimum;
+		// Longer paths are taken as trapped
+		G4double maxPath;
+	};
+
+	// Step doubling controls the error of every step, with the two estimates
+	// combined by Richardson extrapolation. error(full, doubled) is the
+	// difference scaled by the tolerance. A step that would leave the volume
+	// (inside(y) false) or reach a point where the motion stops is halved
+	// until it is shorter than steps.minimum, where the integration ends with
+	// y on the last point inside and path its length. Returns false when the
+	// path grows too long or alive(y) turns false after a step.
+	template <G4int N, typename Derivatives, typename Error, typename Inside, typename Alive>
+	G4bool Integrate(G4double y[N], G4double& path, const Steps& steps, Derivatives derivatives, Error error,
+					 Inside inside, Alive alive) {
+		G4double h = steps.initial;
+		path = 0.;
+
+		G4double full[N], half[N], candidate[N];
+		for (;;) {
+			if (path > steps.maxPath)
+				return false;
+
+			if (!Step<N>(y, h, full, derivatives) || !Step<N>(y, 0.5 * h, half, derivatives) ||
+				!Step<N>(half, 0.5 * h, candidate, derivatives)) {
+				if (h > steps.minimum) {
+					h = std::max(steps.minimum, 0.5 * h);
+					continue;
+				}
+				return true;
+			}
+
+			const G4double scaled = error(full, candidate);
+			if (scaled > 1. && h > steps.minimum) {
+				h = std::max(steps.minimum, h * std::max(0.1, 0.9 * std::pow(scaled, -0.2)));
+				continue;
+			}
+
+			// Richardson extrapolation of the two estimates
+			for (G4int i = 0; i < N; i++)
+				candidate[i] += (candidate[i] - full[i]) / 15.;
+
+			if (!inside(candidate)) {
+				if (h > steps.minimum) {
+					h = std::max(steps.minimum, 0.5 * h);
+					continue;
+				}
+				return true;
+			}
+
+			std::copy(candidate, candidate + N, y);
+			path += h;
+			h = std::min(steps.maximum, h * (scaled > 0. ? std::min(5., 0.9 * std::pow(scaled, -0.2)) : 5.));
+			if (!alive(y))
+				return false;
+		}
+	}
+
+	// Tables of type T of the components, built by the first thread from a
+	// description of their inputs and shared by the others until the
+	// description changes
+	template <typename T>
+	class SharedTables {
+	public:
+		// The table of the component, built by build() unless the one kept
+		// was built from the same description
+		template <typename Build>
+		static std::shared_ptr<const T> Get(const G4String& component, const G4String& description, Build build) {
+			G4AutoLock lock(&GetMutex());
+			Entry& entry = GetEntries()[component];
+			if (!entry.table || entry.description != description) {
+				entry.table = build();
+				entry.description = description;
+			}
+			return entry.table;
+		}
+
+	private:
+		struct Entry {
+			G4String description;
+			std::shared_ptr<const T> table;
+		};
+		static G4Mutex& GetMutex() {
+			static G4Mutex mutex;
+			return mutex;
+		}
+		static std::map<G4String,Entry>& GetEntries() {
+			static std::map<G4String,Entry> entries;
+			return entries;
+		}
+	};
+
+	// Cache file directory/prefix_<key>.bin
+	G4String CacheName(const G4String& directory, const G4String& prefix, uint64_t key);
+
+	// Reads the cache with read(stream), false if it is missing or stale
+	template <typename Read>
+	G4bool ReadCache(const G4String& cacheName, Read read) {
+		std::ifstream cache(cacheName, std::ios::binary);
+		return cache && read(cache);
+	}
+
+	// Writes the cache with write(stream) under a temporary name, renamed
+	// once complete so that concurrent jobs never read a partial file
+	G4String TemporaryName(const G4String& cacheName);
+	template <typename Write>
+	void WriteCache(const G4String& cacheName, const G4String& what, Write write) {
+		const G4String temporaryName = TemporaryName(cacheName);
+		std::ofstream cache(temporaryName, std::ios::binary);
+		write(cache);
+		cache.close();
+		if (!cache || std::rename(temporaryName.c_str(), cacheName.c_str()) != 0) {
+			G4cout << "Could not write " << what << " cache " << cacheName << G4endl;
+			std::remove(temporaryName.c_str());
+		}
+	}
+
+	// Ends the session on an invalid parameter
+	void Abort(TsParameterManager* pM, const G4String& name, const G4String& message);
+}
+
+#endif
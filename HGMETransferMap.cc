@@ -0,0 +1,462 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "HGMETransferMap.hh"
+#include "HGMETabulation.hh"
+
+#include "G4PhysicalConstants.hh"
+#include "G4SystemOfUnits.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+namespace {
+	const char transferMapMagic[8] = {'H', 'G', 'M', 'E', 'T', 'M', '0', '1'};
+
+	// Steps shorter than this end the crossing in a straight line
+	const G4double minimumStep = 1.e-6 * mm;
+
+	// Share of the tolerances given to the integration of one trajectory
+	const G4double integrationShare = 0.01;
+}
+
+HGMETransferMap::HGMETransferMap(const HGMEFieldRegions* magnetic, const HGMEFieldRegions* electric,
+								 G4double charge, G4double mass):
+fHasMagnetic(magnetic != 0), fHasElectric(electric != 0), fCharge(charge), fMass(mass), fMaxDeviation(0.) {
+	if (magnetic)
+		fMagnetic = *magnetic;
+	if (electric)
+		fElectric = *electric;
+
+	for (G4int axis = 0; axis < 3; axis++) {
+		fMin[axis] = DBL_MAX;
+		fMax[axis] = -DBL_MAX;
+		if (magnetic) {
+			fMin[axis] = std::min(fMin[axis], magnetic->GetMin()[axis]);
+			fMax[axis] = std::max(fMax[axis], magnetic->GetMax()[axis]);
+		}
+		if (electric) {
+			fMin[axis] = std::min(fMin[axis], electric->GetMin()[axis]);
+			fMax[axis] = std::max(fMax[axis], electric->GetMax()[axis]);
+		}
+	}
+
+	std::memset(&fGrid, 0, sizeof(fGrid));
+	for (G4int axis = 0; axis < kAxes; axis++)
+		fCells[axis] = 0;
+	fTolerance.position = 0.01 * mm;
+	fTolerance.direction = 1.e-4;
+	fTolerance.kineticEnergy = 1.e-4;
+}
+
+HGMETransferMap::~HGMETransferMap() {;}
+
+G4bool HGMETransferMap::IsBounded() const {
+	for (G4int axis = 0; axis < 3; axis++)
+		if (!(fMin[axis] > -0.5 * DBL_MAX && fMax[axis] < 0.5 * DBL_MAX && fMin[axis] < fMax[axis]))
+			return false;
+	return true;
+}
+
+void HGMETransferMap::Field(const G4double position[3], G4double magnetic[3], G4double electric[3]) const {
+	magnetic[0] = magnetic[1] = magnetic[2] = 0.;
+	electric[0] = electric[1] = electric[2] = 0.;
+	if (fHasMagnetic)
+		fMagnetic.Evaluate(position, magnetic);
+	if (fHasElectric)
+		fElectric.Evaluate(position, electric);
+}
+
+// Equation of motion of G4EqMagElectricField with the path length as the
+// variable: y holds the position, the momentum and the time of flight
+void HGMETransferMap::Derivatives(const G4double y[7], G4double dyds[7]) const {
+	const G4double momentum2 = y[3] * y[3] + y[4] * y[4] + y[5] * y[5];
+	const G4double inverseMomentum = 1. / std::sqrt(momentum2);
+	const G4double energy = std::sqrt(momentum2 + fMass * fMass);
+
+	G4double b[3], e[3];
+	Field(y, b, e);
+
+	const G4double cof = fCharge * c_light * inverseMomentum;
+	const G4double energyOverC = energy / c_light;
+	for (G4int i = 0; i < 3; i++)
+		dyds[i] = y[3 + i] * inverseMomentum;
+	dyds[3] = cof * (energyOverC * e[0] + y[4] * b[2] - y[5] * b[1]);
+	dyds[4] = cof * (energyOverC * e[1] + y[5] * b[0] - y[3] * b[2]);
+	dyds[5] = cof * (energyOverC * e[2] + y[3] * b[1] - y[4] * b[0]);
+	dyds[6] = energyOverC * inverseMomentum;
+}
+
+G4bool HGMETransferMap::IsInside(const G4double position[3]) const {
+	for (G4int axis = 0; axis < 3; axis++)
+		if (position[axis] < fMin[axis] || position[axis] > fMax[axis])
+			return false;
+	return true;
+}
+
+G4int HGMETransferMap::ExitFace(const G4double position[3], const G4double direction[3], G4double& distance) const {
+	G4int face = -1;
+	distance = DBL_MAX;
+	for (G4int axis = 0; axis < 3; axis++) {
+		if (direction[axis] == 0.)
+			continue;
+		const G4bool upper = direction[axis] > 0.;
+		const G4double d = ((upper ? fMax[axis] : fMin[axis]) - position[axis]) / direction[axis];
+		if (d < distance) {
+			distance = d;
+			face = 2 * axis + upper;
+		}
+	}
+	distance = std::max(distance, 0.);
+	return face;
+}
+
+G4bool HGMETransferMap::Track(const State& entry, State& exit) const {
+	return Integrate(entry, exit) >= 0;
+}
+
+// Step doubling controls the error of every step. A step that would leave
+// the box is halved until it is negligible, then the particle goes straight
+// to the face, as the field outside the box is zero.
+G4int HGMETransferMap::Integrate(const State& entry, State& exit) const {
+	if (!IsInside(entry.position) || entry.kineticEnergy <= 0.)
+		return -1;
+
+	const G4double momentum = std::sqrt(entry.kineticEnergy * (entry.kineticEnergy + 2. * fMass));
+	G4double y[7];
+	for (G4int i = 0; i < 3; i++) {
+		y[i] = entry.position[i];
+		y[3 + i] = entry.direction[i] * momentum;
+	}
+	y[6] = 0.;
+
+	G4double diagonal = 0.;
+	for (G4int axis = 0; axis < 3; axis++)
+		diagonal += (fMax[axis] - fMin[axis]) * (fMax[axis] - fMin[axis]);
+	diagonal = std::sqrt(diagonal);
+
+	const G4double positionError = integrationShare * fTolerance.position;
+	const G4double momentumError = integrationShare * std::min(fTolerance.direction, fTolerance.kineticEnergy);
+	HGMETabulation::Steps steps;
+	steps.maximum = diagonal / 50.;
+	steps.initial = steps.maximum / 10.;
+	steps.minimum = minimumStep;
+	steps.maxPath = 100. * diagonal;
+
+	G4double path;
+	const G4bool crossed = HGMETabulation::Integrate<7>(y, path, steps,
+		[this](const G4double* at, G4double* dyds) {
+			Derivatives(at, dyds);
+			return true;
+		},
+		[positionError, momentumError](const G4double* full, const G4double* doubled) {
+			G4double positionDifference = 0., momentumDifference = 0., momentum2 = 0.;
+			for (G4int i = 0; i < 3; i++) {
+				positionDifference = std::max(positionDifference, std::abs(doubled[i] - full[i]));
+				momentumDifference = std::max(momentumDifference, std::abs(doubled[3 + i] - full[3 + i]));
+				momentum2 += doubled[3 + i] * doubled[3 + i];
+			}
+			return std::max(positionDifference / positionError,
+							momentumDifference / (momentumError * std::sqrt(momentum2)));
+		},
+		[this](const G4double* at) { return IsInside(at); },
+		[this, &entry](const G4double* at) {
+			const G4double momentum2 = at[3] * at[3] + at[4] * at[4] + at[5] * at[5];
+			return std::sqrt(momentum2 + fMass * fMass) - fMass >= 1.e-3 * entry.kineticEnergy;
+		});
+	if (!crossed)
+		return -1;
+
+	const G4double momentum2 = y[3] * y[3] + y[4] * y[4] + y[5] * y[5];
+	const G4double inverseMomentum = 1. / std::sqrt(momentum2);
+	const G4double energy = std::sqrt(momentum2 + fMass * fMass);
+	for (G4int i = 0; i < 3; i++)
+		exit.direction[i] = y[3 + i] * inverseMomentum;
+
+	G4double distance;
+	const G4int face = ExitFace(y, exit.direction, distance);
+	for (G4int i = 0; i < 3; i++)
+		exit.position[i] = y[i] + distance * exit.direction[i];
+	exit.position[face / 2] = face % 2 ? fMax[face / 2] : fMin[face / 2];
+	exit.kineticEnergy = energy - fMass;
+	exit.time = entry.time + y[6] + distance * energy * inverseMomentum / c_light;
+	exit.pathLength = entry.pathLength + path + distance;
+	return face;
+}
+
+void HGMETransferMap::EntryState(const G4double u[kAxes], State& entry) const {
+	const G4double norm = std::sqrt(u[kSlopeX] * u[kSlopeX] + u[kSlopeY] * u[kSlopeY] + 1.);
+	entry.position[0] = u[kX];
+	entry.position[1] = u[kY];
+	entry.position[2] = fMin[2];
+	entry.direction[0] = u[kSlopeX] / norm;
+	entry.direction[1] = u[kSlopeY] / norm;
+	entry.direction[2] = 1. / norm;
+	const G4double momentum = 1. / u[kInverseMomentum];
+	entry.kineticEnergy = std::sqrt(momentum * momentum + fMass * fMass) - fMass;
+	entry.time = 0.;
+	entry.pathLength = 0.;
+}
+
+void HGMETransferMap::NodeCoordinates(size_t node, G4double u[kAxes]) const {
+	for (G4int axis = kAxes - 1; axis >= 0; axis--) {
+		const G4int n = fGrid.nodes[axis];
+		const G4int index = node % n;
+		node /= n;
+		u[axis] = n > 1 ? fGrid.min[axis] + (fGrid.max[axis] - fGrid.min[axis]) * index / (n - 1) : fGrid.min[axis];
+	}
+}
+
+G4bool HGMETransferMap::Locate(const State& entry, G4int cell[kAxes], G4double local[kAxes]) const {
+	if (entry.direction[2] <= 0. || fExits.empty())
+		return false;
+	const G4double value[kAxes] = {entry.position[0], entry.position[1],
+		entry.direction[0] / entry.direction[2], entry.direction[1] / entry.direction[2],
+		1. / std::sqrt(entry.kineticEnergy * (entry.kineticEnergy + 2. * fMass))};
+	for (G4int axis = 0; axis < kAxes; axis++) {
+		const G4int n = fGrid.nodes[axis];
+		if (n == 1) {
+			if (std::abs(value[axis] - fGrid.min[axis]) > 1.e-9 * std::max(1., std::abs(fGrid.min[axis])))
+				return false;
+			cell[axis] = 0;
+			local[axis] = 0.;
+			continue;
+		}
+		const G4double t = (value[axis] - fGrid.min[axis]) / (fGrid.max[axis] - fGrid.min[axis]) * (n - 1);
+		if (!(t >= 0. && t <= n - 1))
+			return false;
+		cell[axis] = std::min((G4int)t, n - 2);
+		local[axis] = t - cell[axis];
+	}
+	return true;
+}
+
+size_t HGMETransferMap::CellIndex(const G4int cell[kAxes]) const {
+	size_t index = 0;
+	for (G4int axis = 0; axis < kAxes; axis++)
+		index = index * fCells[axis] + cell[axis];
+	return index;
+}
+
+// Multilinear interpolation over the corners of the cell, axes with a
+// single node contribute one corner
+void HGMETransferMap::Interpolate(const G4int cell[kAxes], const G4double local[kAxes], const State& entry, State& exit) const {
+	G4double sum[kValues] = {0., 0., 0., 0., 0., 0., 0., 0., 0.};
+	G4int face = -1;
+	for (G4int corner = 0; corner < (1 << kAxes); corner++) {
+		G4double weight = 1.;
+		size_t node = 0;
+		G4bool skip = false;
+		for (G4int axis = 0; axis < kAxes; axis++) {
+			const G4int bit = (corner >> axis) & 1;
+			if (bit && fGrid.nodes[axis] == 1) {
+				skip = true;
+				break;
+			}
+			weight *= bit ? local[axis] : 1. - local[axis];
+			node = node * fGrid.nodes[axis] + cell[axis] + bit;
+		}
+		if (skip)
+			continue;
+		face = fFaces[node];
+		const G4double* values = &fExits[kValues * node];
+		for (G4int v = 0; v < kValues; v++)
+			sum[v] += weight * values[v];
+	}
+
+	const G4double norm = std::sqrt(sum[3] * sum[3] + sum[4] * sum[4] + sum[5] * sum[5]);
+	for (G4int i = 0; i < 3; i++) {
+		exit.position[i] = sum[i];
+		exit.direction[i] = sum[3 + i] / norm;
+	}
+	if (face >= 0)
+		exit.position[face / 2] = face % 2 ? fMax[face / 2] : fMin[face / 2];
+	exit.kineticEnergy = entry.kineticEnergy + sum[6];
+	exit.time = entry.time + sum[7];
+	exit.pathLength = entry.pathLength + sum[8];
+}
+
+G4bool HGMETransferMap::Transport(const State& entry, State& exit) const {
+	G4int cell[kAxes];
+	G4double local[kAxes];
+	if (!Locate(entry, cell, local) || !fCellValid[CellIndex(cell)])
+		return false;
+	Interpolate(cell, local, entry, exit);
+	return true;
+}
+
+void HGMETransferMap::Build(const Grid& grid, const Tolerance& tolerance, G4int threads) {
+	fGrid = grid;
+	fTolerance = tolerance;
+	size_t nodes = 1, cells = 1;
+	for (G4int axis = 0; axis < kAxes; axis++) {
+		fCells[axis] = std::max(fGrid.nodes[axis] - 1, 1);
+		nodes *= fGrid.nodes[axis];
+		cells *= fCells[axis];
+	}
+	fExits.assign(kValues * nodes, 0.);
+	fFaces.assign(nodes, -1);
+	fCellValid.assign(cells, 0);
+
+	HGMETabulation::ParallelFor(nodes, threads, [this](size_t node) {
+		G4double u[kAxes];
+		NodeCoordinates(node, u);
+		State entry, exit;
+		EntryState(u, entry);
+		const G4int face = Integrate(entry, exit);
+		if (face < 0)
+			return;
+		G4double* values = &fExits[kValues * node];
+		std::copy(exit.position, exit.position + 3, values);
+		std::copy(exit.direction, exit.direction + 3, values + 3);
+		values[6] = exit.kineticEnergy - entry.kineticEnergy;
+		values[7] = exit.time;
+		values[8] = exit.pathLength;
+		fFaces[node] = face;
+	});
+
+	// Every cell is checked where multilinear interpolation errs most, at
+	// its centre, against a particle tracked from there
+	std::vector<G4double> deviation(cells, 0.);
+	HGMETabulation::ParallelFor(cells, threads, [this, &deviation](size_t index) {
+		G4int cell[kAxes];
+		size_t rest = index;
+		for (G4int axis = kAxes - 1; axis >= 0; axis--) {
+			cell[axis] = rest % fCells[axis];
+			rest /= fCells[axis];
+		}
+
+		G4int face = -2;
+		for (G4int corner = 0; corner < (1 << kAxes); corner++) {
+			size_t node = 0;
+			G4bool skip = false;
+			for (G4int axis = 0; axis < kAxes; axis++) {
+				const G4int bit = (corner >> axis) & 1;
+				skip = skip || (bit && fGrid.nodes[axis] == 1);
+				node = node * fGrid.nodes[axis] + cell[axis] + (fGrid.nodes[axis] > 1 ? bit : 0);
+			}
+			if (skip)
+				continue;
+			if (fFaces[node] < 0 || (face != -2 && fFaces[node] != face))
+				return;
+			face = fFaces[node];
+		}
+
+		G4double local[kAxes], u[kAxes];
+		for (G4int axis = 0; axis < kAxes; axis++) {
+			local[axis] = fGrid.nodes[axis] > 1 ? 0.5 : 0.;
+			u[axis] = fGrid.nodes[axis] > 1 ? fGrid.min[axis] + (fGrid.max[axis] - fGrid.min[axis]) * (cell[axis] + 0.5) / (fGrid.nodes[axis] - 1)
+			: fGrid.min[axis];
+		}
+		State entry, tracked, interpolated;
+		EntryState(u, entry);
+		if (Integrate(entry, tracked) != face)
+			return;
+		Interpolate(cell, local, entry, interpolated);
+
+		G4double position = 0., direction = 0.;
+		for (G4int i = 0; i < 3; i++) {
+			position += (tracked.position[i] - interpolated.position[i]) * (tracked.position[i] - interpolated.position[i]);
+			direction += (tracked.direction[i] - interpolated.direction[i]) * (tracked.direction[i] - interpolated.direction[i]);
+		}
+		position = std::sqrt(position);
+		direction = std::sqrt(direction);
+		const G4double energy = std::abs(tracked.kineticEnergy - interpolated.kineticEnergy) / tracked.kineticEnergy;
+		if (position <= fTolerance.position && direction <= fTolerance.direction && energy <= fTolerance.kineticEnergy) {
+			fCellValid[index] = 1;
+			deviation[index] = position;
+		}
+	});
+	fMaxDeviation = deviation.empty() ? 0. : *std::max_element(deviation.begin(), deviation.end());
+}
+
+size_t HGMETransferMap::GetNumberOfValidCells() const {
+	return std::count(fCellValid.begin(), fCellValid.end(), 1);
+}
+
+// Format: "HGMETM01", uint64 key, int32 nodes[5], double min[5], max[5],
+// box min[3], max[3], max deviation, then the exit values (9 doubles per
+// node, with the energy gained in place of the kinetic energy), the exit faces (int8 per node) and the cell checks (int8 per cell)
+void HGMETransferMap::Write(std::ostream& output, uint64_t key) const {
+	output.write(transferMapMagic, sizeof(transferMapMagic));
+	output.write(reinterpret_cast<const char*>(&key), sizeof(key));
+	for (G4int axis = 0; axis < kAxes; axis++) {
+		int32_t n = fGrid.nodes[axis];
+		output.write(reinterpret_cast<const char*>(&n), sizeof(n));
+	}
+	output.write(reinterpret_cast<const char*>(fGrid.min), sizeof(fGrid.min));
+	output.write(reinterpret_cast<const char*>(fGrid.max), sizeof(fGrid.max));
+	output.write(reinterpret_cast<const char*>(fMin), sizeof(fMin));
+	output.write(reinterpret_cast<const char*>(fMax), sizeof(fMax));
+	output.write(reinterpret_cast<const char*>(&fMaxDeviation), sizeof(fMaxDeviation));
+	output.write(reinterpret_cast<const char*>(fExits.data()), fExits.size() * sizeof(G4double));
+	output.write(reinterpret_cast<const char*>(fFaces.data()), fFaces.size());
+	output.write(fCellValid.data(), fCellValid.size());
+}
+
+G4bool HGMETransferMap::Read(std::istream& input, uint64_t key) {
+	char magic[sizeof(transferMapMagic)];
+	uint64_t fileKey = 0;
+	input.read(magic, sizeof(magic));
+	input.read(reinterpret_cast<char*>(&fileKey), sizeof(fileKey));
+	if (!input || std::memcmp(magic, transferMapMagic, sizeof(magic)) != 0 || fileKey != key)
+		return false;
+
+	Grid grid;
+	size_t nodes = 1, cells = 1;
+	for (G4int axis = 0; axis < kAxes; axis++) {
+		int32_t n = 0;
+		input.read(reinterpret_cast<char*>(&n), sizeof(n));
+		if (!input || n < 1 || n > 65535)
+			return false;
+		grid.nodes[axis] = n;
+		fCells[axis] = std::max(n - 1, 1);
+		nodes *= n;
+		cells *= fCells[axis];
+	}
+	input.read(reinterpret_cast<char*>(grid.min), sizeof(grid.min));
+	input.read(reinterpret_cast<char*>(grid.max), sizeof(grid.max));
+	input.read(reinterpret_cast<char*>(fMin), sizeof(fMin));
+	input.read(reinterpret_cast<char*>(fMax), sizeof(fMax));
+	input.read(reinterpret_cast<char*>(&fMaxDeviation), sizeof(fMaxDeviation));
+	fGrid = grid;
+	fExits.resize(kValues * nodes);
+	fFaces.resize(nodes);
+	fCellValid.resize(cells);
+	input.read(reinterpret_cast<char*>(fExits.data()), fExits.size() * sizeof(G4double));
+	input.read(reinterpret_cast<char*>(fFaces.data()), fFaces.size());
+	input.read(fCellValid.data(), fCellValid.size());
+	if (!input) {
+		fExits.clear();
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,157 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMETransferMap_hh
+#define HGMETransferMap_hh
+
+#include "HGMEFieldRegions.hh"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+// Transfer map of one charged particle species across the box of the maps
+// of a component, from its state where it enters the upstream face (the
+// lowest Z of the box, moving towards +Z) to its state where it leaves the
+// box, all in the component frame.
+//
+// Entry states are tabulated on a regular grid of position on the face
+// (X, Y), slopes (dX/dZ, dY/dZ) and inverse momentum, in which magnetic
+// deflections are nearly linear. Every node is tracked
+// once through the maps with an adaptive Runge-Kutta integrator of the same
+// equation of motion as Geant4, and a query interpolates the exit states of
+// the 32 corners of its cell. A cell is only used if its corners all leave
+// through the same face and, at its centre, the interpolation agrees with a
+// tracked particle within the tolerances.
+class HGMETransferMap
+{
+public:
+	struct State {
+		G4double position[3];
+		G4double direction[3];
+		G4double kineticEnergy;
+		G4double time;
+		G4double pathLength;
+	};
+
+	// Axes of the grid of entry states
+	enum Axis { kX, kY, kSlopeX, kSlopeY, kInverseMomentum, kAxes };
+
+	struct Grid {
+		G4int nodes[kAxes];
+		G4double min[kAxes];
+		G4double max[kAxes];
+	};
+
+	struct Tolerance {
+		G4double position;
+		G4double direction;
+		// Relative to the kinetic energy
+		G4double kineticEnergy;
+	};
+
+	// Maps of the magnetic and electric fields, either of which may be null.
+	// charge and mass are those of the particle, in Geant4 units.
+	HGMETransferMap(const HGMEFieldRegions* magnetic, const HGMEFieldRegions* electric, G4double charge, G4double mass);
+	~HGMETransferMap();
+
+	// Box crossed by the map, the union of the boxes of the maps
+	const G4double* GetMin() const { return fMin; }
+	const G4double* GetMax() const { return fMax; }
+
+	// Whether the box is bounded along every axis, as a map needs
+	G4bool IsBounded() const;
+
+	// Tracks every node of the grid, then checks every cell at its centre,
+	// on the given number of threads
+	void Build(const Grid& grid, const Tolerance& tolerance, G4int threads);
+
+	// Exit state of a particle entering the upstream face at entry. The time
+	// and path length of the crossing are added to those of entry. Returns
+	// false outside the grid, or in a cell that failed its check, where the
+	// particle has to be tracked.
+	G4bool Transport(const State& entry, State& exit) const;
+
+	// Exit state of a particle from any state inside the box, by integration.
+	// Returns false if it stops, or does not leave within a hundred
+	// diagonals of the box.
+	G4bool Track(const State& entry, State& exit) const;
+
+	// Cached maps, valid only for the maps, particle, grid and tolerances
+	// of the given key
+	void Write(std::ostream& output, uint64_t key) const;
+	G4bool Read(std::istream& input, uint64_t key);
+
+	size_t GetNumberOfCells() const { return fCellValid.size(); }
+	size_t GetNumberOfValidCells() const;
+
+	// Largest position deviation found at the centre of a used cell
+	G4double GetMaxDeviation() const { return fMaxDeviation; }
+
+private:
+	// Exit state of a node: position, direction, kinetic energy gained, time
+	// and path length, and the face it leaves through (2 * axis, + 1 for the
+	// upper face), or -1 if it does not leave
+	enum { kValues = 9 };
+
+	// Exit face of the particle leaving from entry, -1 if it does not leave
+	G4int Integrate(const State& entry, State& exit) const;
+
+	void Field(const G4double position[3], G4double magnetic[3], G4double electric[3]) const;
+	void Derivatives(const G4double y[7], G4double dyds[7]) const;
+	G4bool IsInside(const G4double position[3]) const;
+	G4int ExitFace(const G4double position[3], const G4double direction[3], G4double& distance) const;
+
+	// Entry state of a point of the grid, u in grid coordinates
+	void EntryState(const G4double u[kAxes], State& entry) const;
+	void NodeCoordinates(size_t node, G4double u[kAxes]) const;
+	G4bool Locate(const State& entry, G4int cell[kAxes], G4double local[kAxes]) const;
+	size_t CellIndex(const G4int cell[kAxes]) const;
+	void Interpolate(const G4int cell[kAxes], const G4double local[kAxes], const State& entry, State& exit) const;
+
+	HGMEFieldRegions fMagnetic;
+	HGMEFieldRegions fElectric;
+	G4bool fHasMagnetic;
+	G4bool fHasElectric;
+	G4double fCharge;
+	G4double fMass;
+	G4double fMin[3];
+	G4double fMax[3];
+
+	Grid fGrid;
+	Tolerance fTolerance;
+	G4int fCells[kAxes];
+	std::vector<G4double> fExits;
+	std::vector<signed char> fFaces;
+	std::vector<char> fCellValid;
+	G4double fMaxDeviation;
+};
+
+#endif
@@ -0,0 +1,295 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#include "TsParameterManager.hh"
+
+#include "HGMETransferMapModel.hh"
+#include "HGMEFieldMapLoader.hh"
+#include "HGMETabulation.hh"
+#include "TsVGeometryComponent.hh"
+
+#include "G4FastSimulationManager.hh"
+#include "G4LogicalVolume.hh"
+#include "G4Material.hh"
+#include "G4ParticleTable.hh"
+#include "G4PhysicalConstants.hh"
+#include "G4SystemOfUnits.hh"
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+namespace {
+	// Tables and placements of the maps. identity gives the storage
+	// addresses, which tell a reloaded table apart within the process,
+	// otherwise the content is hashed for the disk cache.
+	void DescribeMaps(std::ostream& description, const char* name, const HGMEFieldRegions* regions, G4bool identity,
+					  uint64_t& hash) {
+		if (!regions)
+			return;
+		description << " " << name;
+		for (size_t r = 0; r < regions->GetNumberOfRegions(); r++) {
+			const HGMEFieldTable& table = regions->GetTable(r);
+			const G4double* offset = regions->GetOffset(r);
+			description << " [" << offset[0] << " " << offset[1] << " " << offset[2]
+			<< " interpolation " << table.GetInterpolation() << " geometry " << table.GetGeometry()
+			<< " scale " << table.GetScale() << "]";
+			if (identity)
+				description << " " << &table.GetStorage();
+			else
+				hash = HGMEFieldMapLoader::Hash(table.GetStorage().GetData(), table.GetStorage().GetSize(), hash);
+		}
+	}
+}
+
+HGMETransferMapModel::HGMETransferMapModel(const G4String& name, G4Region* region):
+G4VFastSimulationModel(name, region), fParticle(0), fRegion(region) {
+}
+
+HGMETransferMapModel::~HGMETransferMapModel() {
+	G4FastSimulationManager* manager = fRegion->GetFastSimulationManager();
+	if (manager)
+		manager->RemoveFastSimulationModel(this);
+}
+
+void HGMETransferMapModel::SetMap(const std::shared_ptr<const HGMETransferMap>& map, const G4ParticleDefinition* particle) {
+	fMap = map;
+	fParticle = particle;
+}
+
+G4bool HGMETransferMapModel::IsApplicable(const G4ParticleDefinition& particle) {
+	return &particle == fParticle;
+}
+
+G4bool HGMETransferMapModel::ModelTrigger(const G4FastTrack& fastTrack) {
+	if (!fMap)
+		return false;
+
+	const G4ThreeVector position = fastTrack.GetPrimaryTrackLocalPosition();
+	const G4ThreeVector direction = fastTrack.GetPrimaryTrackLocalDirection();
+	const G4double face = fMap->GetMin()[2];
+	if (direction.z() <= 0. || position.z() > face)
+		return false;
+
+	// Straight to the upstream face, the field is zero outside the box
+	const G4Track* track = fastTrack.GetPrimaryTrack();
+	const G4double kineticEnergy = track->GetKineticEnergy();
+	const G4double mass = fParticle->GetPDGMass();
+	const G4double velocity = c_light * std::sqrt(kineticEnergy * (kineticEnergy + 2. * mass)) / (kineticEnergy + mass);
+	const G4double distance = (face - position.z()) / direction.z();
+
+	HGMETransferMap::State entry;
+	for (G4int i = 0; i < 3; i++) {
+		entry.position[i] = position[i] + distance * direction[i];
+		entry.direction[i] = direction[i];
+	}
+	entry.position[2] = face;
+	entry.kineticEnergy = kineticEnergy;
+	entry.time = track->GetGlobalTime() + distance / velocity;
+	entry.pathLength = distance;
+	if (!fMap->Transport(entry, fExit))
+		return false;
+
+	// Both ends of the crossing have to be in the envelope
+	const G4VSolid* solid = fastTrack.GetEnvelopeSolid();
+	return solid->Inside(G4ThreeVector(entry.position[0], entry.position[1], entry.position[2])) != kOutside &&
+	solid->Inside(G4ThreeVector(fExit.position[0], fExit.position[1], fExit.position[2])) != kOutside;
+}
+
+void HGMETransferMapModel::DoIt(const G4FastTrack&, G4FastStep& step) {
+	step.ProposePrimaryTrackFinalPosition(G4ThreeVector(fExit.position[0], fExit.position[1], fExit.position[2]), true);
+	step.ProposePrimaryTrackFinalMomentumDirection(G4ThreeVector(fExit.direction[0], fExit.direction[1], fExit.direction[2]), true);
+	step.ProposePrimaryTrackFinalKineticEnergy(fExit.kineticEnergy);
+	step.ProposePrimaryTrackFinalTime(fExit.time);
+	step.ProposePrimaryTrackPathLength(fExit.pathLength);
+}
+
+HGMETransferMapModel* HGMETransferMapModel::Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+													  const HGMEFieldRegions* magnetic, const HGMEFieldRegions* electric,
+													  HGMETransferMapModel* model) {
+	G4String name = component->GetFullParmName("TransferMap");
+	if (!pM->ParameterExists(name) || !pM->GetBooleanParameter(name)) {
+		if (model)
+			model->SetMap(std::shared_ptr<const HGMETransferMap>(), 0);
+		return model;
+	}
+
+	G4String particleName = "e-";
+	name = component->GetFullParmName("TransferMapParticle");
+	if (pM->ParameterExists(name))
+		particleName = pM->GetStringParameter(name);
+	const G4ParticleDefinition* particle = G4ParticleTable::GetParticleTable()->FindParticle(particleName);
+	if (!particle || particle->GetPDGCharge() == 0.)
+		HGMETabulation::Abort(pM, name, "must name a charged particle, not " + particleName);
+
+	G4double energy[2] = {0., 0.};
+	const char* energyNames[2] = {"TransferMapMinKineticEnergy", "TransferMapMaxKineticEnergy"};
+	for (G4int i = 0; i < 2; i++) {
+		name = component->GetFullParmName(energyNames[i]);
+		if (!pM->ParameterExists(name))
+			HGMETabulation::Abort(pM, name, "is needed by TransferMap.");
+		energy[i] = pM->GetDoubleParameter(name, "Energy");
+	}
+	if (energy[0] <= 0. || energy[1] < energy[0])
+		HGMETabulation::Abort(pM, name, "must be at least TransferMapMinKineticEnergy, which must be positive.");
+
+	G4double maxSlope = 0.05;
+	name = component->GetFullParmName("TransferMapMaxSlope");
+	if (pM->ParameterExists(name))
+		maxSlope = pM->GetUnitlessParameter(name);
+	if (maxSlope < 0.)
+		HGMETabulation::Abort(pM, name, "must not be negative.");
+
+	G4int nodes[3] = {9, 5, 5};
+	const char* nodeNames[3] = {"TransferMapPositionNodes", "TransferMapSlopeNodes", "TransferMapMomentumNodes"};
+	for (G4int i = 0; i < 3; i++) {
+		name = component->GetFullParmName(nodeNames[i]);
+		if (pM->ParameterExists(name))
+			nodes[i] = pM->GetIntegerParameter(name);
+		if (nodes[i] < 2 || nodes[i] > 65535)
+			HGMETabulation::Abort(pM, name, "must be between 2 and 65535.");
+	}
+
+	HGMETransferMap::Tolerance tolerance;
+	tolerance.position = 0.1 * mm;
+	tolerance.direction = 1.e-3;
+	tolerance.kineticEnergy = 1.e-3;
+	name = component->GetFullParmName("TransferMapPositionTolerance");
+	if (pM->ParameterExists(name))
+		tolerance.position = pM->GetDoubleParameter(name, "Length");
+	name = component->GetFullParmName("TransferMapDirectionTolerance");
+	if (pM->ParameterExists(name))
+		tolerance.direction = pM->GetUnitlessParameter(name);
+	name = component->GetFullParmName("TransferMapEnergyTolerance");
+	if (pM->ParameterExists(name))
+		tolerance.kineticEnergy = pM->GetUnitlessParameter(name);
+	if (tolerance.position <= 0. || tolerance.direction <= 0. || tolerance.kineticEnergy <= 0.)
+		HGMETabulation::Abort(pM, component->GetFullParmName("TransferMapPositionTolerance"), "and the other TransferMap tolerances must be positive.");
+
+	G4int threads = std::max(1U, std::thread::hardware_concurrency());
+	name = component->GetFullParmName("TransferMapThreads");
+	if (pM->ParameterExists(name))
+		threads = std::max(1, pM->GetIntegerParameter(name));
+
+	G4bool useCache = true;
+	G4String cacheDirectory;
+	if (pM->ParameterExists(component->GetFullParmName("TransferMapCache")))
+		useCache = pM->GetBooleanParameter(component->GetFullParmName("TransferMapCache"));
+	if (pM->ParameterExists(component->GetFullParmName("TransferMapCacheDirectory")))
+		cacheDirectory = pM->GetStringParameter(component->GetFullParmName("TransferMapCacheDirectory"));
+
+	// The map only knows the field, so daughters and any material that would
+	// slow down or scatter the particle must not be in the box it skips
+	G4double maxDensity = 1.e-5 * g / cm3;
+	name = component->GetFullParmName("TransferMapMaxDensity");
+	if (pM->ParameterExists(name))
+		maxDensity = pM->GetDoubleParameter(name, "Volumic Mass");
+	G4LogicalVolume* envelope = component->GetEnvelopeLogicalVolume();
+	if (envelope->GetNoDaughters() > 0)
+		HGMETabulation::Abort(pM, component->GetFullParmName("TransferMap"), "needs an envelope without daughter volumes, which the map would skip.");
+	const G4Material* material = envelope->GetMaterial();
+	if (material && material->GetDensity() > maxDensity)
+		HGMETabulation::Abort(pM, component->GetFullParmName("TransferMap"), "needs a vacuum envelope, but " + material->GetName() +
+			  " is denser than TransferMapMaxDensity.");
+
+	if (!model) {
+		if (!envelope->IsRootRegion()) {
+			G4cerr << "" << G4endl;
+			G4cerr << "Topas is exiting due to a serious error." << G4endl;
+			G4cerr << "The transfer map of " << component->GetName() << " needs a region of its own." << G4endl;
+			G4cerr << "Set " << component->GetFullParmName("AssignToRegionNamed") << " to a region holding only this component." << G4endl;
+			pM->AbortSession(1);
+		}
+		model = new HGMETransferMapModel(component->GetName() + "/TransferMap", envelope->GetRegion());
+	}
+
+	// Inverse momentum decreases with the kinetic energy
+	HGMETransferMap::Grid grid;
+	std::shared_ptr<HGMETransferMap> map = std::make_shared<HGMETransferMap>(magnetic, electric,
+		particle->GetPDGCharge(), particle->GetPDGMass());
+	if (!map->IsBounded())
+		HGMETabulation::Abort(pM, component->GetFullParmName("TransferMap"), "needs maps bounded along every axis.");
+	const G4double mass = particle->GetPDGMass();
+	const G4double limits[HGMETransferMap::kAxes][2] = {
+		{map->GetMin()[0], map->GetMax()[0]}, {map->GetMin()[1], map->GetMax()[1]},
+		{-maxSlope, maxSlope}, {-maxSlope, maxSlope},
+		{1. / std::sqrt(energy[1] * (energy[1] + 2. * mass)), 1. / std::sqrt(energy[0] * (energy[0] + 2. * mass))}};
+	const G4int axisNodes[HGMETransferMap::kAxes] = {nodes[0], nodes[0], nodes[1], nodes[1], nodes[2]};
+	for (G4int axis = 0; axis < HGMETransferMap::kAxes; axis++) {
+		grid.min[axis] = limits[axis][0];
+		grid.max[axis] = limits[axis][1];
+		grid.nodes[axis] = grid.max[axis] > grid.min[axis] ? axisNodes[axis] : 1;
+	}
+
+	std::ostringstream options;
+	options << std::setprecision(17) << "particle " << particleName;
+	for (G4int axis = 0; axis < HGMETransferMap::kAxes; axis++)
+		options << " " << grid.nodes[axis] << " " << grid.min[axis] << " " << grid.max[axis];
+	options << " tolerance " << tolerance.position << " " << tolerance.direction << " " << tolerance.kineticEnergy;
+
+	std::ostringstream description;
+	description << options.str();
+	uint64_t unused = 0;
+	DescribeMaps(description, "magnetic", magnetic, true, unused);
+	DescribeMaps(description, "electric", electric, true, unused);
+
+	const std::shared_ptr<const HGMETransferMap> sharedMap = HGMETabulation::SharedTables<HGMETransferMap>::Get(
+		component->GetName(), description.str(), [&]() {
+		std::ostringstream content;
+		content << options.str();
+		uint64_t hash = HGMEFieldMapLoader::Hash(0, 0);
+		DescribeMaps(content, "magnetic", magnetic, false, hash);
+		DescribeMaps(content, "electric", electric, false, hash);
+		const uint64_t key = HGMEFieldMapLoader::Hash(content.str().data(), content.str().size(), hash);
+		const G4String cacheName = HGMETabulation::CacheName(cacheDirectory, "HGMETransferMap", key);
+
+		if (useCache && HGMETabulation::ReadCache(cacheName, [&](std::istream& cache) { return map->Read(cache, key); })) {
+			G4cout << component->GetName() << ": read transfer map " << cacheName << G4endl;
+		} else {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			map->Build(grid, tolerance, threads);
+			G4cout << component->GetName() << ": built the transfer map of " << particleName << " in "
+			<< std::chrono::duration<G4double>(std::chrono::steady_clock::now() - start).count() << " s on "
+			<< threads << " threads" << G4endl;
+			if (useCache)
+				HGMETabulation::WriteCache(cacheName, "transfer map", [&](std::ostream& cache) { map->Write(cache, key); });
+		}
+
+		const size_t cells = map->GetNumberOfCells();
+		G4cout << component->GetName() << ": transfer map of " << cells << " cells, "
+		<< std::fixed << std::setprecision(1) << (cells > 0 ? 100. * map->GetNumberOfValidCells() / cells : 0.)
+		<< std::defaultfloat << std::setprecision(6) << "% within tolerance, largest deviation "
+		<< map->GetMaxDeviation() / mm << " mm at the cell centres" << G4endl;
+		return std::shared_ptr<const HGMETransferMap>(map);
+	});
+	model->SetMap(sharedMap, particle);
+	return model;
+}
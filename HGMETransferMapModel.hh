@@ -0,0 +1,81 @@
+//
+// ********************************************************************
+// *                                                                  *
+// * Copyright 2022 The TOPAS Collaboration                           *
+// *                                                                  *
+// * Permission is hereby granted, free of charge, to any person      *
+// * obtaining a copy of this software and associated documentation   *
+// * files (the "Software"), to deal in the Software without          *
+// * restriction, including without limitation the rights to use,     *
+// * copy, modify, merge, publish, distribute, sublicense, and/or     *
+// * sell copies of the Software, and to permit persons to whom the   *
+// * Software is furnished to do so, subject to the following         *
+// * conditions:                                                      *
+// *                                                                  *
+// * The above copyright notice and this permission notice shall be   *
+// * included in all copies or substantial portions of the Software.  *
+// *                                                                  *
+// * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,  *
+// * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES  *
+// * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND         *
+// * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT      *
+// * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,     *
+// * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING     *
+// * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR    *
+// * OTHER DEALINGS IN THE SOFTWARE.                                  *
+// *                                                                  *
+// ********************************************************************
+//
+
+#ifndef HGMETransferMapModel_hh
+#define HGMETransferMapModel_hh
+
+#include "HGMETransferMap.hh"
+
+#include "G4VFastSimulationModel.hh"
+
+#include <memory>
+
+class TsParameterManager;
+class TsVGeometryComponent;
+
+// Fast simulation model of the envelope of a mapped-field component that
+// moves particles of one species across the box of its maps in a single
+// step, with the exit state of an HGMETransferMap. It applies to particles
+// that enter the envelope upstream of the box and head for its upstream
+// face, and leaves every other particle, and those whose entry state the
+// map does not cover, to full tracking.
+//
+// The envelope must be the root of its own region and the physics list must
+// include fast simulation. Interactions and daughter volumes inside the box
+// are ignored, so it is meant for vacuum or gas filled field regions.
+class HGMETransferMapModel : public G4VFastSimulationModel
+{
+public:
+	HGMETransferMapModel(const G4String& name, G4Region* region);
+	~HGMETransferMapModel();
+
+	// Map shared by the threads, or null to track every particle
+	void SetMap(const std::shared_ptr<const HGMETransferMap>& map, const G4ParticleDefinition* particle);
+
+	G4bool IsApplicable(const G4ParticleDefinition& particle);
+	G4bool ModelTrigger(const G4FastTrack& track);
+	void DoIt(const G4FastTrack& track, G4FastStep& step);
+
+	// Sets up or updates the model of a component when TransferMap is set,
+	// building the map once per process or reading it from the cache, and
+	// returns it, or model as it is otherwise. Either map may be null.
+	static HGMETransferMapModel* Configure(TsParameterManager* pM, TsVGeometryComponent* component,
+										   const HGMEFieldRegions* magnetic, const HGMEFieldRegions* electric,
+										   HGMETransferMapModel* model);
+
+private:
+	std::shared_ptr<const HGMETransferMap> fMap;
+	const G4ParticleDefinition* fParticle;
+	G4Region* fRegion;
+
+	// Exit state found by ModelTrigger for DoIt
+	HGMETransferMap::State fExit;
+};
+
+#endif
@@ -32,10 +32,13 @@
 
 #include "TsVMagneticField.hh"
 
-#include "G4AffineTransform.hh"
+#include "HGMEFieldMapEngine.hh"
 
-#include <vector>
+class HGMEFieldEnvelope;
+class HGMEFieldManager;
 
+// Mapped magnetic field. The maps are those of HGMEFieldMapEngine, the
+// integrator the one TOPAS attaches.
 class TsMagneticFieldMap : public TsVMagneticField
 {
 public:
@@ -46,27 +49,18 @@ public:
 	void GetFieldValue(const double p[3], double* Field) const;
 	void ResolveParameters();
 
-private:
-	// Physical limits of the defined region
-	G4double fMinX, fMinY, fMinZ, fMaxX, fMaxY, fMaxZ;
-
-	// Physical extent of the defined region
-	G4double fDX, fDY, fDZ;
-
-	// Allows handling of either direction of min and max positions
-	G4bool fInvertX, fInvertY, fInvertZ;
+	// Mapped field at a point of the world and its derivatives dF_i/dx_j in
+	// gradient[3 * i + j], both in the world frame, from a single lookup of
+	// the table. The derivatives are those of the interpolant.
+	void GetFieldValueAndGradient(const G4double point[4], G4double field[3], G4double gradient[9]) const;
 
-	// Dimensions of the table
-	G4int fNX, fNY, fNZ;
-
-	// Storage for the table
-	std::vector< std::vector< std::vector< double > > > fFieldX;
-	std::vector< std::vector< std::vector< double > > > fFieldY;
-	std::vector< std::vector< std::vector< double > > > fFieldZ;
+private:
+	HGMEFieldMapEngine<3, HGMEMagneticSlots> fEngine;
 
-	// Affine transformation to the world to resolve the position/rotation
-	// when a daughter is placed in a mother holding the field
-	G4AffineTransform fAffineTransf;
+	// Where the maps have field, null when FieldEnvelope is off, and the
+	// manager applying it in place of the one TOPAS gave the envelope
+	HGMEFieldEnvelope* fEnvelope;
+	HGMEFieldManager* fFieldManager;
 };
 
 #endif